@@ -58,6 +58,12 @@
   *
   *   ```
   *
+  *  Real-time mode:
+  *
+  *  MTCircularBuffer< T, MTCircularBufferRTSync > protects the buffer with PTHREAD_PRIO_INHERIT
+  *  mutexes. Together with the try_* methods (that return an AcquireResult instead of throwing)
+  *  no code path allocates memory after construction.
+  *
   *
   * The MIT License (MIT)
   * Copyright (c) 2015 Filippo Bergamasco
@@ -90,65 +96,423 @@
 #endif
 
 
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/has_trivial_copy.hpp>
 #include <boost/thread/condition.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <cstring>
 #include <sstream>
 #include <vector>
-#include <queue>
+
+#if __cplusplus >= 202002L
+    #include <cstddef>
+    #include <iterator>
+    #include <memory>
+    #include <ranges>
+    #if defined(__cpp_lib_ranges)
+        #define MT_CIRCULAR_BUFFER_HAS_RANGES 1
+    #endif
+#endif
+
+#if !defined(_WIN32)
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
 
 #define DEFAULT_LOCK_TIMEOUT_SEC 1
 #undef MT_CIRCULAR_BUFFER_DEBUG
 
-template < typename T >
+#define MT_CIRCULAR_BUFFER_CACHE_LINE 64
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define MT_CIRCULAR_BUFFER_PREFETCH_READ( addr ) __builtin_prefetch( (addr), 0, 3 )
+    #define MT_CIRCULAR_BUFFER_PREFETCH_WRITE( addr ) __builtin_prefetch( (addr), 1, 3 )
+#elif defined(_MSC_VER) && ( defined(_M_IX86) || defined(_M_X64) )
+    #include <xmmintrin.h>
+    #define MT_CIRCULAR_BUFFER_PREFETCH_READ( addr ) _mm_prefetch( (const char*)(addr), _MM_HINT_T0 )
+    #define MT_CIRCULAR_BUFFER_PREFETCH_WRITE( addr ) _mm_prefetch( (const char*)(addr), _MM_HINT_T0 )
+#else
+    #define MT_CIRCULAR_BUFFER_PREFETCH_READ( addr )
+    #define MT_CIRCULAR_BUFFER_PREFETCH_WRITE( addr )
+#endif
+
+
+/**
+ * @brief MTFixedQueue is a FIFO whose storage is allocated once, at construction (or by reset).
+ *        Pushing into a full queue drops the oldest item. The queue must be externally locked, but
+ *        size() can also be read without locking, to get an approximate value.
+ */
+template< typename V >
+class MTFixedQueue : private boost::noncopyable
+{
+public:
+    inline explicit MTFixedQueue( size_t capacity ) : items( capacity>0 ? capacity : 1 ), head(0), count(0) {}
+
+    inline bool empty() const { return size()==0; }
+    inline size_t size() const { return count.load( boost::memory_order_relaxed ); }
+    inline size_t capacity() const { return items.size(); }
+    inline V front() const { return items[head]; }
+    inline V at( size_t i ) const { return items[ (head+i)%items.size() ]; }
+    inline V back() const { return items[ (head+size()-1)%items.size() ]; }
+
+    /**
+     * @return true if the oldest item was dropped to make room for v
+     */
+    inline bool push( V v )
+    {
+        const bool full = size()==items.size();
+        if( full )
+            pop();
+        items[ (head+size())%items.size() ] = v;
+        count.store( size()+1, boost::memory_order_relaxed );
+        return full;
+    }
+    inline void pop()
+    {
+        head = (head+1)%items.size();
+        count.store( size()-1, boost::memory_order_relaxed );
+    }
+
+    /**
+     * @brief remove removes the oldest occurrence of v, keeping the order of the other items
+     * @return false if v is not queued
+     */
+    inline bool remove( V v )
+    {
+        for( size_t i=0; i<size(); ++i )
+        {
+            if( !( at(i)==v ) )
+                continue;
+            if( i==0 )
+            {
+                pop();
+                return true;
+            }
+            for( size_t j=i+1; j<size(); ++j )
+                items[ (head+j-1)%items.size() ] = at(j);
+            count.store( size()-1, boost::memory_order_relaxed );
+            return true;
+        }
+        return false;
+    }
+    inline void clear() { head=0; count.store( 0, boost::memory_order_relaxed ); }
+    inline void reset( size_t capacity )
+    {
+        items.assign( capacity>0 ? capacity : 1, V() );
+        clear();
+    }
+    inline void swap( MTFixedQueue& other )
+    {
+        items.swap( other.items );
+        std::swap( head, other.head );
+        const size_t n = size();
+        count.store( other.size(), boost::memory_order_relaxed );
+        other.count.store( n, boost::memory_order_relaxed );
+    }
+
+private:
+    std::vector< V > items;
+    size_t head;
+    boost::atomic< size_t > count;  // written with the queue locked, may be read without locking
+};
+
+
+/**
+ * @brief MTCircularBufferDefaultSync selects the boost::thread primitives used to protect the
+ *        buffer. Readers of the same slot share the slot lock.
+ */
+struct MTCircularBufferDefaultSync
+{
+    typedef boost::shared_mutex slot_mutex;
+    typedef boost::timed_mutex main_mutex;
+    typedef boost::mutex data_mutex;
+    typedef boost::condition_variable data_condition;
+};
+
+
+#if ( defined(__GNUC__) || defined(__clang__) ) && ( defined(__x86_64__) || defined(__i386__) )
+    #include <immintrin.h>
+    #define MT_CIRCULAR_BUFFER_HAS_STREAM_COPY 1
+#endif
+
+/**
+ * @brief MTStreamCopy copies large blocks with non-temporal stores, so that the destination does
+ *        not pollute the cache of the copying core. AVX stores are used if the CPU supports them
+ *        (checked at runtime), SSE2 stores otherwise. On other architectures, or for blocks
+ *        smaller than MTStreamCopy::MIN_STREAM_BYTES, it falls back to memcpy.
+ */
+struct MTStreamCopy
+{
+    enum { MIN_STREAM_BYTES = 16*1024 };
+
+    static inline void copy( void* dst, const void* src, size_t n )
+    {
+#if defined(MT_CIRCULAR_BUFFER_HAS_STREAM_COPY)
+        if( n >= MIN_STREAM_BYTES )
+        {
+            if( has_avx() )
+                copy_avx( static_cast<char*>(dst), static_cast<const char*>(src), n );
+            else
+                copy_sse2( static_cast<char*>(dst), static_cast<const char*>(src), n );
+            return;
+        }
+#endif
+        std::memcpy( dst, src, n );
+    }
+
+#if defined(MT_CIRCULAR_BUFFER_HAS_STREAM_COPY)
+    static inline bool has_avx()
+    {
+        static const bool avx = __builtin_cpu_supports("avx");
+        return avx;
+    }
+
+private:
+    static inline size_t unaligned_head( const char* dst, size_t alignment, size_t n )
+    {
+        const size_t misalignment = reinterpret_cast<size_t>(dst) & (alignment-1);
+        const size_t head = misalignment ? alignment-misalignment : 0;
+        return head < n ? head : n;
+    }
+
+    __attribute__((target("avx")))
+    static inline void copy_avx( char* dst, const char* src, size_t n )
+    {
+        const size_t head = unaligned_head( dst, 32, n );
+        std::memcpy( dst, src, head );
+        dst += head; src += head; n -= head;
+
+        for( ; n>=128; n-=128, dst+=128, src+=128 )
+        {
+            const __m256i a = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(src) );
+            const __m256i b = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(src+32) );
+            const __m256i c = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(src+64) );
+            const __m256i d = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(src+96) );
+            _mm256_stream_si256( reinterpret_cast<__m256i*>(dst), a );
+            _mm256_stream_si256( reinterpret_cast<__m256i*>(dst+32), b );
+            _mm256_stream_si256( reinterpret_cast<__m256i*>(dst+64), c );
+            _mm256_stream_si256( reinterpret_cast<__m256i*>(dst+96), d );
+        }
+        _mm_sfence();
+        std::memcpy( dst, src, n );
+    }
+
+    __attribute__((target("sse2")))
+    static inline void copy_sse2( char* dst, const char* src, size_t n )
+    {
+        const size_t head = unaligned_head( dst, 16, n );
+        std::memcpy( dst, src, head );
+        dst += head; src += head; n -= head;
+
+        for( ; n>=64; n-=64, dst+=64, src+=64 )
+        {
+            const __m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src) );
+            const __m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src+16) );
+            const __m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src+32) );
+            const __m128i d = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src+48) );
+            _mm_stream_si128( reinterpret_cast<__m128i*>(dst), a );
+            _mm_stream_si128( reinterpret_cast<__m128i*>(dst+16), b );
+            _mm_stream_si128( reinterpret_cast<__m128i*>(dst+32), c );
+            _mm_stream_si128( reinterpret_cast<__m128i*>(dst+48), d );
+        }
+        _mm_sfence();
+        std::memcpy( dst, src, n );
+    }
+#endif
+};
+
+
+#if defined(_POSIX_THREAD_PRIO_INHERIT) && _POSIX_THREAD_PRIO_INHERIT > 0
+    #define MT_CIRCULAR_BUFFER_HAS_RT 1
+
+/**
+ * @brief MTPIMutex is a timed mutex created with the PTHREAD_PRIO_INHERIT protocol, so that
+ *        a low priority thread holding it is boosted to the priority of the highest waiter.
+ *
+ *        The shared locking interface is provided to be used as a slot mutex, but it is
+ *        exclusive: POSIX read-write locks do not support priority inheritance, so concurrent
+ *        readers of the same slot are serialized.
+ */
+class MTPIMutex : private boost::noncopyable
+{
+public:
+    inline MTPIMutex()
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init( &attr );
+        pthread_mutexattr_setprotocol( &attr, PTHREAD_PRIO_INHERIT );
+        pthread_mutex_init( &mtx, &attr );
+        pthread_mutexattr_destroy( &attr );
+    }
+    inline ~MTPIMutex() { pthread_mutex_destroy( &mtx ); }
+
+    inline void lock() { pthread_mutex_lock( &mtx ); }
+    inline void unlock() { pthread_mutex_unlock( &mtx ); }
+    inline bool try_lock() { return pthread_mutex_trylock( &mtx )==0; }
+    inline bool timed_lock( const boost::system_time& abs_time )
+    {
+        const timespec ts = to_timespec( abs_time );
+        return pthread_mutex_timedlock( &mtx, &ts )==0;
+    }
+    template< typename TimeDuration >
+    inline bool timed_lock( const TimeDuration& rel_time ) { return timed_lock( boost::get_system_time()+rel_time ); }
+
+    inline void lock_shared() { lock(); }
+    inline void unlock_shared() { unlock(); }
+    inline bool try_lock_shared() { return try_lock(); }
+    inline bool timed_lock_shared( const boost::system_time& abs_time ) { return timed_lock( abs_time ); }
+    template< typename TimeDuration >
+    inline bool timed_lock_shared( const TimeDuration& rel_time ) { return timed_lock( rel_time ); }
+
+    inline pthread_mutex_t* native_handle() { return &mtx; }
+
+    static inline timespec to_timespec( const boost::system_time& abs_time )
+    {
+        const boost::posix_time::time_duration since_epoch = abs_time - boost::posix_time::from_time_t(0);
+        timespec ts;
+        ts.tv_sec = static_cast<time_t>( since_epoch.total_seconds() );
+        ts.tv_nsec = static_cast<long>( since_epoch.fractional_seconds() * (1000000000 / boost::posix_time::time_duration::ticks_per_second()) );
+        return ts;
+    }
+
+private:
+    pthread_mutex_t mtx;
+};
+
+/**
+ * @brief MTPICondition is a condition variable to be used together with MTPIMutex
+ */
+class MTPICondition : private boost::noncopyable
+{
+public:
+    inline MTPICondition() { pthread_cond_init( &cond, 0 ); }
+    inline ~MTPICondition() { pthread_cond_destroy( &cond ); }
+
+    inline bool timed_wait( boost::unique_lock< MTPIMutex >& lk, const boost::system_time& abs_time )
+    {
+        const timespec ts = MTPIMutex::to_timespec( abs_time );
+        return pthread_cond_timedwait( &cond, lk.mutex()->native_handle(), &ts )==0;
+    }
+    inline void notify_one() { pthread_cond_signal( &cond ); }
+    inline void notify_all() { pthread_cond_broadcast( &cond ); }
+
+private:
+    pthread_cond_t cond;
+};
+
+/**
+ * @brief MTCircularBufferRTSync selects priority-inheritance primitives for all the locks of
+ *        the buffer. Use it together with the try_* methods, that never allocate or throw:
+ *
+ *        MTCircularBuffer< int, MTCircularBufferRTSync > buff(10);
+ */
+struct MTCircularBufferRTSync
+{
+    typedef MTPIMutex slot_mutex;
+    typedef MTPIMutex main_mutex;
+    typedef MTPIMutex data_mutex;
+    typedef MTPICondition data_condition;
+};
+
+#endif
+
+
+template < typename T, typename SYNC = MTCircularBufferDefaultSync >
 class MTCircularBuffer : private boost::noncopyable
 {
 public:
 
+    typedef typename SYNC::slot_mutex slot_mutex_type;
+    typedef typename SYNC::main_mutex main_mutex_type;
+    typedef typename SYNC::data_mutex data_mutex_type;
+    typedef typename SYNC::data_condition data_condition_type;
+
+    /**
+     * @brief seq_type is the type of the global ordinal given to each written item. The first item
+     *        written in the buffer has sequence number 0.
+     */
+    typedef boost::uint64_t seq_type;
+
     struct ACCESS_OPT_WRITE;
     struct ACCESS_OPT_READ;
     struct ACCESS_OPT_CONSUME;
+    struct ACCESS_OPT_PEEK;
+
+private:
+    struct Ring;
+
+public:
 
     template< typename LOCK_TYPE, typename OPT >
     class BufferSlotAccess : private boost::noncopyable
     {
     public:
         friend class MTCircularBuffer;
-        BufferSlotAccess() :  _slot(-1), slot(_slot), srcBuffer(0), data(0) {}
-        BufferSlotAccess( size_t req_slot ) :  _slot(req_slot), slot(_slot), srcBuffer(0), data(0) {}
+        BufferSlotAccess() :  data(0), tag(0), repeats(0), slot(_slot), seq(_seq), _slot(-1), _seq(-1), srcBuffer(0), ring(0) {}
+        BufferSlotAccess( size_t req_slot ) :  data(0), tag(0), repeats(0), slot(_slot), seq(_seq), _slot(req_slot), _seq(-1), srcBuffer(0), ring(0) {}
 
         T* data;
+        boost::uint32_t tag;    // user tag of the slot, set by the producer before releasing write access
+        boost::uint32_t repeats;// number of identical items written after this one (see enable_dedup)
         inline ~BufferSlotAccess()
+        {
+            release();
+        }
+
+        /**
+         * @brief release Releases the slot before the access is destroyed. The access can then be
+         *        granted again
+         */
+        inline void release()
         {
             data = 0;
             if( srcBuffer )
                 srcBuffer->release_slot_access( *this );
+            srcBuffer = 0;
+            if( slot_lock.owns_lock() )
+                slot_lock.unlock();
+            if( ring )
+                ring->n_refs--;  // after unlocking: the ring may be deleted as soon as it is unreferenced
+            ring = 0;
         }
 
         const size_t& slot;
+        const seq_type& seq;    // sequence number of the item stored in the slot
 
     private:
         LOCK_TYPE slot_lock;
         size_t _slot;
+        seq_type _seq;
         MTCircularBuffer* srcBuffer;
+        Ring* ring;
     };
 
     /**
      * @brief BufferSlotWriteAccess provides exclusive write access to a buffer slot
      */
-    typedef BufferSlotAccess< boost::unique_lock< boost::shared_mutex >, ACCESS_OPT_WRITE   > BufferSlotWriteAccess;
+    typedef BufferSlotAccess< boost::unique_lock< slot_mutex_type >, ACCESS_OPT_WRITE   > BufferSlotWriteAccess;
     /**
      * @brief BufferSlotReadAccess provides shared read access to a buffer slot.
      * The slot is not consumed after BufferSlotReadAccess destruction
      */
-    typedef BufferSlotAccess< boost::shared_lock< boost::shared_mutex >, ACCESS_OPT_READ    > BufferSlotReadAccess;
+    typedef BufferSlotAccess< boost::shared_lock< slot_mutex_type >, ACCESS_OPT_READ    > BufferSlotReadAccess;
     /**
      * @brief BufferSlotConsumeAccess provides shared read access to a buffer slot.
      * The slot is consumed after BufferSlotConsumeAccess destruction
      */
-    typedef BufferSlotAccess< boost::shared_lock< boost::shared_mutex >, ACCESS_OPT_CONSUME > BufferSlotConsumeAccess;
+    typedef BufferSlotAccess< boost::shared_lock< slot_mutex_type >, ACCESS_OPT_CONSUME > BufferSlotConsumeAccess;
+    /**
+     * @brief BufferSlotPeekAccess provides shared read access to the least recently produced slot
+     * without consuming it. It can be converted into a BufferSlotConsumeAccess (see consume_peeked)
+     */
+    typedef BufferSlotAccess< boost::shared_lock< slot_mutex_type >, ACCESS_OPT_PEEK    > BufferSlotPeekAccess;
 
 
 
@@ -161,181 +525,1554 @@ public:
      */
     class DataAvailableTimeout : boost::exception {};
 
-
     /**
-     * @brief MTCircularBuffer constructs a new MTCircularBuffer of a given size
-     * @param size Buffer size
+     * @brief AcquireResult is returned by the try_* methods, that report failures without throwing
      */
-    inline explicit MTCircularBuffer( size_t size ) : buff( size ) , buff_desc( size ), curr_w_slot(0)
-	{ 
-		for( size_t i=0; i<buff_desc.size(); ++i )
-		{
-			buff_desc[i] = new BufferSlotDescriptor();
-            buff_desc[i]->writing = false;
-            buff_desc[i]->n_reading = 0;
-        }
-	}
+    enum AcquireResult
+    {
+        ACQUIRE_OK = 0,
+        ACQUIRE_SLOT_TIMEOUT,   // a timeout occurred while locking a slot (see SlotAcqTimeout)
+        ACQUIRE_DATA_TIMEOUT,   // a timeout occurred before data become available (see DataAvailableTimeout)
+        ACQUIRE_TOO_OLD,        // the requested item has already been overwritten (or discarded by clear)
+        ACQUIRE_NOT_YET         // the requested item has not been written yet
+    };
 
     /**
-     * @brief Discards all dirty slots and resets all the buffer slots (NOTE: this method
-     *        is intented to be called when no other thread is accessing the buffer)
-     *
+     * @brief StartPosition selects the first item returned to a HistoryReader
      */
-    inline void clear()
+    enum StartPosition
     {
-        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        START_OLDEST,   // the oldest item still stored in the buffer
+        START_NEWEST    // the most recently written item
+    };
 
-        // Advance to next slot (we need to lock the entire circular buffer to change curr_w_slot)
-        boost::unique_lock< boost::timed_mutex > sc_lock( main_mtx, lock_timeout  );
-        if( !sc_lock.owns_lock() ) //owns_lock is false if lock failed (probably timeout has occurred)
-        {
-            throw SlotAcqTimeout();
-        }
+    /**
+     * @brief HistoryReader is a cursor iterating forward over the buffer history, in write order,
+     *        without consuming it (see subscribe and read_next). Each reader is meant to be used
+     *        by a single thread.
+     */
+    class HistoryReader
+    {
+    public:
+        friend class MTCircularBuffer;
+        HistoryReader() : next(0), missed(0) {}
 
-        while( !dirty_slots.empty() )
-            dirty_slots.pop();
+        /**
+         * @return sequence number of the next item that will be read
+         */
+        inline seq_type position() const { return next; }
 
-        for( size_t i=0; i<buff_desc.size(); ++i )
-        {
-            buff_desc[i]->is_dirty = false;
-        }
+        /**
+         * @return number of items skipped because they were overwritten before being read
+         */
+        inline seq_type num_missed() const { return missed; }
 
-        curr_w_slot = 0;
+    private:
+        seq_type next;
+        seq_type missed;
+    };
 
-    }
 
     /**
-     * @return number of buffer slots
+     * @brief FilteredSubscription is an independent consumer of the items whose tag (see
+     *        BufferSlotAccess::tag) matches a predicate. The predicate is evaluated by the producer
+     *        when write access is released, so the subscriber is only woken up for matching items;
+     *        non matching items are skipped without waking it (see subscribe and consume_next_matching).
      */
-	inline size_t size() const { return buff.size(); }
+    class FilteredSubscription : private boost::noncopyable
+    {
+    public:
+        friend class MTCircularBuffer;
+        typedef boost::function< bool ( boost::uint32_t ) > predicate_type;
 
+        explicit FilteredSubscription( const predicate_type& _pred ) : pred(_pred), pending(1), owner(0), missed(0), filtered(0) {}
+        inline ~FilteredSubscription()
+        {
+            if( owner )
+                owner->unsubscribe( *this );
+        }
+
+        /**
+         * @return number of matching items overwritten before being consumed
+         */
+        inline seq_type num_missed() const { return missed; }
+
+        /**
+         * @return number of items skipped because their tag did not match
+         */
+        inline seq_type num_filtered() const { return filtered; }
+
+    private:
+        predicate_type pred;
+        MTFixedQueue< seq_type > pending;
+        data_condition_type matched;
+        MTCircularBuffer* owner;
+        seq_type missed;
+        seq_type filtered;
+    };
 
     /**
-     * @brief write_next Gain exclusive write access to the next available slot
-     * @param acc A BufferSlotWriteAccess that will represent slot ownership
-     * @param overwrite_occurred is set to true if write access is given to a non consumed slot
+     * @brief FrozenRing is a consistent, read-only copy of the whole buffer obtained with freeze().
+     *        The items with sequence numbers in [first_seq,end_seq) can be read at leisure, without
+     *        locking, while the producer keeps writing. The storage is given back to the buffer when
+     *        the FrozenRing is released or destroyed.
      */
-    inline void write_next( BufferSlotWriteAccess& acc, bool* overwrite_occurred=0 )
-	{
-        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+    class FrozenRing : private boost::noncopyable
+    {
+    public:
+        friend class MTCircularBuffer;
+        FrozenRing() : srcBuffer(0), items(0), n_slots(0), base(0), first(0), end(0) {}
+        inline ~FrozenRing() { release(); }
 
-        boost::unique_lock< boost::shared_mutex > um(buff_desc[curr_w_slot]->slot_mtx , lock_timeout );
-        if( !um.owns_lock() ) //owns_lock is false if lock failed (probably timeout has occurred)
+        /**
+         * @return the frozen item with sequence number seq, or 0 if seq is not in [first_seq,end_seq)
+         */
+        inline const T* operator()( seq_type seq ) const
         {
-            throw SlotAcqTimeout();
+            if( seq<first || seq>=end )
+                return 0;
+            return items + static_cast<size_t>( (seq-base)%n_slots );
         }
 
-        if( overwrite_occurred != 0 )
-            *overwrite_occurred = buff_desc[curr_w_slot]->is_dirty;
-
-        acc._slot = curr_w_slot;
-        acc.data = &(buff[curr_w_slot]);
-        acc.srcBuffer = this;
-        buff_desc[curr_w_slot]->writing = true;
-        acc.slot_lock.swap( um );
+        inline seq_type first_seq() const { return first; }
+        inline seq_type end_seq() const { return end; }
+        inline bool valid() const { return srcBuffer!=0; }
 
-        // Advance to next slot (we need to lock the entire circular buffer to change curr_w_slot)
-        boost::unique_lock< boost::timed_mutex > sc_lock( main_mtx, lock_timeout  );
-        if( !sc_lock.owns_lock() ) //owns_lock is false if lock failed (probably timeout has occurred)
+        /**
+         * @brief release Gives the frozen storage back to the buffer
+         */
+        inline void release()
         {
-            throw SlotAcqTimeout();
+            if( srcBuffer )
+                srcBuffer->thaw();
+            srcBuffer = 0;
+            items = 0;
+            first = end = 0;
         }
-        curr_w_slot = (++curr_w_slot)%buff.size();
-    }
 
+    private:
+        MTCircularBuffer* srcBuffer;
+        const T* items;
+        size_t n_slots;
+        seq_type base;
+        seq_type first;
+        seq_type end;
+    };
 
     /**
-     * @brief read_slot Gain shared read access to a given slot
-     * @param slot Slot number
-     * @param acc A BufferSlotReadAccess that will represent slot ownership
+     * @brief Snapshot is a reference to a published item that does not lock its slot (see
+     *        read_newest_snapshot). It can be held for any time: when the slot is written again the
+     *        producer moves to a spare storage cell, and the pinned cell is recycled when the last
+     *        Snapshot referencing it is released.
      */
-    inline void read_slot( const size_t slot, BufferSlotReadAccess& acc )
+    class Snapshot : private boost::noncopyable
     {
-        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
-        boost::shared_lock< boost::shared_mutex > um(buff_desc[slot]->slot_mtx , boost::get_system_time()+lock_timeout );
-        if( !um.owns_lock() ) //owns_lock is false if lock failed
+    public:
+        friend class MTCircularBuffer;
+        Snapshot() : data(0), seq(INVALID_SEQ), tag(0), srcBuffer(0), ring(0), cell(0) {}
+        inline ~Snapshot() { release(); }
+
+        inline void release()
         {
-            throw SlotAcqTimeout();
+            if( srcBuffer )
+                srcBuffer->release_snapshot( *this );
+            data = 0;
+            srcBuffer = 0;
+            ring = 0;
         }
 
-        acc._slot = slot ;
-        acc.data = &(buff[slot]);
-        acc.srcBuffer = this;
-        buff_desc[slot]->n_reading++;
-        acc.slot_lock.swap( um );
-    }
+        const T* data;
+        seq_type seq;
+        boost::uint32_t tag;
+
+    private:
+        MTCircularBuffer* srcBuffer;
+        Ring* ring;
+        size_t cell;
+    };
 
     /**
-     * @brief read_newest_available Gain shared read access to the most recently produced slot
-     * @param acc A BufferSlotReadAccess that will represent slot ownership
-     *            If acc.slot is equal to the newest available slot, this method waits until
-     *            a new slot become available (or a DataAvailableTimeout is raised). This is
-     *            useful to avoid reading the same slot more than once
+     * @brief AckToken is an item consumed without holding its slot lock (see
+     *        consume_next_available( AckToken& )). The item stays valid, and its slot is not written
+     *        again, until it is acknowledged with ack(). Tokens can be copied and handed to other
+     *        threads, but each item must be acknowledged exactly once.
      */
-    inline void read_newest_available( BufferSlotReadAccess& acc )
+    class AckToken
     {
-        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
-        boost::unique_lock< boost::mutex > data_available_lock( data_available_mutex );
+    public:
+        friend class MTCircularBuffer;
+        AckToken() : data(0), seq(INVALID_SEQ), tag(0), srcBuffer(0), slot(0) {}
 
-        // wait until some data is available
-        while( dirty_slots.empty() ||  (acc.slot == dirty_slots.back()) )
-        {
-            if( !data_available.timed_wait( data_available_lock, boost::get_system_time()+lock_timeout ) )
-            {
-                throw DataAvailableTimeout();
-            }
-        }
+        inline bool valid() const { return srcBuffer!=0; }
 
-        const size_t slot = dirty_slots.back();
-        boost::shared_lock< boost::shared_mutex > um(buff_desc[slot]->slot_mtx , boost::get_system_time()+lock_timeout );
-        if( !um.owns_lock() ) //owns_lock is false if lock failed
-        {
-            throw SlotAcqTimeout();
-        }
+        T* data;
+        seq_type seq;
+        boost::uint32_t tag;
 
-        acc._slot = slot;
-        acc.data = &(buff[slot]);
-        acc.srcBuffer = this;
-        buff_desc[slot]->n_reading++;
-        acc.slot_lock.swap( um );
-    }
+    private:
+        MTCircularBuffer* srcBuffer;
+        size_t slot;
+    };
 
     /**
-     * @brief consume_next_available Gain shared read access to the least recently produced slot
-     * @param acc A BufferSlotConsumeAccess that will represent slot ownership
+     * @brief ConsumerMetrics collects the metrics of the consumer threads registered with it (see
+     *        register_consumer): a single consumer, or a group of consumers sharing it. Each update is
+     *        also forwarded to the group passed to the constructor, if any, so that both views are
+     *        available. Counters are atomic and can be read at any time from any thread (see sample).
      */
-    inline void consume_next_available( BufferSlotConsumeAccess& acc )
+    class ConsumerMetrics : private boost::noncopyable
     {
-        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
-        boost::unique_lock< boost::mutex > data_available_lock( data_available_mutex );
+    public:
+        friend class MTCircularBuffer;
 
-        // wait until some data is available
-        while( dirty_slots.empty() )
+        /**
+         * @brief Consumed items are counted in LAG_BUCKETS buckets by lag_us: bucket b counts the items
+         *        with lag_us <= 2^b microseconds (and above the previous bound), the last one the others
+         */
+        enum { LAG_BUCKETS = 22 };
+
+        struct Sample
+        {
+            boost::uint64_t n_consumed;
+            boost::uint64_t lag;        // items published after the last consumed item, when it was consumed
+            boost::uint64_t lag_us;     // microseconds between publication and consumption of the last consumed item
+            boost::uint64_t blocked_us; // microseconds spent waiting for items, slots or acknowledgments
+            double rate;                // items consumed per second since the previous sample( true )
+            boost::uint64_t lag_us_buckets[ LAG_BUCKETS ];  // histogram of lag_us (not cumulative)
+            boost::uint64_t lag_us_sum;
+        };
+
+        explicit ConsumerMetrics( ConsumerMetrics* _group = 0 ) : group(_group), n_consumed(0), lag(0), lag_us(0), blocked_us(0),
+            lag_us_sum(0), rate_since( boost::get_system_time() ), rate_since_n(0)
+        {
+            for( size_t b=0; b<LAG_BUCKETS; ++b )
+                lag_us_buckets[b] = 0;
+        }
+
+        /**
+         * @return the upper bound of bucket b in microseconds (the last bucket is unbounded)
+         */
+        static inline boost::uint64_t lag_bucket_bound( size_t b ) { return static_cast< boost::uint64_t >(1) << b; }
+
+        /**
+         * @param restart_rate If true, the next rate is measured from now. Only one thread at a time
+         *        should restart the rate
+         */
+        inline Sample sample( bool restart_rate = false )
         {
-            if( !data_available.timed_wait( data_available_lock, boost::get_system_time() + lock_timeout)  )
+            Sample s;
+            s.n_consumed = n_consumed;
+            s.lag = lag;
+            s.lag_us = lag_us;
+            s.blocked_us = blocked_us;
+            for( size_t b=0; b<LAG_BUCKETS; ++b )
+                s.lag_us_buckets[b] = lag_us_buckets[b];
+            s.lag_us_sum = lag_us_sum;
+            const boost::system_time now = boost::get_system_time();
+            const boost::int64_t elapsed_us = ( now-rate_since ).total_microseconds();
+            s.rate = elapsed_us>0 ? static_cast<double>( s.n_consumed-rate_since_n )*1e6/elapsed_us : 0.0;
+            if( restart_rate )
             {
-                throw DataAvailableTimeout();
+                rate_since = now;
+                rate_since_n = s.n_consumed;
             }
+            return s;
         }
 
-        const size_t slot = dirty_slots.front();
-        boost::shared_lock< boost::shared_mutex > um(buff_desc[slot]->slot_mtx , boost::get_system_time()+lock_timeout );
-        if( !um.owns_lock() ) //owns_lock is false if lock failed
+    private:
+        inline void count( boost::uint64_t items_lag, boost::uint64_t time_lag_us )
         {
-            data_available.notify_all(); // We failed to lock this slot, maybe someone else will succeed
-            throw SlotAcqTimeout();
+            size_t bucket = 0;
+            while( bucket+1<LAG_BUCKETS && time_lag_us > lag_bucket_bound( bucket ) )
+                ++bucket;
+            for( ConsumerMetrics* m=this; m; m=m->group )
+            {
+                m->n_consumed++;
+                m->lag = items_lag;
+                m->lag_us = time_lag_us;
+                m->lag_us_buckets[ bucket ]++;
+                m->lag_us_sum += time_lag_us;
+            }
         }
 
-        // Now we got the access to this slot, so we can safely remove it from the consume queue
-        dirty_slots.pop();
+        inline void count_blocked( boost::uint64_t us )
+        {
+            for( ConsumerMetrics* m=this; m; m=m->group )
+                m->blocked_us += us;
+        }
 
+        ConsumerMetrics* group;
+        boost::atomic< boost::uint64_t > n_consumed;
+        boost::atomic< boost::uint64_t > lag;
+        boost::atomic< boost::uint64_t > lag_us;
+        boost::atomic< boost::uint64_t > blocked_us;
+        boost::atomic< boost::uint64_t > lag_us_buckets[ LAG_BUCKETS ];
+        boost::atomic< boost::uint64_t > lag_us_sum;
+        boost::system_time rate_since;
+        boost::uint64_t rate_since_n;
+    };
+
+    /**
+     * @brief Stats is a snapshot of the buffer counters (see stats()). Counters are cumulative since
+     *        construction, peaks since the previous stats( true ) call.
+     */
+    struct Stats
+    {
+        size_t size;                    // number of slots
+        size_t occupancy;               // items written and not consumed yet
+        size_t peak_occupancy;          // highest occupancy
+        boost::uint64_t peak_lag;       // highest number of items written after an item, when it was consumed
+        boost::uint64_t n_written;      // published items
+        boost::uint64_t n_overwritten;  // items overwritten before being consumed
+        boost::uint64_t n_consumed;
+        boost::uint64_t n_deduplicated;
+        boost::uint64_t n_resizes;
+        size_t recommended_size;        // capacity recommended by a tuner (0 if none, see set_recommended_size)
+    };
+
+    /**
+     * @brief PeakWindow tracks peak_occupancy and peak_lag (see Stats) for an observer that restarts
+     *        them on its own schedule, without resetting the peaks reported by stats() (see watch_peaks)
+     */
+    struct PeakWindow
+    {
+        PeakWindow() : peak_occupancy(0), peak_lag(0) {}
+
+        boost::atomic< size_t > peak_occupancy;
+        boost::atomic< boost::uint64_t > peak_lag;
+    };
+
+    /**
+     * @brief MTCircularBuffer constructs a new MTCircularBuffer of a given size
+     * @param size Buffer size
+     */
+    inline explicit MTCircularBuffer( size_t size ) : n_history_waiters(0), ring( new Ring( size, 0, 0 ) ), n_slots( size ), dirty_slots( size ), live_block(0), frozen(false), n_writing(0), n_spare_cells(0), curr_w_slot(0), w_seq(0), first_valid_seq(0), prefetch_distance(0), prefetch_bytes(0), dedup_equal(0), n_deduplicated(0), n_written(0), n_overwritten(0), n_consumed(0), n_resizes(0), peak_occupancy(0), peak_lag(0), recommended_size(0), ack_window( 1 ), ack_window_size(0), n_ack_reserved(0), acked_end(0),
+        consumer_metrics( &MTCircularBuffer::keep_metrics ), n_consumer_metrics(0)
+	{ 
+	}
+
+    inline ~MTCircularBuffer()
+    {
+        while( !subscriptions.empty() )
+            unsubscribe( *subscriptions.back() );
+
+        delete ring;
+        for( size_t i=0; i<retired_rings.size(); ++i )
+            delete retired_rings[i];
+    }
+
+    /**
+     * @brief Discards all dirty slots and resets all the buffer slots (NOTE: this method
+     *        is intented to be called when no other thread is accessing the buffer)
+     *
+     */
+    inline void clear()
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+
+        // Advance to next slot (we need to lock the entire circular buffer to change curr_w_slot)
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx, lock_timeout  );
+        if( !sc_lock.owns_lock() ) //owns_lock is false if lock failed (probably timeout has occurred)
+        {
+            throw SlotAcqTimeout();
+        }
+
+        {
+            boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+            dirty_slots.clear();
+        }
+
+        {
+            // Items in flight are discarded too: their tokens cannot be acknowledged anymore
+            boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+            ack_window.clear();
+        }
+
+        for( size_t i=0; i<ring->size(); ++i )
+        {
+            ring->buff_desc[i]->is_dirty = false;
+            ring->buff_desc[i]->in_flight = false;
+            ring->buff_desc[i]->acked = false;
+            ring->buff_desc[i]->seq = INVALID_SEQ;
+        }
+
+        // Sequence numbers are never reused: skip at least one full buffer, so that all the
+        // discarded items are reported as too old, and keep slot_of(seq) equal to the slot number
+        const seq_type n = ring->size();
+        const seq_type base = ring->base_seq;
+        w_seq = base + ( (w_seq-base+2*n-1)/n )*n;
+        first_valid_seq = w_seq.load();
+        curr_w_slot = 0;
+
+    }
+
+    /**
+     * @return number of buffer slots
+     */
+	inline size_t size() const { return n_slots; }
+
+    /**
+     * @brief resize Changes the number of slots while producers and consumers keep running. The newest
+     *        items (at most new_size) are migrated in order to a new ring and keep their sequence numbers
+     *        and their consumed/not consumed state. Older items are dropped, as if they were overwritten.
+     *        Accesses granted before the resize stay valid until released: the old ring is deleted by a
+     *        later resize (or by the destructor) once none of its accesses is left.
+     *
+     *        Waits until the in-flight write access, if any, is released, until the buffer is not
+     *        frozen (see freeze) and until all the items consumed through an AckToken are acknowledged
+     *        (see enable_ack_window). Producers and consumers are blocked only while the items are copied.
+     *        NOTE: the new ring is allocated, so resize must not be called on a real-time path
+     * @param new_size The new number of slots (at least 1)
+     */
+    inline void resize( size_t new_size )
+    {
+        if( try_resize( new_size ) != ACQUIRE_OK )
+            throw SlotAcqTimeout();
+    }
+
+    /**
+     * @brief try_resize same as resize, but returns ACQUIRE_SLOT_TIMEOUT instead of throwing
+     */
+    inline AcquireResult try_resize( size_t new_size )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        const boost::system_time deadline = boost::get_system_time()+lock_timeout;
+        if( new_size==0 )
+            new_size = 1;
+
+        // Allocated before locking anything
+        Ring* next = new Ring( new_size, 0, n_spare_cells );
+        MTFixedQueue< size_t > next_dirty( new_size );
+
+        while( true )
+        {
+            boost::unique_lock< main_mutex_type > sc_lock( main_mtx, deadline );
+            if( !sc_lock.owns_lock() )
+                break;
+            if( n_writing==0 && !frozen && migrate( next, next_dirty ) )
+                return ACQUIRE_OK;
+            sc_lock.unlock();
+            if( boost::get_system_time() >= deadline )
+                break;
+            boost::this_thread::yield();
+        }
+        delete next;
+        return ACQUIRE_SLOT_TIMEOUT;
+    }
+
+    /**
+     * @brief set_prefetch enables software prefetch of the upcoming slots. When write access is
+     *        granted, the next slots to be written are prefetched with write intent. When consume
+     *        access is granted, the next dirty slots are prefetched for reading.
+     * @param distance Number of upcoming slots to prefetch (0 disables prefetching)
+     * @param bytes_per_slot Number of payload bytes to prefetch for each slot (at most sizeof(T))
+     *
+     *        NOTE: this method is intented to be called before the buffer is shared with other threads
+     */
+    inline void set_prefetch( size_t distance, size_t bytes_per_slot = 4*MT_CIRCULAR_BUFFER_CACHE_LINE )
+    {
+        prefetch_distance = distance < size() ? distance : size()-1;
+        prefetch_bytes = bytes_per_slot < sizeof(T) ? bytes_per_slot : sizeof(T);
+    }
+
+    /**
+     * @return number of upcoming slots prefetched on each access
+     */
+    inline size_t get_prefetch_distance() const { return prefetch_distance; }
+
+
+    /**
+     * @brief write_next Gain exclusive write access to the next available slot
+     * @param acc A BufferSlotWriteAccess that will represent slot ownership
+     * @param overwrite_occurred is set to true if write access is given to a non consumed slot
+     */
+    inline void write_next( BufferSlotWriteAccess& acc, bool* overwrite_occurred=0 )
+	{
+        if( try_write_next( acc, overwrite_occurred ) != ACQUIRE_OK )
+            throw SlotAcqTimeout();
+    }
+
+    /**
+     * @brief try_write_next same as write_next, but returns ACQUIRE_SLOT_TIMEOUT instead of throwing
+     */
+    inline AcquireResult try_write_next( BufferSlotWriteAccess& acc, bool* overwrite_occurred=0 )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+
+        // We need to lock the entire circular buffer to read and advance curr_w_slot
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx, lock_timeout  );
+        if( !sc_lock.owns_lock() ) //owns_lock is false if lock failed (probably timeout has occurred)
+        {
+            return ACQUIRE_SLOT_TIMEOUT;
+        }
+
+        const size_t slot = curr_w_slot;
+        BufferSlotDescriptor& desc = *ring->buff_desc[slot];
+        boost::unique_lock< slot_mutex_type > um( desc.slot_mtx , lock_timeout );
+        if( !um.owns_lock() ) //owns_lock is false if lock failed (probably timeout has occurred)
+        {
+            return ACQUIRE_SLOT_TIMEOUT;
+        }
+        if( !wait_acked( slot, boost::get_system_time()+lock_timeout ) )
+        {
+            return ACQUIRE_SLOT_TIMEOUT;
+        }
+
+        if( overwrite_occurred != 0 )
+            *overwrite_occurred = desc.is_dirty;
+
+        if( desc.is_dirty )
+        {
+            n_overwritten++;
+            // The old content is lost, so it must not be handed to consumers anymore. Concurrent
+            // writers may publish out of slot order, so the slot is not necessarily the oldest queued
+            boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+            dirty_slots.remove( slot );
+        }
+
+        desc.block = live_block;
+        redirect_pinned( slot );
         acc._slot = slot;
-        acc.data = &(buff[slot]);
+        acc._seq = w_seq;
+        acc.data = &(ring->slot_data(slot));
         acc.srcBuffer = this;
-        buff_desc[slot]->n_reading++;
+        acc.ring = ring;
+        ring->n_refs++;
+        n_writing++;
+        desc.writing = true;
+        desc.seq = INVALID_SEQ;
+        desc.repeats = 0;
         acc.slot_lock.swap( um );
+
+        curr_w_slot = (slot+1)%ring->size();
+        w_seq = w_seq+1;
+
+        for( size_t i=1; i<=prefetch_distance; ++i )
+            prefetch_slot_for_write( (slot+i)%ring->size() );
+
+        return ACQUIRE_OK;
     }
 
+    /**
+     * @brief write_batch Copies n items into the next n slots and publishes them at once. The write
+     *        position is held for the whole batch, so the items get consecutive sequence numbers,
+     *        and consumers are notified only once. Batches are not deduplicated (see enable_dedup).
+     * @param items Array of n items
+     * @param n Number of items. If n > size(), the items are written in batches of size() items
+     * @param tags If not null, array of n tags assigned to the items
+     * @param n_overwritten If not null, is set to the number of non consumed slots overwritten
+     */
+    inline void write_batch( const T* items, size_t n, const boost::uint32_t* tags=0, size_t* n_overwritten=0 )
+    {
+        if( n_overwritten )
+            *n_overwritten = 0;
+        size_t done = 0;
+        while( done < n )
+        {
+            size_t n_written;
+            size_t n_batch_overwritten;
+            if( try_write_batch( items+done, n-done, tags ? tags+done : 0, &n_batch_overwritten, &n_written ) != ACQUIRE_OK )
+                throw SlotAcqTimeout();
+            done += n_written;
+            if( n_overwritten )
+                *n_overwritten += n_batch_overwritten;
+        }
+    }
+
+    /**
+     * @brief try_write_batch same as write_batch, but returns ACQUIRE_SLOT_TIMEOUT instead of throwing.
+     *        All the slots of the batch are locked before writing, so on timeout nothing is written.
+     *        A single batch is written: if n > size(), only the first size() items are.
+     * @param n_written If not null, is set to the number of items written (0 on timeout)
+     */
+    inline AcquireResult try_write_batch( const T* items, size_t n, const boost::uint32_t* tags=0, size_t* n_overwritten=0,
+                                          size_t* n_written=0 )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        if( n_overwritten )
+            *n_overwritten = 0;
+        if( n_written )
+            *n_written = 0;
+
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx, lock_timeout  );
+        if( !sc_lock.owns_lock() )
+        {
+            return ACQUIRE_SLOT_TIMEOUT;
+        }
+        if( n > ring->size() )
+            n = ring->size();
+
+        const size_t first_slot = curr_w_slot;
+        const seq_type first_seq = w_seq;
+        const boost::system_time deadline = boost::get_system_time()+lock_timeout;
+        for( size_t i=0; i<n; ++i )
+        {
+            const size_t slot = (first_slot+i)%ring->size();
+            boost::unique_lock< slot_mutex_type > um( ring->buff_desc[slot]->slot_mtx, deadline );
+            if( !um.owns_lock() || !wait_acked( slot, deadline ) )
+            {
+                for( size_t j=0; j<i; ++j )
+                    ring->buff_desc[ (first_slot+j)%ring->size() ]->slot_mtx.unlock();
+                return ACQUIRE_SLOT_TIMEOUT;
+            }
+            um.release();   // kept locked until the slot is written below
+        }
+
+        for( size_t i=0; i<n; ++i )
+        {
+            const size_t slot = (first_slot+i)%ring->size();
+            BufferSlotDescriptor& desc = *ring->buff_desc[slot];
+            boost::unique_lock< slot_mutex_type > um( desc.slot_mtx, boost::adopt_lock );
+            if( desc.is_dirty )
+            {
+                this->n_overwritten++;
+                if( n_overwritten )
+                    (*n_overwritten)++;
+                boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+                dirty_slots.remove( slot );
+            }
+            desc.block = live_block;
+            redirect_pinned( slot );
+            ring->slot_data( slot ) = items[i];
+            desc.writing = false;
+            desc.is_dirty = true;
+            desc.tag = tags ? tags[i] : 0;
+            desc.repeats = 0;
+            desc.seq = first_seq+i;
+            if( dedup_hash )
+                desc.hash = dedup_hash( ring->slot_data( slot ) );
+        }
+        curr_w_slot = (first_slot+n)%ring->size();
+        w_seq = first_seq+n;
+
+        bool history_waiting;
+        {
+            // Published before main_mtx is released, so that a concurrent write cannot be queued first
+            boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+            for( size_t i=0; i<n; ++i )
+                publish_slot( (first_slot+i)%ring->size(), first_seq+i, tags ? tags[i] : 0 );
+            history_waiting = n_history_waiters>0;
+        }
+        sc_lock.unlock();
+
+        data_available.notify_all();
+        if( history_waiting )
+            seq_published.notify_all();
+
+        if( n_written )
+            *n_written = n;
+        return ACQUIRE_OK;
+    }
+
+
+    /**
+     * @brief read_slot Gain shared read access to a given slot
+     * @param slot Slot number
+     * @param acc A BufferSlotReadAccess that will represent slot ownership
+     */
+    inline void read_slot( const size_t slot, BufferSlotReadAccess& acc )
+    {
+        if( try_read_slot( slot, acc ) != ACQUIRE_OK )
+            throw SlotAcqTimeout();
+    }
+
+    /**
+     * @brief try_read_slot same as read_slot, but returns ACQUIRE_SLOT_TIMEOUT instead of throwing
+     */
+    inline AcquireResult try_read_slot( const size_t slot, BufferSlotReadAccess& acc )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        boost::shared_lock< slot_mutex_type > ring_lock( ring_mtx );
+        if( slot >= ring->size() ) // the buffer has been shrunk
+        {
+            return ACQUIRE_SLOT_TIMEOUT;
+        }
+        // ring_mtx is not held while waiting for the slot (it is exclusive with MTCircularBufferRTSync):
+        // the reference keeps the ring alive if it is replaced meanwhile (see resize)
+        Ring& r = *ring;
+        r.n_refs++;
+        ring_lock.unlock();
+
+        AcquireResult res = ACQUIRE_OK;
+        boost::shared_lock< slot_mutex_type > um(r.buff_desc[slot]->slot_mtx , boost::get_system_time()+lock_timeout );
+        if( !um.owns_lock() ) //owns_lock is false if lock failed
+            res = ACQUIRE_SLOT_TIMEOUT;
+        else
+            grant_access( acc, r, slot, um );
+        r.n_refs--;
+        return res;
+    }
+
+    /**
+     * @brief read_seq Gain shared read access to the item with a given sequence number, if it is
+     *        still stored in the buffer. The slot holding it is computed in O(1) and validated
+     *        with the sequence number stamped on the slot when the item was written.
+     * @param seq Sequence number of the item (see BufferSlotAccess::seq and next_seq())
+     * @param acc A BufferSlotReadAccess that will represent slot ownership
+     * @return ACQUIRE_OK if the access is granted,
+     *         ACQUIRE_TOO_OLD if the item has been overwritten,
+     *         ACQUIRE_NOT_YET if the item was not written yet (or it is being written),
+     *         ACQUIRE_SLOT_TIMEOUT if a timeout occurred while locking the slot
+     */
+    inline AcquireResult read_seq( const seq_type seq, BufferSlotReadAccess& acc )
+    {
+        boost::shared_lock< slot_mutex_type > ring_lock( ring_mtx );
+        const seq_type next = w_seq;
+        if( seq >= next )
+            return ACQUIRE_NOT_YET;
+        if( seq+ring->size() < next || seq < ring->base_seq || seq < first_valid_seq )
+            return ACQUIRE_TOO_OLD;
+
+        // seq is the last item granted on its slot, so a different stamp means that it is still being written
+        Ring& r = *ring;
+        const size_t slot = r.slot_of( seq );
+        BufferSlotDescriptor& desc = *r.buff_desc[slot];
+        if( desc.seq != seq )
+            return ACQUIRE_NOT_YET;
+
+        // Wait for the slot without holding ring_mtx, as in try_read_slot
+        r.n_refs++;
+        ring_lock.unlock();
+
+        AcquireResult res = ACQUIRE_OK;
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        boost::shared_lock< slot_mutex_type > um( desc.slot_mtx , boost::get_system_time()+lock_timeout );
+        if( !um.owns_lock() ) //owns_lock is false if lock failed
+            res = ACQUIRE_SLOT_TIMEOUT;
+        else if( desc.seq != seq ) // overwritten while we were waiting for the lock
+            res = ACQUIRE_TOO_OLD;
+        else
+            grant_access( acc, r, slot, um );
+        r.n_refs--;
+        return res;
+    }
+
+    /**
+     * @return the sequence number that will be given to the next written item
+     */
+    inline seq_type next_seq() const { return w_seq; }
+
+    /**
+     * @return the sequence number of the oldest item that may still be stored in the buffer
+     */
+    inline seq_type oldest_seq() const
+    {
+        const seq_type next = w_seq;
+        const seq_type oldest = next > size() ? next-size() : 0;
+        return oldest > first_valid_seq ? oldest : static_cast<seq_type>( first_valid_seq );
+    }
+
+    /**
+     * @brief subscribe Positions a HistoryReader at the oldest or at the newest item of the buffer.
+     *        Late-joining readers can start from START_OLDEST to warm up from the buffer history.
+     */
+    inline void subscribe( HistoryReader& reader, StartPosition from )
+    {
+        if( from==START_OLDEST )
+        {
+            reader.next = oldest_seq();
+        }
+        else
+        {
+            const seq_type next = w_seq;
+            reader.next = next > first_valid_seq ? next-1 : static_cast<seq_type>( first_valid_seq );
+        }
+        reader.missed = 0;
+    }
+
+    /**
+     * @brief subscribe_at Positions a HistoryReader at a given sequence number
+     */
+    inline void subscribe_at( HistoryReader& reader, seq_type seq )
+    {
+        reader.next = seq;
+        reader.missed = 0;
+    }
+
+    /**
+     * @brief read_next Gain shared read access to the item at the reader position and advance the
+     *        reader. Items are not consumed. If the item at the reader position has been overwritten,
+     *        the reader skips to the oldest stored item (see HistoryReader::num_missed); if it has not
+     *        been written yet, this method waits until it becomes available.
+     * @return ACQUIRE_OK, ACQUIRE_DATA_TIMEOUT if no item was written before the timeout, or
+     *         ACQUIRE_SLOT_TIMEOUT if a timeout occurred while locking the slot
+     */
+    inline AcquireResult read_next( HistoryReader& reader, BufferSlotReadAccess& acc )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        const boost::system_time deadline = boost::get_system_time()+lock_timeout;
+
+        while( true )
+        {
+            const AcquireResult res = read_seq( reader.next, acc );
+            if( res==ACQUIRE_OK )
+            {
+                reader.next++;
+                return ACQUIRE_OK;
+            }
+            if( res==ACQUIRE_TOO_OLD )
+            {
+                const seq_type oldest = oldest_seq();
+                reader.missed += oldest > reader.next ? oldest-reader.next : 1;
+                reader.next = oldest > reader.next ? oldest : reader.next+1;
+                continue;
+            }
+            if( res!=ACQUIRE_NOT_YET )
+                return res;
+
+            // wait until the item is published (write release stamps the slot before notifying)
+            boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+            ++n_history_waiters;
+            while( !is_published( reader.next ) && reader.next+ring->size() >= w_seq )
+            {
+                if( !seq_published.timed_wait( data_available_lock, deadline ) )
+                {
+                    --n_history_waiters;
+                    return ACQUIRE_DATA_TIMEOUT;
+                }
+            }
+            --n_history_waiters;
+        }
+    }
+
+    /**
+     * @brief read_newest_available Gain shared read access to the most recently produced slot
+     * @param acc A BufferSlotReadAccess that will represent slot ownership
+     *            If acc.slot is equal to the newest available slot, this method waits until
+     *            a new slot become available (or a DataAvailableTimeout is raised). This is
+     *            useful to avoid reading the same slot more than once
+     */
+    inline void read_newest_available( BufferSlotReadAccess& acc )
+    {
+        throw_on_failure( try_read_newest_available( acc ) );
+    }
+
+    /**
+     * @brief try_read_newest_available same as read_newest_available, but returns the failure reason
+     *        instead of throwing
+     */
+    inline AcquireResult try_read_newest_available( BufferSlotReadAccess& acc )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+
+        size_t slot = acc.slot;
+        boost::shared_lock< slot_mutex_type > um;
+        const AcquireResult res = lock_queued( data_available_lock, um, slot, true, boost::get_system_time()+lock_timeout );
+        if( res!=ACQUIRE_OK )
+            return res;
+
+        grant_access( acc, slot, um );
+        return ACQUIRE_OK;
+    }
+
+    /**
+     * @brief enable_snapshots allocates max_snapshots spare storage cells, so that up to max_snapshots
+     *        Snapshot can be held at the same time without ever blocking the producer (see
+     *        read_newest_snapshot). The buffer cannot be frozen while snapshots are enabled.
+     *
+     *        NOTE: this method is intented to be called before the buffer is shared with other threads
+     */
+    inline void enable_snapshots( size_t max_snapshots )
+    {
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx );
+        Ring& r = *ring;
+        r.spare_cells.resize( max_snapshots );
+        r.cell_pins.assign( r.size()+max_snapshots, 0 );
+        r.cell_owned.assign( r.size()+max_snapshots, true );
+        r.free_cells.reset( max_snapshots );
+        for( size_t c=r.size(); c<r.size()+max_snapshots; ++c )
+        {
+            r.cell_owned[c] = false;
+            r.free_cells.push( c );
+        }
+        for( size_t i=0; i<r.size(); ++i )
+            r.buff_desc[i]->cell = i;
+        n_spare_cells = max_snapshots;
+    }
+
+    /**
+     * @brief read_newest_snapshot Gain a Snapshot of the most recently published item. Unlike
+     *        read_newest_available, the slot lock is only held while the storage cell is pinned.
+     */
+    inline void read_newest_snapshot( Snapshot& snap )
+    {
+        throw_on_failure( try_read_newest_snapshot( snap ) );
+    }
+
+    /**
+     * @brief try_read_newest_snapshot same as read_newest_snapshot, but returns the failure reason
+     *        instead of throwing
+     * @return ACQUIRE_OK, ACQUIRE_NOT_YET if nothing was published yet, or ACQUIRE_SLOT_TIMEOUT if
+     *         max_snapshots Snapshot are already held (see enable_snapshots) or the slot could not be locked
+     */
+    inline AcquireResult try_read_newest_snapshot( Snapshot& snap )
+    {
+        snap.release();
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        boost::shared_lock< slot_mutex_type > ring_lock( ring_mtx );
+
+        // the newest item may still be being written: take the newest published one
+        const seq_type oldest = oldest_seq();
+        seq_type seq = w_seq;
+        while( seq > oldest && !is_published( seq-1 ) )
+            --seq;
+        if( seq==oldest )
+            return ACQUIRE_NOT_YET;
+        --seq;
+
+        // Wait for the slot without holding ring_mtx, as in try_read_slot
+        Ring& r = *ring;
+        const size_t slot = r.slot_of( seq );
+        BufferSlotDescriptor& desc = *r.buff_desc[slot];
+        r.n_refs++;
+        ring_lock.unlock();
+
+        boost::shared_lock< slot_mutex_type > um( desc.slot_mtx , boost::get_system_time()+lock_timeout );
+        boost::unique_lock< data_mutex_type > snapshot_lock( snapshot_mtx, boost::defer_lock );
+        if( um.owns_lock() && desc.seq == seq )
+            snapshot_lock.lock();
+        if( !snapshot_lock.owns_lock() || r.n_snapshots >= r.spare_cells.size() )
+        {
+            r.n_refs--;
+            return ACQUIRE_SLOT_TIMEOUT;
+        }
+        r.n_snapshots++;
+        r.cell_pins[ desc.cell ]++;
+
+        snap.data = &( r.cell( desc.cell ) );
+        snap.seq = seq;
+        snap.tag = desc.tag;
+        snap.srcBuffer = this;
+        snap.ring = &r;
+        snap.cell = desc.cell;
+        return ACQUIRE_OK;     // the reference taken above is released with the snapshot
+    }
+
+    /**
+     * @brief consume_next_available Gain shared read access to the least recently produced slot
+     * @param acc A BufferSlotConsumeAccess that will represent slot ownership
+     */
+    inline void consume_next_available( BufferSlotConsumeAccess& acc )
+    {
+        throw_on_failure( try_consume_next_available( acc ) );
+    }
+
+    /**
+     * @brief try_consume_next_available same as consume_next_available, but returns the failure
+     *        reason instead of throwing
+     */
+    inline AcquireResult try_consume_next_available( BufferSlotConsumeAccess& acc )
+    {
+        return try_consume_front( acc, false );
+    }
+
+    /**
+     * @brief enable_ack_window enables acknowledged consumption (see consume_next_available( AckToken& )).
+     *        The slot of an item consumed through an AckToken is not written again until the item, and
+     *        all the items consumed before it, are acknowledged: the producer waits for them. At most
+     *        max_in_flight items can be in flight at the same time; an item acknowledged out of order
+     *        keeps its place in the window until the items consumed before it are acknowledged too.
+     *        The buffer cannot be frozen while the ack window is enabled (see freeze).
+     *
+     *        NOTE: this method is intented to be called before the buffer is shared with other threads
+     */
+    inline void enable_ack_window( size_t max_in_flight )
+    {
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx );
+        ack_window.reset( max_in_flight );
+        ack_window_size = max_in_flight;
+    }
+
+    /**
+     * @brief consume_next_available Consumes the least recently produced slot without keeping it
+     *        locked: the item can be processed asynchronously and acknowledged later, in any order
+     *        (see ack). The ack window must be enabled (see enable_ack_window)
+     * @param token An AckToken that will represent the consumed item until it is acknowledged
+     */
+    inline void consume_next_available( AckToken& token )
+    {
+        throw_on_failure( try_consume_next_available( token ) );
+    }
+
+    /**
+     * @brief try_consume_next_available same as consume_next_available( AckToken& ), but returns the
+     *        failure reason instead of throwing
+     * @return ACQUIRE_OK, ACQUIRE_DATA_TIMEOUT if no data became available, or ACQUIRE_SLOT_TIMEOUT if
+     *         the slot could not be locked, the window stayed full (max_in_flight items not
+     *         acknowledged) until the timeout, or the ack window is not enabled
+     */
+    inline AcquireResult try_consume_next_available( AckToken& token )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        const boost::system_time deadline = boost::get_system_time()+lock_timeout;
+        token = AckToken();
+        if( ack_window_size==0 )
+            return ACQUIRE_SLOT_TIMEOUT;
+
+        {
+            // A place in the window is reserved first, so that the consume queue is never locked
+            // while waiting for acknowledgments
+            boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+            BlockedTimer blocked( registered_metrics() );
+            while( ack_window.size()+n_ack_reserved >= ack_window_size )
+            {
+                blocked.start();
+                if( !slot_acked.timed_wait( ack_lock, deadline ) && ack_window.size()+n_ack_reserved >= ack_window_size )
+                    return ACQUIRE_SLOT_TIMEOUT;
+            }
+            n_ack_reserved++;
+        }
+
+        BufferSlotConsumeAccess acc;
+        const AcquireResult res = try_consume_front( acc, true );
+        if( res!=ACQUIRE_OK )
+        {
+            {
+                boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+                n_ack_reserved--;
+            }
+            slot_acked.notify_all();
+            return res;
+        }
+
+        // acc is released on return: the slot is marked as consumed, but stays in flight
+        token.data = acc.data;
+        token.seq = acc.seq;
+        token.tag = acc.tag;
+        token.srcBuffer = this;
+        token.slot = acc.slot;
+        return ACQUIRE_OK;
+    }
+
+    /**
+     * @brief ack acknowledges an item consumed through token, which is reset. Items can be acknowledged
+     *        in any order, but a slot is given back to the producer only when all the items consumed
+     *        before it are acknowledged too (see acked_seq)
+     * @return false if token is not valid or was already acknowledged
+     */
+    inline bool ack( AckToken& token )
+    {
+        const AckToken acked_token = token;
+        token = AckToken();
+        if( acked_token.srcBuffer != this )
+            return false;
+
+        bool freed = false;
+        {
+            boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+
+            // While the window is not empty the ring cannot be replaced (see migrate)
+            bool in_window = false;
+            for( size_t i=0; i<ack_window.size() && !in_window; ++i )
+                in_window = ack_window.at(i)==acked_token.slot;
+            if( !in_window )
+                return false;
+            BufferSlotDescriptor& desc = *ring->buff_desc[ acked_token.slot ];
+            if( desc.acked || desc.seq!=acked_token.seq )
+                return false;
+            desc.acked = true;
+
+            // Slots are freed in consume order, up to the first item not acknowledged yet
+            while( !ack_window.empty() && ring->buff_desc[ ack_window.front() ]->acked )
+            {
+                BufferSlotDescriptor& first = *ring->buff_desc[ ack_window.front() ];
+                acked_end = first.seq+1;
+                first.in_flight = false;
+                first.acked = false;
+                ack_window.pop();
+                freed = true;
+            }
+        }
+        if( freed )
+            slot_acked.notify_all();
+        return true;
+    }
+
+    /**
+     * @return the sequence number following the acknowledged prefix: all the items consumed through
+     *         an AckToken with a lower sequence number have been acknowledged
+     */
+    inline seq_type acked_seq() const
+    {
+        boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+        return ack_window.empty() ? acked_end : static_cast<seq_type>( ring->buff_desc[ ack_window.front() ]->seq );
+    }
+
+    /**
+     * @return number of items consumed through an AckToken whose slot is not given back yet
+     */
+    inline size_t num_in_flight() const
+    {
+        boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+        return ack_window.size();
+    }
+
+    /**
+     * @brief try_consume_available Gain shared read access to up to max_n of the least recently produced
+     *        slots, locking the consume queue only once. Waits until at least one slot is available;
+     *        further slots are only granted if they can be locked without waiting.
+     * @param accs Array of at least max_n BufferSlotConsumeAccess
+     * @param max_n Maximum number of slots to consume
+     * @param n_acquired Set to the number of granted accesses (accs[0] ... accs[n_acquired-1])
+     */
+    inline AcquireResult try_consume_available( BufferSlotConsumeAccess* accs, size_t max_n, size_t& n_acquired )
+    {
+        n_acquired = 0;
+        if( max_n==0 )
+            return ACQUIRE_OK;
+
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+
+        while( n_acquired<max_n )
+        {
+            size_t slot;
+            boost::shared_lock< slot_mutex_type > um;
+            if( n_acquired==0 )
+            {
+                const AcquireResult res = lock_queued( data_available_lock, um, slot, false, boost::get_system_time()+lock_timeout );
+                if( res==ACQUIRE_DATA_TIMEOUT )
+                    return res;
+            }
+            else if( !dirty_slots.empty() )
+            {
+                slot = dirty_slots.front();
+                boost::shared_lock< slot_mutex_type >( ring->buff_desc[slot]->slot_mtx , boost::try_to_lock ).swap( um );
+            }
+
+            if( !um.owns_lock() )
+                break;
+
+            dirty_slots.pop();
+
+            BufferSlotConsumeAccess& acc = accs[ n_acquired++ ];
+            grant_access( acc, slot, um );
+            count_consumed( acc.seq, slot );
+        }
+
+        if( n_acquired==0 )
+        {
+            data_available.notify_all(); // We failed to lock this slot, maybe someone else will succeed
+            return ACQUIRE_SLOT_TIMEOUT;
+        }
+        return ACQUIRE_OK;
+    }
+
+    /**
+     * @brief peek_next_available Gain shared read access to the least recently produced slot, without
+     *        removing it from the consume queue
+     * @param acc A BufferSlotPeekAccess that will represent slot ownership
+     */
+    inline void peek_next_available( BufferSlotPeekAccess& acc )
+    {
+        throw_on_failure( try_peek_next_available( acc ) );
+    }
+
+    /**
+     * @brief try_peek_next_available same as peek_next_available, but returns the failure reason
+     *        instead of throwing
+     */
+    inline AcquireResult try_peek_next_available( BufferSlotPeekAccess& acc )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        return try_peek_next_available( acc, boost::get_system_time()+lock_timeout );
+    }
+
+    /**
+     * @brief try_peek_next_available same as above, but gives up at deadline. A deadline already
+     *        expired (e.g. the current time) makes the call non-blocking
+     */
+    inline AcquireResult try_peek_next_available( BufferSlotPeekAccess& acc, const boost::system_time& deadline )
+    {
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+
+        size_t slot;
+        boost::shared_lock< slot_mutex_type > um;
+        const AcquireResult res = lock_queued( data_available_lock, um, slot, false, deadline );
+        if( res!=ACQUIRE_OK )
+            return res;
+
+        grant_access( acc, slot, um );
+        return ACQUIRE_OK;
+    }
+
+    /**
+     * @brief consume_peeked Converts a peek access into a consume access, without releasing the slot lock.
+     *        The conversion fails if the peeked item is no longer the least recently produced one
+     *        (for example, because another consumer consumed it meanwhile).
+     * @param peek A granted BufferSlotPeekAccess. It is empty after a successful conversion
+     * @param acc A BufferSlotConsumeAccess that will represent slot ownership
+     * @return true if the conversion succeeded
+     */
+    inline bool consume_peeked( BufferSlotPeekAccess& peek, BufferSlotConsumeAccess& acc )
+    {
+        if( peek.srcBuffer != this )
+            return false;
+
+        bool still_oldest = false;
+        {
+            boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+            still_oldest = peek.ring==ring && !dirty_slots.empty() && dirty_slots.front()==peek.slot && ring->buff_desc[peek.slot]->is_dirty;
+            if( still_oldest )
+            {
+                dirty_slots.pop();
+                count_consumed( peek.seq, peek.slot );
+            }
+        }
+        if( !still_oldest )
+            return false;
+
+        acc._slot = peek._slot;
+        acc._seq = peek._seq;
+        acc.tag = peek.tag;
+        acc.repeats = peek.ring->buff_desc[peek.slot]->repeats;
+        acc.data = peek.data;
+        acc.srcBuffer = this;
+        acc.ring = peek.ring;
+        acc.slot_lock.swap( peek.slot_lock );
+
+        peek.data = 0;
+        peek.srcBuffer = 0;
+        peek.ring = 0;
+        return true;
+    }
+
+    /**
+     * @brief subscribe Registers a FilteredSubscription. Only items written after this call are delivered.
+     *        NOTE: registering allocates memory, so it should not be done on a real-time path
+     */
+    inline void subscribe( FilteredSubscription& sub )
+    {
+        if( sub.owner )
+            sub.owner->unsubscribe( sub );
+
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+        sub.pending.reset( ring->size() );
+        sub.owner = this;
+        subscriptions.push_back( &sub );
+    }
+
+    /**
+     * @brief unsubscribe Removes a FilteredSubscription (done automatically when the subscription is destroyed)
+     */
+    inline void unsubscribe( FilteredSubscription& sub )
+    {
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+        for( size_t i=0; i<subscriptions.size(); ++i )
+        {
+            if( subscriptions[i]==&sub )
+            {
+                subscriptions.erase( subscriptions.begin()+i );
+                break;
+            }
+        }
+        sub.owner = 0;
+        sub.matched.notify_all();
+    }
+
+    /**
+     * @brief consume_next_matching Gain shared read access to the least recently produced item matching
+     *        the subscription predicate, waiting until one is available. Each item is delivered once
+     *        per subscription, independently of the other consumers of the buffer.
+     * @return ACQUIRE_OK, ACQUIRE_DATA_TIMEOUT if no matching item was produced before the timeout, or
+     *         ACQUIRE_SLOT_TIMEOUT if a timeout occurred while locking the slot
+     */
+    inline AcquireResult consume_next_matching( FilteredSubscription& sub, BufferSlotReadAccess& acc )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        const boost::system_time deadline = boost::get_system_time()+lock_timeout;
+
+        while( true )
+        {
+            seq_type seq;
+            {
+                boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+                while( sub.pending.empty() )
+                {
+                    if( sub.owner != this || !sub.matched.timed_wait( data_available_lock, deadline ) )
+                    {
+                        return ACQUIRE_DATA_TIMEOUT;
+                    }
+                }
+                seq = sub.pending.front();
+                sub.pending.pop();
+            }
+
+            const AcquireResult res = read_seq( seq, acc );
+            if( res!=ACQUIRE_TOO_OLD )
+                return res;
+
+            boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+            sub.missed++;
+        }
+    }
+
+    /**
+     * @brief enable_dedup Enables write deduplication: when write access is released, the new item is
+     *        compared with the previous one (using T::operator==). If they are equal, the new item is not
+     *        published: its slot is reused by the next write and the repeat counter of the previous item
+     *        is incremented instead (see BufferSlotAccess::repeats and num_deduplicated)
+     *
+     *        NOTE: this method is intented to be called before the buffer is shared with other threads
+     */
+    inline void enable_dedup()
+    {
+        dedup_hash.clear();
+        dedup_equal = &MTCircularBuffer::items_equal;
+    }
+
+    /**
+     * @brief enable_dedup Enables write deduplication comparing item hashes, computed by hash_fn
+     *        when each item is published, instead of using T::operator==
+     */
+    inline void enable_dedup( const boost::function< size_t ( const T& ) >& hash_fn )
+    {
+        dedup_equal = 0;
+        dedup_hash = hash_fn;
+    }
+
+    inline void disable_dedup()
+    {
+        dedup_equal = 0;
+        dedup_hash.clear();
+    }
+
+    /**
+     * @return number of written items that were not published because equal to the previous one
+     */
+    inline boost::uint64_t num_deduplicated() const { return n_deduplicated; }
+
+    /**
+     * @brief write_copy Writes a block of bytes into the next available slot, using non-temporal
+     *        stores for large blocks (see MTStreamCopy). T must be trivially copyable.
+     * @param src Source data
+     * @param n Number of bytes to copy (at most sizeof(T) bytes are copied)
+     * @param overwrite_occurred is set to true if a non consumed slot was overwritten
+     */
+    inline void write_copy( const void* src, size_t n, bool* overwrite_occurred=0 )
+    {
+        BOOST_STATIC_ASSERT( boost::has_trivial_copy<T>::value );
+
+        BufferSlotWriteAccess acc;
+        write_next( acc, overwrite_occurred );
+        MTStreamCopy::copy( acc.data, src, n < sizeof(T) ? n : sizeof(T) );
+    }
+
+    /**
+     * @brief consume_copy Consumes the least recently produced slot copying its content into dst,
+     *        using non-temporal stores for large blocks (see MTStreamCopy). T must be trivially copyable.
+     * @param dst Destination buffer
+     * @param n Size of the destination buffer (at most sizeof(T) bytes are copied)
+     * @return number of bytes copied
+     */
+    inline size_t consume_copy( void* dst, size_t n )
+    {
+        BOOST_STATIC_ASSERT( boost::has_trivial_copy<T>::value );
+
+        BufferSlotConsumeAccess acc;
+        consume_next_available( acc );
+        const size_t n_copy = n < sizeof(T) ? n : sizeof(T);
+        MTStreamCopy::copy( dst, acc.data, n_copy );
+        return n_copy;
+    }
+
+    /**
+     * @brief freeze Freezes the current content of the whole buffer into ring. The live storage is
+     *        swapped with a standby storage block in O(1), so the producer is never stalled: it keeps
+     *        writing into the standby block while the frozen one is read through ring.
+     *        The standby block (one more copy of the buffer) is allocated by the first call.
+     *
+     *        When ring is released, the items written before the freeze and not overwritten
+     *        meanwhile are copied back into the live block, taking each of their slot locks in turn.
+     *
+     * @param frozen_ring A FrozenRing that will represent the frozen storage
+     * @return false if the buffer is already frozen (only one FrozenRing can exist at a time) or if
+     *         snapshots or the ack window are enabled (see enable_snapshots and enable_ack_window)
+     */
+    inline bool freeze( FrozenRing& frozen_ring )
+    {
+        frozen_ring.release();
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx );
+        if( frozen || n_spare_cells>0 || ack_window_size>0 )
+            return false;
+        if( ring->standby_buff.size() != ring->size() )
+            ring->standby_buff.resize( ring->size() );
+
+        // Items still being written are excluded, their slot will be copied back when thawing
+        seq_type end = w_seq;
+        while( end > first_valid_seq && !is_published( end-1 ) && end+ring->size() > w_seq )
+            --end;
+        const seq_type oldest = w_seq > ring->size() ? w_seq-ring->size() : 0;
+
+        frozen_ring.srcBuffer = this;
+        frozen_ring.items = &( ring->storage( live_block, 0 ) );
+        frozen_ring.n_slots = ring->size();
+        frozen_ring.base = ring->base_seq;
+        frozen_ring.first = oldest > first_valid_seq ? oldest : static_cast<seq_type>( first_valid_seq );
+        frozen_ring.end = end > frozen_ring.first ? end : frozen_ring.first;
+
+        live_block = 1-live_block;
+        frozen = true;
+        return true;
+    }
+
+#if defined(MT_CIRCULAR_BUFFER_HAS_RANGES)
+
+    /**
+     * @brief ConsumeView is a C++20 input range that consumes the buffer items lazily. Slots are
+     *        acquired BATCH at a time (see try_consume_available) and each slot is released as soon
+     *        as the iterator moves past it. The range ends when no data becomes available before
+     *        the timeout.
+     */
+    template< size_t BATCH >
+    class ConsumeView : public std::ranges::view_interface< ConsumeView< BATCH > >
+    {
+        struct State : private boost::noncopyable
+        {
+            explicit State( MTCircularBuffer* _buffer ) : buffer(_buffer), n(0), idx(0), started(false), done(false) {}
+
+            inline void fetch()
+            {
+                for( size_t i=idx; i<n; ++i )
+                    accs[i].release();
+                idx = 0;
+                n = 0;
+                done = buffer->try_consume_available( accs, BATCH, n )!=ACQUIRE_OK;
+            }
+            inline void advance()
+            {
+                accs[idx].release();
+                if( ++idx >= n )
+                    fetch();
+            }
+
+            MTCircularBuffer* buffer;
+            BufferSlotConsumeAccess accs[ BATCH ];
+            size_t n;
+            size_t idx;
+            bool started;
+            bool done;
+        };
+
+    public:
+        class iterator
+        {
+        public:
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+
+            iterator() : state(0) {}
+            explicit iterator( State* _state ) : state(_state) {}
+
+            inline const T& operator*() const { return *(state->accs[state->idx].data); }
+            inline const T* operator->() const { return state->accs[state->idx].data; }
+            inline iterator& operator++() { state->advance(); return *this; }
+            inline void operator++( int ) { state->advance(); }
+
+            friend inline bool operator==( const iterator& it, std::default_sentinel_t ) { return it.state==0 || it.state->done; }
+
+        private:
+            State* state;
+        };
+
+        ConsumeView() {}
+        explicit ConsumeView( MTCircularBuffer& buffer ) : state( std::make_shared< State >( &buffer ) ) {}
+
+        inline iterator begin()
+        {
+            if( state && !state->started )
+            {
+                state->started = true;
+                state->fetch();
+            }
+            return iterator( state.get() );
+        }
+        inline std::default_sentinel_t end() const { return std::default_sentinel; }
+
+    private:
+        std::shared_ptr< State > state;
+    };
+
+    /**
+     * @brief HistoryView is a C++20 input range over the buffer history (see HistoryReader). Items are
+     *        not consumed. The range ends when it reaches the most recently written item.
+     */
+    class HistoryView : public std::ranges::view_interface< HistoryView >
+    {
+        struct State : private boost::noncopyable
+        {
+            explicit State( MTCircularBuffer* _buffer ) : buffer(_buffer), started(false), done(false) {}
+
+            inline void fetch()
+            {
+                acc.release();
+                done = reader.position() >= buffer->next_seq() || buffer->read_next( reader, acc )!=ACQUIRE_OK;
+            }
+
+            MTCircularBuffer* buffer;
+            HistoryReader reader;
+            BufferSlotReadAccess acc;
+            bool started;
+            bool done;
+        };
+
+    public:
+        class iterator
+        {
+        public:
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+
+            iterator() : state(0) {}
+            explicit iterator( State* _state ) : state(_state) {}
+
+            inline const T& operator*() const { return *(state->acc.data); }
+            inline const T* operator->() const { return state->acc.data; }
+            inline iterator& operator++() { state->fetch(); return *this; }
+            inline void operator++( int ) { state->fetch(); }
+
+            friend inline bool operator==( const iterator& it, std::default_sentinel_t ) { return it.state==0 || it.state->done; }
+
+        private:
+            State* state;
+        };
+
+        HistoryView() {}
+        HistoryView( MTCircularBuffer& buffer, StartPosition from ) : state( std::make_shared< State >( &buffer ) )
+        {
+            buffer.subscribe( state->reader, from );
+        }
+
+        inline iterator begin()
+        {
+            if( state && !state->started )
+            {
+                state->started = true;
+                state->fetch();
+            }
+            return iterator( state.get() );
+        }
+        inline std::default_sentinel_t end() const { return std::default_sentinel; }
+
+    private:
+        std::shared_ptr< State > state;
+    };
+
+    /**
+     * @brief consume_view returns a range that consumes the buffer items (see ConsumeView)
+     */
+    template< size_t BATCH >
+    inline ConsumeView< BATCH > consume_view() { return ConsumeView< BATCH >( *this ); }
+    inline ConsumeView< 16 > consume_view() { return ConsumeView< 16 >( *this ); }
+
+    /**
+     * @brief history_view returns a range over the buffer history, without consuming it (see HistoryView)
+     */
+    inline HistoryView history_view( StartPosition from = START_OLDEST ) { return HistoryView( *this, from ); }
+
+#endif
+
     inline void operator()( BufferSlotConsumeAccess& acc )
     {
         consume_next_available( acc );
@@ -351,9 +2088,10 @@ public:
      */
     inline bool is_written( size_t slot ) const
     {
-        if( slot < buff_desc.size() )
+        boost::shared_lock< slot_mutex_type > ring_lock( ring_mtx );
+        if( slot < ring->size() )
         {
-            return buff_desc[slot]->writing;
+            return ring->buff_desc[slot]->writing;
         }
         return false;
     }
@@ -364,9 +2102,10 @@ public:
      */
     inline size_t num_concurrent_read( size_t slot ) const
     {
-        if( slot < buff_desc.size() )
+        boost::shared_lock< slot_mutex_type > ring_lock( ring_mtx );
+        if( slot < ring->size() )
         {
-            return buff_desc[slot]->n_reading;
+            return ring->buff_desc[slot]->n_reading;
         }
         return 0;
     }
@@ -377,7 +2116,84 @@ public:
     inline bool is_read( size_t slot ) const { return num_concurrent_read(slot)>0; }
 
 
-    inline size_t num_consumable_slots() const { return dirty_slots.size(); }
+    /**
+     * @return number of items published and not consumed yet
+     */
+    inline size_t num_consumable_slots() const
+    {
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+        return dirty_slots.size();
+    }
+
+    /**
+     * @brief register_consumer attributes the items consumed by the calling thread, and the time it
+     *        spends waiting, to metrics (see ConsumerMetrics) until it is called again. Pass 0 to stop.
+     *        metrics must outlive the registration. While at least one consumer is registered, items
+     *        are timestamped when published.
+     */
+    inline void register_consumer( ConsumerMetrics* metrics )
+    {
+        ConsumerMetrics* previous = consumer_metrics.get();
+        if( previous==metrics )
+            return;
+        consumer_metrics.reset( metrics );
+        if( !previous )
+            n_consumer_metrics++;
+        else if( !metrics )
+            n_consumer_metrics--;
+    }
+
+    /**
+     * @brief stats returns a snapshot of the buffer counters. The counters are read without locking,
+     *        so they may be slightly inconsistent with each other
+     * @param reset_peaks If true, peak_occupancy and peak_lag restart from the current values
+     */
+    inline Stats stats( bool reset_peaks = false )
+    {
+        Stats st;
+        st.size = size();
+        st.occupancy = dirty_slots.size();
+        st.peak_occupancy = reset_peaks ? peak_occupancy.exchange( st.occupancy ) : peak_occupancy.load();
+        st.peak_lag = reset_peaks ? peak_lag.exchange( 0 ) : peak_lag.load();
+        st.n_written = n_written;
+        st.n_overwritten = n_overwritten;
+        st.n_consumed = n_consumed;
+        st.n_deduplicated = n_deduplicated;
+        st.n_resizes = n_resizes;
+        st.recommended_size = recommended_size;
+        return st;
+    }
+
+    /**
+     * @brief watch_peaks updates the peaks of w along with the buffer ones, until unwatch_peaks is
+     *        called. w must outlive the registration
+     */
+    inline void watch_peaks( PeakWindow& w )
+    {
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+        w.peak_occupancy = dirty_slots.size();
+        w.peak_lag = 0;
+        peak_windows.push_back( &w );
+    }
+
+    inline void unwatch_peaks( PeakWindow& w )
+    {
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+        for( size_t i=0; i<peak_windows.size(); ++i )
+        {
+            if( peak_windows[i]==&w )
+            {
+                peak_windows.erase( peak_windows.begin()+i );
+                break;
+            }
+        }
+    }
+
+    /**
+     * @brief set_recommended_size publishes the capacity recommended by a tuner in stats()
+     *        (see MTCircularBufferTuner)
+     */
+    inline void set_recommended_size( size_t n ) { recommended_size = n; }
 
 
     inline std::string to_string()
@@ -385,16 +2201,17 @@ public:
         std::stringstream ss;
         ss << "[ ";
 
-        boost::unique_lock< boost::timed_mutex > sc_lock( main_mtx   );
-        for( size_t i=0; i<buff_desc.size(); ++i )
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx   );
+        for( size_t i=0; i<ring->size(); ++i )
         {
-            if( buff_desc[i]->writing )
+            const BufferSlotDescriptor& desc = *ring->buff_desc[i];
+            if( desc.writing )
                 ss << " W ";
-            else if( buff_desc[i]->n_reading>0 )
+            else if( desc.n_reading>0 )
             {
-                ss << buff_desc[i]->n_reading << "R ";
+                ss << desc.n_reading.load() << "R ";
             }
-            else if( buff_desc[i]->is_dirty )
+            else if( desc.is_dirty )
             {
                 ss << " X ";
             }
@@ -411,23 +2228,569 @@ private:
 		
 	struct BufferSlotDescriptor : boost::noncopyable
 	{
-		boost::shared_mutex slot_mtx;
+		slot_mutex_type slot_mtx;
         bool writing;
-        size_t n_reading;
+        boost::atomic< size_t > n_reading;  // shared accesses granted, updated under a shared slot lock
         bool is_dirty;
+        boost::atomic< seq_type > seq; // sequence number of the stored item, INVALID_SEQ while being written
+        boost::uint32_t tag;
+        boost::atomic< boost::uint32_t > repeats;
+        size_t hash;
+        size_t block;   // storage block holding the item (see freeze)
+        size_t cell;    // storage cell holding the item in block 0 (see enable_snapshots)
+        bool in_flight; // consumed through an AckToken and not given back yet, guarded by ack_mtx
+        bool acked;     // in flight and acknowledged, guarded by ack_mtx
+        boost::system_time published;   // publication time, only set while consumers are registered
+    };
+
+    /**
+     * @brief Ring holds the slots of the buffer. resize() replaces it with a new one; the old ring is
+     *        kept alive until all the accesses granted on it are released (see n_refs).
+     *        The item with sequence number seq is stored in slot (seq-base_seq)%size()
+     */
+    struct Ring : boost::noncopyable
+    {
+        Ring( size_t size, seq_type _base_seq, size_t n_spare ) : buff( size ), buff_desc( size ), base_seq( _base_seq ), n_refs( 0 ),
+            spare_cells( n_spare ), cell_pins( size+n_spare, 0 ), cell_owned( size+n_spare, true ), free_cells( n_spare ), n_snapshots( 0 )
+        {
+            for( size_t c=size; c<size+n_spare; ++c )
+            {
+                cell_owned[c] = false;
+                free_cells.push( c );
+            }
+            for( size_t i=0; i<buff_desc.size(); ++i )
+            {
+                buff_desc[i] = new BufferSlotDescriptor();
+                buff_desc[i]->writing = false;
+                buff_desc[i]->n_reading = 0;
+                buff_desc[i]->is_dirty = false;
+                buff_desc[i]->seq = INVALID_SEQ;
+                buff_desc[i]->tag = 0;
+                buff_desc[i]->repeats = 0;
+                buff_desc[i]->hash = 0;
+                buff_desc[i]->block = 0;
+                buff_desc[i]->cell = i;
+                buff_desc[i]->in_flight = false;
+                buff_desc[i]->acked = false;
+            }
+        }
+
+        ~Ring()
+        {
+            for( size_t i=0; i<buff_desc.size(); ++i )
+                delete buff_desc[i];
+        }
+
+        inline size_t size() const { return buff.size(); }
+        inline size_t slot_of( seq_type seq ) const { return static_cast<size_t>( (seq-base_seq)%buff.size() ); }
+
+        inline T& storage( size_t block, size_t slot )
+        {
+            return block==0 ? buff[slot] : standby_buff[slot];
+        }
+
+        /**
+         * @return storage cell c: cells [0,size()) are the slots of block 0, the others are spare cells
+         */
+        inline T& cell( size_t c )
+        {
+            return c < buff.size() ? buff[c] : spare_cells[ c-buff.size() ];
+        }
+
+        /**
+         * @return the item currently stored in slot. The slot lock must be held
+         */
+        inline T& slot_data( size_t slot )
+        {
+            const BufferSlotDescriptor& desc = *buff_desc[slot];
+            return desc.block==0 ? cell( desc.cell ) : standby_buff[slot];
+        }
+
+        std::vector< T > buff;
+        std::vector< T > standby_buff;  // second storage block, allocated by the first freeze()
+        std::vector< BufferSlotDescriptor* > buff_desc;
+        seq_type base_seq;
+        boost::atomic< size_t > n_refs; // number of accesses granted on this ring and not released yet
+
+        // Snapshot cells, guarded by snapshot_mtx. Every slot owns exactly one cell; a cell pinned by
+        // a Snapshot is given up by its slot when the slot is written again, and becomes free once unpinned
+        std::vector< T > spare_cells;
+        std::vector< size_t > cell_pins;
+        std::vector< bool > cell_owned;
+        MTFixedQueue< size_t > free_cells;
+        size_t n_snapshots;
+    };
+
+    static const seq_type INVALID_SEQ = ~static_cast<seq_type>(0);
+
+    inline bool is_published( seq_type seq ) const
+    {
+        return seq >= ring->base_seq && ring->buff_desc[ ring->slot_of( seq ) ]->seq == seq;
+    }
+
+    inline void prefetch_slot_for_write( size_t slot )
+    {
+        MT_CIRCULAR_BUFFER_PREFETCH_WRITE( ring->buff_desc[slot] );
+        const char* payload = reinterpret_cast< const char* >( &(ring->storage( live_block, slot )) );
+        for( size_t b=0; b<prefetch_bytes; b+=MT_CIRCULAR_BUFFER_CACHE_LINE )
+            MT_CIRCULAR_BUFFER_PREFETCH_WRITE( payload+b );
+    }
+
+    inline void prefetch_slot_for_read( size_t slot )
+    {
+        MT_CIRCULAR_BUFFER_PREFETCH_READ( ring->buff_desc[slot] );
+        const char* payload = reinterpret_cast< const char* >( &(ring->slot_data(slot)) );
+        for( size_t b=0; b<prefetch_bytes; b+=MT_CIRCULAR_BUFFER_CACHE_LINE )
+            MT_CIRCULAR_BUFFER_PREFETCH_READ( payload+b );
+    }
+
+    inline void throw_on_failure( AcquireResult res )
+    {
+        if( res==ACQUIRE_SLOT_TIMEOUT )
+            throw SlotAcqTimeout();
+        if( res==ACQUIRE_DATA_TIMEOUT )
+            throw DataAvailableTimeout();
+    }
+
+    static inline bool items_equal( const T& a, const T& b )
+    {
+        return a==b;
+    }
+
+    /**
+     * @brief try_deduplicate is called when write access to acc is released. If the written item
+     *        is equal to the previous one, it rolls back the write position so that the slot is
+     *        reused by the next write, and returns true.
+     *        The slot lock of acc is held, while the write path locks main_mtx first: main_mtx and
+     *        the previous slot are only try-locked, and the item is published as is if either is busy.
+     */
+    inline bool try_deduplicate( const BufferSlotWriteAccess& acc )
+    {
+        Ring& r = *acc.ring;    // no resize while a write access is granted
+        BufferSlotDescriptor& desc = *r.buff_desc[ acc.slot ];
+        if( dedup_hash )
+            desc.hash = dedup_hash( r.slot_data(acc.slot) );
+        if( acc.seq==0 || acc.seq<=first_valid_seq )
+            return false;
+
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx, boost::try_to_lock );
+        if( !sc_lock.owns_lock() || w_seq != acc.seq+1 ) // other writes were granted meanwhile, cannot roll back
+            return false;
+
+        const size_t prev = (acc.slot+r.size()-1)%r.size();
+        if( prev==acc.slot )
+            return false;
+        BufferSlotDescriptor& prev_desc = *r.buff_desc[ prev ];
+        boost::shared_lock< slot_mutex_type > prev_lock( prev_desc.slot_mtx, boost::try_to_lock ); // stable block (see thaw)
+        if( !prev_lock.owns_lock() || prev_desc.seq != acc.seq-1 )
+            return false;
+
+        const bool equal = dedup_hash ? prev_desc.hash==desc.hash : dedup_equal( r.slot_data(prev), r.slot_data(acc.slot) );
+        if( !equal )
+            return false;
+
+        prev_desc.repeats++;
+        n_deduplicated++;
+
+        desc.writing = false;
+        desc.is_dirty = false;
+        curr_w_slot = acc.slot;
+        w_seq = acc.seq;
+
+        // If the ring was full, the rolled back write has overwritten the oldest item anyway
+        if( acc.seq >= r.size() && acc.seq-r.size()+1 > first_valid_seq )
+            first_valid_seq = acc.seq-r.size()+1;
+        return true;
+    }
+
+    /**
+     * @brief thaw is called when a FrozenRing is released. Slots whose item is still stored in the
+     *        frozen block are copied to the live one, then the frozen block becomes the standby.
+     */
+    inline void thaw()
+    {
+        size_t frozen_block;
+        {
+            boost::unique_lock< main_mutex_type > sc_lock( main_mtx );
+            frozen_block = 1-live_block;
+        }
+        for( size_t i=0; i<ring->size(); ++i )
+        {
+            BufferSlotDescriptor& desc = *ring->buff_desc[i];
+            boost::unique_lock< slot_mutex_type > um( desc.slot_mtx );
+            if( desc.block == frozen_block )
+            {
+                ring->storage( 1-frozen_block, i ) = ring->storage( frozen_block, i );
+                desc.block = 1-frozen_block;
+            }
+        }
+        boost::unique_lock< main_mutex_type > sc_lock( main_mtx );
+        frozen = false;
+    }
+
+    /**
+     * @brief migrate replaces the ring with next, copying the newest published items. Called with
+     *        main_mtx held and no write access granted
+     * @return false, without migrating, if some items are in flight (see enable_ack_window)
+     */
+    inline bool migrate( Ring* next, MTFixedQueue< size_t >& next_dirty )
+    {
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+        {
+            // Items are only put in flight with data_available_mutex held
+            boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+            if( !ack_window.empty() )
+                return false;
+        }
+        boost::unique_lock< slot_mutex_type > ring_lock( ring_mtx );
+        Ring& old = *ring;
+
+        const seq_type end = w_seq;
+        seq_type first = oldest_seq();
+        if( end-first > next->size() )
+            first = end-next->size();
+        next->base_seq = first;
+
+        for( seq_type seq=first; seq<end; ++seq )
+        {
+            const size_t from_slot = old.slot_of( seq );
+            const BufferSlotDescriptor& from = *old.buff_desc[ from_slot ];
+            if( from.seq != seq ) // discarded by clear()
+                continue;
+            const size_t slot = next->slot_of( seq );
+            BufferSlotDescriptor& to = *next->buff_desc[ slot ];
+            next->buff[ slot ] = old.slot_data( from_slot );
+            to.seq = seq;
+            to.tag = from.tag;
+            to.repeats = from.repeats.load();
+            to.hash = from.hash;
+            to.published = from.published;
+        }
+
+        // Items not consumed yet are queued again in the same order. Items being consumed were
+        // already removed from the queue
+        for( size_t i=0; i<dirty_slots.size(); ++i )
+        {
+            const seq_type seq = old.buff_desc[ dirty_slots.at(i) ]->seq;
+            if( seq>=first && seq<end )
+            {
+                next->buff_desc[ next->slot_of( seq ) ]->is_dirty = true;
+                next_dirty.push( next->slot_of( seq ) );
+            }
+        }
+        dirty_slots.swap( next_dirty );
+
+        ring = next;
+        n_slots = next->size();
+        live_block = 0;
+        curr_w_slot = next->slot_of( end );
+        if( first > first_valid_seq )
+            first_valid_seq = first;
+        if( prefetch_distance >= next->size() )
+            prefetch_distance = next->size()-1;
+
+        n_resizes++;
+        retired_rings.push_back( &old );
+        for( size_t i=0; i<retired_rings.size(); )
+        {
+            if( retired_rings[i]->n_refs==0 )
+            {
+                delete retired_rings[i];
+                retired_rings.erase( retired_rings.begin()+i );
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        data_available.notify_all();
+        return true;
+    }
+
+    /**
+     * @brief wait_acked waits until slot is not in flight (see enable_ack_window). Called by the
+     *        producer with main_mtx and the slot lock held
+     * @return false if the deadline expired
+     */
+    inline bool wait_acked( size_t slot, const boost::system_time& deadline )
+    {
+        if( ack_window_size==0 )
+            return true;
+        const BufferSlotDescriptor& desc = *ring->buff_desc[slot];
+        boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+        while( desc.in_flight )
+        {
+            if( !slot_acked.timed_wait( ack_lock, deadline ) )
+                return !desc.in_flight;
+        }
+        return true;
+    }
+
+    /**
+     * @brief redirect_pinned moves slot to a free storage cell if its current cell is pinned by a
+     *        Snapshot. Called by the producer with main_mtx and the slot lock held; never blocks for long
+     */
+    inline void redirect_pinned( size_t slot )
+    {
+        Ring& r = *ring;
+        if( r.spare_cells.empty() )
+            return;
+
+        BufferSlotDescriptor& desc = *r.buff_desc[slot];
+        boost::unique_lock< data_mutex_type > snapshot_lock( snapshot_mtx );
+        if( r.cell_pins[ desc.cell ]==0 )
+            return;
+
+        // There are at most spare_cells.size()-1 other pinned cells, so a free one always exists
+        r.cell_owned[ desc.cell ] = false;
+        desc.cell = r.free_cells.front();
+        r.free_cells.pop();
+        r.cell_owned[ desc.cell ] = true;
+    }
+
+    inline void release_snapshot( const Snapshot& snap )
+    {
+        Ring& r = *snap.ring;
+        {
+            boost::unique_lock< data_mutex_type > snapshot_lock( snapshot_mtx );
+            if( --r.cell_pins[ snap.cell ]==0 && !r.cell_owned[ snap.cell ] )
+                r.free_cells.push( snap.cell );
+            r.n_snapshots--;
+        }
+        r.n_refs--;
+    }
+
+    /**
+     * @brief try_consume_front consumes the least recently produced slot. If in_flight, the slot is
+     *        also appended to the ack window, in consume order (a place must have been reserved)
+     */
+    inline AcquireResult try_consume_front( BufferSlotConsumeAccess& acc, bool in_flight )
+    {
+        boost::posix_time::time_duration lock_timeout(0, 0, DEFAULT_LOCK_TIMEOUT_SEC);
+        boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+
+        size_t slot;
+        boost::shared_lock< slot_mutex_type > um;
+        const AcquireResult res = lock_queued( data_available_lock, um, slot, false, boost::get_system_time()+lock_timeout );
+        if( res!=ACQUIRE_OK )
+        {
+            if( res==ACQUIRE_SLOT_TIMEOUT )
+                data_available.notify_all(); // We failed to lock this slot, maybe someone else will succeed
+            return res;
+        }
+
+        // Now we got the access to this slot, so we can safely remove it from the consume queue
+        dirty_slots.pop();
+
+        for( size_t i=0; i<prefetch_distance && i<dirty_slots.size(); ++i )
+            prefetch_slot_for_read( dirty_slots.at(i) );
+
+        grant_access( acc, slot, um );
+        count_consumed( acc.seq, slot );
+        if( in_flight )
+        {
+            boost::unique_lock< data_mutex_type > ack_lock( ack_mtx );
+            ring->buff_desc[slot]->in_flight = true;
+            ack_window.push( slot );
+            n_ack_reserved--;
+        }
+        return ACQUIRE_OK;
+    }
+
+    /**
+     * @brief lock_queued waits until the consume queue is not empty and locks its oldest slot (or its
+     *        newest one, if newest). Called with data_available_lock held, which is released while
+     *        waiting for a busy slot: the producer holding it needs data_available_mutex to publish
+     * @param slot Set to the locked slot. If newest, on input the slot that must not be returned: the
+     *        call waits until a newer item is published
+     */
+    inline AcquireResult lock_queued( boost::unique_lock< data_mutex_type >& data_available_lock, boost::shared_lock< slot_mutex_type >& um,
+                                      size_t& slot, bool newest, const boost::system_time& deadline )
+    {
+        const size_t not_slot = slot;
+        BlockedTimer blocked( registered_metrics() );
+        while( true )
+        {
+            // wait until some data is available
+            while( dirty_slots.empty() || ( newest && dirty_slots.back()==not_slot ) )
+            {
+                blocked.start();
+                if( !data_available.timed_wait( data_available_lock, deadline ) )
+                {
+                    return ACQUIRE_DATA_TIMEOUT;
+                }
+            }
+
+            slot = newest ? dirty_slots.back() : dirty_slots.front();
+            Ring* r = ring;
+            boost::shared_lock< slot_mutex_type >( r->buff_desc[slot]->slot_mtx , boost::try_to_lock ).swap( um );
+            if( um.owns_lock() )
+                return ACQUIRE_OK;
+
+            blocked.start();
+            r->n_refs++;    // the ring may be replaced while waiting (see resize)
+            data_available_lock.unlock();
+            boost::shared_lock< slot_mutex_type >( r->buff_desc[slot]->slot_mtx , deadline ).swap( um );
+            data_available_lock.lock();
+            r->n_refs--;
+            if( !um.owns_lock() ) //owns_lock is false if lock failed
+                return ACQUIRE_SLOT_TIMEOUT;
+
+            // The queue may have changed meanwhile
+            if( r==ring && !dirty_slots.empty() && slot==( newest ? dirty_slots.back() : dirty_slots.front() ) )
+                return ACQUIRE_OK;
+            um.unlock();
+        }
+    }
+
+    /**
+     * @brief grant_access fills a read, consume or peek access to slot, whose lock is held by um.
+     *        The caller must prevent the ring from being replaced (see resize)
+     */
+    template< typename ACCESS >
+    inline void grant_access( ACCESS& acc, size_t slot, boost::shared_lock< slot_mutex_type >& um )
+    {
+        grant_access( acc, *ring, slot, um );
+    }
+
+    /**
+     * @brief grant_access same as above, for a slot of r, that may have been replaced already:
+     *        the caller must hold a reference on r (see Ring::n_refs)
+     */
+    template< typename ACCESS >
+    inline void grant_access( ACCESS& acc, Ring& r, size_t slot, boost::shared_lock< slot_mutex_type >& um )
+    {
+        BufferSlotDescriptor& desc = *r.buff_desc[slot];
+        acc._slot = slot;
+        acc._seq = desc.seq;
+        acc.tag = desc.tag;
+        acc.repeats = desc.repeats;
+        acc.data = &(r.slot_data(slot));
+        acc.srcBuffer = this;
+        acc.ring = &r;
+        r.n_refs++;
+        desc.n_reading++;
+        acc.slot_lock.swap( um );
+    }
+
+    /**
+     * @brief count_consumed updates the consumer statistics, and the metrics of the calling consumer
+     *        if registered. Must be called with data_available_mutex held
+     */
+    inline void count_consumed( seq_type seq, size_t slot )
+    {
+        n_consumed++;
+        const seq_type next = w_seq;
+        const boost::uint64_t lag = next > seq ? next-seq-1 : 0;
+        if( lag > peak_lag )
+            peak_lag = lag;
+        for( size_t i=0; i<peak_windows.size(); ++i )
+            if( lag > peak_windows[i]->peak_lag )
+                peak_windows[i]->peak_lag = lag;
+
+        ConsumerMetrics* metrics = registered_metrics();
+        if( metrics )
+        {
+            const boost::system_time& published = ring->buff_desc[slot]->published;
+            const boost::int64_t lag_us = published.is_special() ? 0 : ( boost::get_system_time()-published ).total_microseconds();
+            metrics->count( lag, lag_us>0 ? lag_us : 0 );
+        }
+    }
+
+    /**
+     * @return the metrics registered by the calling thread, or 0 (see register_consumer)
+     */
+    inline ConsumerMetrics* registered_metrics() const
+    {
+        return n_consumer_metrics>0 ? consumer_metrics.get() : 0;
+    }
+
+    static void keep_metrics( ConsumerMetrics* ) {}   // registered metrics are owned by the consumer
+
+    /**
+     * @brief BlockedTimer adds the time elapsed since the first start() to the blocked time of a
+     *        registered consumer, when destroyed
+     */
+    struct BlockedTimer : private boost::noncopyable
+    {
+        explicit BlockedTimer( ConsumerMetrics* _metrics ) : metrics(_metrics), running(false) {}
+        inline ~BlockedTimer()
+        {
+            if( running )
+                metrics->count_blocked( ( boost::get_system_time()-since ).total_microseconds() );
+        }
+        inline void start()
+        {
+            if( metrics && !running )
+            {
+                since = boost::get_system_time();
+                running = true;
+            }
+        }
+
+        ConsumerMetrics* metrics;
+        boost::system_time since;
+        bool running;
     };
 
+    /**
+     * @brief publish_slot makes a written slot available to consumers and filtered subscriptions.
+     *        Must be called with data_available_mutex held
+     */
+    inline void publish_slot( size_t slot, seq_type seq, boost::uint32_t tag )
+    {
+        if( n_consumer_metrics>0 )
+            ring->buff_desc[slot]->published = boost::get_system_time();
+        dirty_slots.push( slot );
+        n_written++;
+        if( dirty_slots.size() > peak_occupancy )
+            peak_occupancy = dirty_slots.size();
+        for( size_t i=0; i<peak_windows.size(); ++i )
+            if( dirty_slots.size() > peak_windows[i]->peak_occupancy )
+                peak_windows[i]->peak_occupancy = dirty_slots.size();
+        for( size_t i=0; i<subscriptions.size(); ++i )
+        {
+            FilteredSubscription& sub = *subscriptions[i];
+            if( sub.pred( tag ) )
+            {
+                if( sub.pending.push( seq ) )
+                    sub.missed++;
+                sub.matched.notify_one();
+            }
+            else
+            {
+                sub.filtered++;
+            }
+        }
+    }
+
     inline void release_slot_access( const BufferSlotWriteAccess& acc )
     {
-        //boost::unique_lock< boost::timed_mutex > sc_lock( main_mtx );
-        buff_desc[ acc.slot ]->writing = false;
-        buff_desc[ acc.slot ]->is_dirty = true;
-        dirty_slots.push( acc.slot );
+        if( ( dedup_equal || dedup_hash ) && try_deduplicate( acc ) )
+        {
+#ifdef MT_CIRCULAR_BUFFER_DEBUG
+            std::cout << "Write access released on slot " << acc.slot << ", duplicate item discarded" << std::endl;
+#endif
+            n_writing--;
+            return;
+        }
 
-        while( dirty_slots.size() > size() )
-            dirty_slots.pop();
+        BufferSlotDescriptor& desc = *acc.ring->buff_desc[ acc.slot ];
+        desc.writing = false;
+        desc.is_dirty = true;
+        desc.tag = acc.tag;
+        desc.seq = acc.seq;
+        bool history_waiting;
+        {
+            boost::unique_lock< data_mutex_type > data_available_lock( data_available_mutex );
+            publish_slot( acc.slot, acc.seq, acc.tag );
+            history_waiting = n_history_waiters>0;
+        }
+        n_writing--;    // published: resize can migrate this slot
 
         data_available.notify_one();
+        if( history_waiting )
+            seq_published.notify_all();
 
 #ifdef MT_CIRCULAR_BUFFER_DEBUG
         std::cout << "Write access released on slot " << acc.slot << ", dirty slot produced" << std::endl;
@@ -436,7 +2799,7 @@ private:
     inline void release_slot_access( const BufferSlotReadAccess& acc )
     {
         //boost::unique_lock< boost::timed_mutex > sc_lock( main_mtx );
-        buff_desc[ acc.slot ]->n_reading--;
+        acc.ring->buff_desc[ acc.slot ]->n_reading--;
 #ifdef MT_CIRCULAR_BUFFER_DEBUG
         std::cout << "Read access released on slot " << acc.slot <<   std::endl;
 #endif
@@ -444,22 +2807,63 @@ private:
     inline void release_slot_access( const BufferSlotConsumeAccess& acc )
     {
         //boost::unique_lock< boost::timed_mutex > sc_lock( main_mtx );
-        buff_desc[ acc.slot ]->is_dirty = false;
-        buff_desc[ acc.slot ]->n_reading--;
+        acc.ring->buff_desc[ acc.slot ]->is_dirty = false;
+        acc.ring->buff_desc[ acc.slot ]->n_reading--;
 #ifdef MT_CIRCULAR_BUFFER_DEBUG
         std::cout << "Consume access released on slot " << acc.slot << ", dirty slot consumed" << std::endl;
 #endif
     }
 
-    boost::timed_mutex main_mtx;
-
-    boost::condition_variable data_available;
-    boost::mutex data_available_mutex;
+    inline void release_slot_access( const BufferSlotPeekAccess& acc )
+    {
+        acc.ring->buff_desc[ acc.slot ]->n_reading--;
+#ifdef MT_CIRCULAR_BUFFER_DEBUG
+        std::cout << "Peek access released on slot " << acc.slot <<   std::endl;
+#endif
+    }
 
-	std::vector< T > buff;
-	std::vector< BufferSlotDescriptor* > buff_desc;
-    std::queue< size_t > dirty_slots;
+    main_mutex_type main_mtx;
+
+    data_condition_type data_available;
+    mutable data_mutex_type data_available_mutex;
+    data_condition_type seq_published;
+    size_t n_history_waiters;
+    std::vector< FilteredSubscription* > subscriptions;
+
+    Ring* ring;                     // guarded by main_mtx, data_available_mutex and ring_mtx (see resize)
+    mutable slot_mutex_type ring_mtx;       // held shared by the accesses that hold neither main_mtx nor data_available_mutex, only while choosing the slot
+    std::vector< Ring* > retired_rings;
+    boost::atomic< size_t > n_slots;
+    MTFixedQueue< size_t > dirty_slots;
+    size_t live_block;              // block written by the producer, guarded by main_mtx
+    bool frozen;                    // guarded by main_mtx
+    boost::atomic< size_t > n_writing;
+    data_mutex_type snapshot_mtx;
+    size_t n_spare_cells;           // maximum number of Snapshot alive at the same time
     size_t curr_w_slot;
+    boost::atomic< seq_type > w_seq;
+    boost::atomic< seq_type > first_valid_seq;
+    size_t prefetch_distance;
+    size_t prefetch_bytes;
+    bool (*dedup_equal)( const T&, const T& );
+    boost::function< size_t ( const T& ) > dedup_hash;
+    boost::atomic< boost::uint64_t > n_deduplicated;
+    boost::atomic< boost::uint64_t > n_written;
+    boost::atomic< boost::uint64_t > n_overwritten;
+    boost::atomic< boost::uint64_t > n_consumed;
+    boost::atomic< boost::uint64_t > n_resizes;
+    boost::atomic< size_t > peak_occupancy;        // updated with data_available_mutex held
+    boost::atomic< boost::uint64_t > peak_lag;     // updated with data_available_mutex held
+    std::vector< PeakWindow* > peak_windows;       // guarded by data_available_mutex
+    boost::atomic< size_t > recommended_size;
+    mutable data_mutex_type ack_mtx;
+    data_condition_type slot_acked;
+    MTFixedQueue< size_t > ack_window;  // slots in flight, in consume order, guarded by ack_mtx
+    size_t ack_window_size;         // maximum number of items in flight (0 if the ack window is disabled)
+    size_t n_ack_reserved;          // guarded by ack_mtx
+    seq_type acked_end;             // guarded by ack_mtx
+    boost::thread_specific_ptr< ConsumerMetrics > consumer_metrics;    // see register_consumer
+    boost::atomic< size_t > n_consumer_metrics;
 };
 
 
@@ -0,0 +1,805 @@
+/**
+ *  MTCircularBuffer Benchmarks
+ *
+ *  Usage: MTCircularBufferBENCH [--perf] [name filter]
+ *
+ *  --perf  also reports hardware and software counters per operation (Linux perf events)
+ *
+ */
+#include "MTCircularBuffer.hpp"
+#include "MTCircularDeltaHistory.hpp"
+#include "MTCircularBufferStage.hpp"
+#include "MTCircularBufferWorkload.hpp"
+#include "MTCircularBufferVariant.hpp"
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if ( defined(__GNUC__) || defined(__clang__) ) && ( defined(__x86_64__) || defined(__i386__) )
+    #include <x86intrin.h>
+    #define MT_BENCH_HAS_TSC 1
+#elif defined(_WIN32)
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+#if defined(__linux__)
+    #include <fstream>
+    #include <linux/perf_event.h>
+    #include <sched.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+#endif
+
+
+struct BenchResult
+{
+    std::string name;
+    size_t n_ops;
+    double seconds;
+};
+
+static std::string bench_filter;
+static bool bench_perf = false;
+
+
+/*
+ * PerfCounters counts cycles, L1D and LLC read misses, branch misses and context switches of the
+ * calling thread and of the threads it creates while counting. Counters that cannot be opened
+ * (no kernel support, perf_event_paranoid, virtual machines...) are reported as n/a.
+ */
+class PerfCounters
+{
+public:
+    enum { CYCLES, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, CONTEXT_SWITCHES, N_COUNTERS };
+
+    PerfCounters()
+    {
+        for( int i=0; i<N_COUNTERS; ++i )
+        {
+            fds[i] = -1;
+            values[i] = 0;
+        }
+#if defined(__linux__)
+        fds[CYCLES] = open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES );
+        fds[L1D_MISSES] = open( PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) );
+        fds[LLC_MISSES] = open( PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) );
+        fds[BRANCH_MISSES] = open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES );
+        fds[CONTEXT_SWITCHES] = open( PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES );
+#endif
+    }
+
+    ~PerfCounters()
+    {
+#if defined(__linux__)
+        for( int i=0; i<N_COUNTERS; ++i )
+            if( fds[i]>=0 )
+                close( fds[i] );
+#endif
+    }
+
+    inline bool any() const
+    {
+        for( int i=0; i<N_COUNTERS; ++i )
+            if( fds[i]>=0 )
+                return true;
+        return false;
+    }
+
+    inline void start()
+    {
+#if defined(__linux__)
+        for( int i=0; i<N_COUNTERS; ++i )
+        {
+            if( fds[i]<0 )
+                continue;
+            ioctl( fds[i], PERF_EVENT_IOC_RESET, 0 );
+            ioctl( fds[i], PERF_EVENT_IOC_ENABLE, 0 );
+        }
+#endif
+    }
+
+    inline void stop()
+    {
+#if defined(__linux__)
+        for( int i=0; i<N_COUNTERS; ++i )
+        {
+            if( fds[i]<0 )
+                continue;
+            ioctl( fds[i], PERF_EVENT_IOC_DISABLE, 0 );
+            boost::uint64_t v = 0;
+            values[i] = read( fds[i], &v, sizeof(v) )==sizeof(v) ? v : 0;
+        }
+#endif
+    }
+
+    /**
+     * @return the per-operation counts, n/a for the counters that could not be opened
+     */
+    inline std::string per_op( size_t n_ops ) const
+    {
+        static const char* names[N_COUNTERS] = { "cyc", "L1D-miss", "LLC-miss", "br-miss", "ctx-sw" };
+        std::stringstream ss;
+        ss << std::fixed << std::setprecision(2);
+        for( int i=0; i<N_COUNTERS; ++i )
+        {
+            ss << "  " << names[i] << "/op ";
+            if( fds[i]<0 )
+                ss << "n/a";
+            else
+                ss << static_cast< double >( values[i] )/n_ops;
+        }
+        return ss.str();
+    }
+
+private:
+#if defined(__linux__)
+    static inline int open( boost::uint32_t type, boost::uint64_t config )
+    {
+        perf_event_attr attr;
+        std::memset( &attr, 0, sizeof(attr) );
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;           // count the threads created by the scenario too
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        const long fd = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+        if( fd<0 && type==PERF_TYPE_SOFTWARE )
+        {
+            // Context switches happen in the kernel, retry counting them there
+            attr.exclude_kernel = 0;
+            return static_cast< int >( syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 ) );
+        }
+        return static_cast< int >( fd );
+    }
+#endif
+
+    int fds[N_COUNTERS];
+    boost::uint64_t values[N_COUNTERS];
+};
+
+/*
+ * Starts counting for a scenario. The counters are opened only with --perf, so that plain runs do
+ * not pay for them: returns null otherwise.
+ */
+inline PerfCounters* start_perf_counters()
+{
+    if( !bench_perf )
+        return 0;
+    PerfCounters* counters = new PerfCounters();
+    counters->start();
+    return counters;
+}
+
+template< typename F >
+inline void run_bench( const std::string& name, size_t n_ops, F fn )
+{
+    if( !bench_filter.empty() && name.find( bench_filter )==std::string::npos )
+        return;
+
+    boost::scoped_ptr< PerfCounters > counters( start_perf_counters() );
+    const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+    fn();
+    const boost::posix_time::time_duration dt = boost::posix_time::microsec_clock::universal_time()-t0;
+    if( counters )
+        counters->stop();
+
+    BenchResult res;
+    res.name = name;
+    res.n_ops = n_ops;
+    res.seconds = dt.total_microseconds()*1E-6;
+
+    std::cout << std::left << std::setw(48) << res.name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(1) << (res.seconds*1E9/res.n_ops) << " ns/op"
+              << std::setw(14) << std::setprecision(0) << (res.n_ops/res.seconds) << " op/s"
+              << ( counters ? counters->per_op( res.n_ops ) : std::string() ) << std::endl;
+}
+
+template< size_t BYTES >
+inline void run_workload( const std::string& name, size_t buffer_size, const MTWorkloadConfig& cfg )
+{
+    if( !bench_filter.empty() && name.find( bench_filter )==std::string::npos )
+        return;
+
+    typename MTCircularBufferWorkload< BYTES >::Buffer buff( buffer_size );
+    boost::scoped_ptr< PerfCounters > counters( start_perf_counters() );
+    const MTWorkloadReport report = MTCircularBufferWorkload< BYTES >( buff, cfg ).run();
+    if( counters )
+        counters->stop();
+
+    // An operation is an item produced, consumed or read
+    std::cout << std::left << std::setw(48) << name << report.to_string()
+              << ( counters ? counters->per_op( report.n_produced+report.n_consumed+report.n_read ) : std::string() ) << std::endl;
+}
+
+
+/*
+ * Prefetch: the ring is much larger than the cache, so every write_next and
+ * consume_next_available touches a cold slot unless it was prefetched.
+ */
+struct Frame
+{
+    char bytes[512];
+};
+
+struct PrefetchBench
+{
+    PrefetchBench( size_t _distance, size_t _n_ops ) : distance(_distance), n_ops(_n_ops) {}
+
+    void operator()()
+    {
+        const size_t burst = 64;
+        MTCircularBuffer< Frame > buff( 32768 );
+        buff.set_prefetch( distance, sizeof(Frame) );
+
+        size_t checksum = 0;
+        for( size_t i=0; i<n_ops; i+=burst )
+        {
+            for( size_t j=0; j<burst; ++j )
+            {
+                MTCircularBuffer< Frame >::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                std::memset( wa.data->bytes, static_cast<int>(i+j), sizeof(Frame) );
+            }
+            for( size_t j=0; j<burst; ++j )
+            {
+                MTCircularBuffer< Frame >::BufferSlotConsumeAccess ca;
+                buff.consume_next_available( ca );
+                for( size_t k=0; k<sizeof(Frame); k+=MT_CIRCULAR_BUFFER_CACHE_LINE )
+                    checksum += ca.data->bytes[k];
+            }
+        }
+        if( checksum==1 )
+            std::cout << "";
+    }
+
+    size_t distance;
+    size_t n_ops;
+};
+
+
+/*
+ * Streaming copy: each op copies a 4 MB frame into the ring and out of it again.
+ * After each op a 256 KB "victim" working set is re-read: the slower it is, the
+ * more the copies evicted it from the cache.
+ */
+struct BigFrame
+{
+    char bytes[4*1024*1024];
+};
+
+struct StreamCopyBench
+{
+    StreamCopyBench( bool _streaming, size_t _n_ops ) : streaming(_streaming), n_ops(_n_ops) {}
+
+    void operator()()
+    {
+        MTCircularBuffer< BigFrame > buff( 4 );
+        std::vector< char > src( sizeof(BigFrame), 1 );
+        std::vector< char > dst( sizeof(BigFrame) );
+        std::vector< size_t > victim( 256*1024/sizeof(size_t), 1 );
+
+        size_t checksum = 0;
+        boost::posix_time::time_duration victim_time;
+        for( size_t i=0; i<n_ops; ++i )
+        {
+            if( streaming )
+            {
+                buff.write_copy( &src[0], src.size() );
+                buff.consume_copy( &dst[0], dst.size() );
+            }
+            else
+            {
+                {
+                    MTCircularBuffer< BigFrame >::BufferSlotWriteAccess wa;
+                    buff.write_next( wa );
+                    std::memcpy( wa.data, &src[0], src.size() );
+                }
+                {
+                    MTCircularBuffer< BigFrame >::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    std::memcpy( &dst[0], ca.data, dst.size() );
+                }
+            }
+
+            const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+            for( size_t j=0; j<victim.size(); j+=MT_CIRCULAR_BUFFER_CACHE_LINE/sizeof(size_t) )
+                checksum += victim[j];
+            victim_time += boost::posix_time::microsec_clock::universal_time()-t0;
+        }
+
+        std::cout << "    " << std::fixed << std::setprecision(2)
+                  << (2.0*sizeof(BigFrame)*n_ops/1E9) << " GB copied, victim re-read "
+                  << (victim_time.total_microseconds()/double(n_ops)) << " us/pass"
+                  << ( checksum==1 ? " " : "" ) << std::endl;
+    }
+
+    bool streaming;
+    size_t n_ops;
+};
+
+
+/*
+ * Delta history: records of 4 slowly varying doubles, pushed and then decoded
+ * back in ranges. Reports the stored bytes per record against sizeof(record).
+ */
+typedef MTCircularDeltaHistory< double, 4 > DeltaHistory;
+
+struct DeltaHistoryPushBench
+{
+    DeltaHistoryPushBench( DeltaHistory& _history, size_t _n_ops ) : history(_history), n_ops(_n_ops) {}
+
+    void operator()()
+    {
+        double rec[4] = { 20.0, 1013.25, 0.0, 50.0 };
+        for( size_t i=0; i<n_ops; ++i )
+        {
+            if( i%16==0 )
+                rec[0] += 0.125;
+            if( i%64==0 )
+                rec[1] -= 0.25;
+            rec[2] = double( (i/8)%100 );
+            history.push( rec );
+        }
+        std::cout << "    " << std::fixed << std::setprecision(2) << history.bytes_per_record()
+                  << " bytes/record stored (raw " << DeltaHistory::RECORD_BYTES << ")" << std::endl;
+    }
+
+    DeltaHistory& history;
+    size_t n_ops;
+};
+
+struct DeltaHistoryReadBench
+{
+    DeltaHistoryReadBench( DeltaHistory& _history, size_t _n_ops ) : history(_history), n_ops(_n_ops) {}
+
+    void operator()()
+    {
+        std::vector< double > out( 4*1024 );
+        double checksum = 0;
+        size_t done = 0;
+        DeltaHistory::seq_type s = history.oldest_seq();
+        while( done < n_ops )
+        {
+            size_t n_read = 0;
+            if( history.read_range( s, 1024, &out[0], &n_read )!=DeltaHistory::READ_OK )
+                s = history.oldest_seq();
+            checksum += out[0];
+            done += n_read;
+            s += n_read;
+        }
+        if( checksum==1 )
+            std::cout << "";
+    }
+
+    DeltaHistory& history;
+    size_t n_ops;
+};
+
+
+/*
+ * Staging: several threads write short items into the same buffer, either
+ * directly (one write position acquisition per item) or through a private
+ * MTCircularBufferStage (one acquisition per batch).
+ */
+struct StageProducer
+{
+    StageProducer( MTCircularBuffer< int >& _buff, size_t _batch, size_t _n_ops ) : buff(_buff), batch(_batch), n_ops(_n_ops) {}
+
+    void operator()()
+    {
+        if( batch==0 )
+        {
+            for( size_t i=0; i<n_ops; ++i )
+            {
+                MTCircularBuffer< int >::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = static_cast<int>(i);
+            }
+            return;
+        }
+        MTCircularBufferStage< int > stage( buff, batch, boost::posix_time::milliseconds(1) );
+        for( size_t i=0; i<n_ops; ++i )
+            stage.push( static_cast<int>(i) );
+    }
+
+    MTCircularBuffer< int >& buff;
+    size_t batch;
+    size_t n_ops;
+};
+
+struct StageBench
+{
+    StageBench( size_t _n_threads, size_t _batch, size_t _n_ops ) : n_threads(_n_threads), batch(_batch), n_ops(_n_ops) {}
+
+    void operator()()
+    {
+        MTCircularBuffer< int > buff( 65536 );
+        boost::thread_group producers;
+        for( size_t t=0; t<n_threads; ++t )
+            producers.create_thread( StageProducer( buff, batch, n_ops/n_threads ) );
+        producers.join_all();
+    }
+
+    size_t n_threads;
+    size_t batch;
+    size_t n_ops;
+};
+
+
+/*
+ * Heterogeneous messages: one stream of two message types, carried either as
+ * shared pointers to a common base (one allocation per message) or inline in
+ * variant slots (see MTCircularBufferVariant.hpp).
+ */
+struct BaseMessage
+{
+    virtual ~BaseMessage() {}
+    virtual int value() const = 0;
+};
+
+struct TickMessage : public BaseMessage
+{
+    int price;
+    int value() const { return price; }
+};
+
+struct OrderMessage : public BaseMessage
+{
+    int qty;
+    char side[8];
+    int value() const { return qty; }
+};
+
+struct PlainTick { int price; };
+struct PlainOrder { int qty; char side[8]; };
+#if defined(MT_CIRCULAR_BUFFER_HAS_STD_VARIANT)
+typedef std::variant< PlainTick, PlainOrder > PlainMessage;    // constructed in place
+#else
+typedef boost::variant< PlainTick, PlainOrder > PlainMessage;
+#endif
+
+struct PlainValue : public boost::static_visitor< int >
+{
+    int operator()( const PlainTick& t ) const { return t.price; }
+    int operator()( const PlainOrder& o ) const { return o.qty; }
+};
+
+struct VariantBench
+{
+    VariantBench( bool _inline_slots, size_t _n_ops ) : inline_slots(_inline_slots), n_ops(_n_ops) {}
+
+    void operator()()
+    {
+        const size_t burst = 64;
+        size_t checksum = 0;
+        if( inline_slots )
+        {
+            MTCircularBuffer< PlainMessage > buff( 1024 );
+            for( size_t i=0; i<n_ops; i+=burst )
+            {
+                for( size_t j=0; j<burst; ++j )
+                {
+                    MTCircularBuffer< PlainMessage >::BufferSlotWriteAccess wa;
+                    if( j%2==0 )
+                        write_next_as< PlainTick >( buff, wa ).price = static_cast<int>(j);
+                    else
+                        write_next_as< PlainOrder >( buff, wa ).qty = static_cast<int>(j);
+                }
+                for( size_t j=0; j<burst; ++j )
+                    checksum += consume_next_visit( buff, PlainValue() );
+            }
+        }
+        else
+        {
+            MTCircularBuffer< boost::shared_ptr< BaseMessage > > buff( 1024 );
+            for( size_t i=0; i<n_ops; i+=burst )
+            {
+                for( size_t j=0; j<burst; ++j )
+                {
+                    MTCircularBuffer< boost::shared_ptr< BaseMessage > >::BufferSlotWriteAccess wa;
+                    buff.write_next( wa );
+                    if( j%2==0 )
+                    {
+                        TickMessage* t = new TickMessage;
+                        t->price = static_cast<int>(j);
+                        wa.data->reset( t );
+                    }
+                    else
+                    {
+                        OrderMessage* o = new OrderMessage;
+                        o->qty = static_cast<int>(j);
+                        wa.data->reset( o );
+                    }
+                }
+                for( size_t j=0; j<burst; ++j )
+                {
+                    MTCircularBuffer< boost::shared_ptr< BaseMessage > >::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    checksum += (*ca.data)->value();
+                }
+            }
+        }
+        if( checksum==1 )
+            std::cout << "";
+    }
+
+    bool inline_slots;
+    size_t n_ops;
+};
+
+
+/*
+ * Ping-pong: a sequence number bounces between two pinned threads through a
+ * pair of buffers. Half of the round trip, timed with the TSC where available,
+ * is the one-way handoff latency between the two CPUs.
+ */
+#if defined(MT_BENCH_HAS_TSC)
+    inline boost::uint64_t bench_ticks() { return __rdtsc(); }
+#elif defined(_WIN32)
+    inline boost::uint64_t bench_ticks()
+    {
+        LARGE_INTEGER t;
+        QueryPerformanceCounter( &t );
+        return static_cast< boost::uint64_t >( t.QuadPart );
+    }
+#else
+    // A monotonic clock: the time of day jumps (and wraps at midnight)
+    inline boost::uint64_t bench_ticks()
+    {
+        struct timespec t;
+        clock_gettime( CLOCK_MONOTONIC, &t );
+        return static_cast< boost::uint64_t >( t.tv_sec )*1000000000ULL+t.tv_nsec;
+    }
+#endif
+
+static double ticks_per_ns = 0;
+
+inline void calibrate_ticks()
+{
+    const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+    const boost::uint64_t c0 = bench_ticks();
+    boost::this_thread::sleep( boost::posix_time::milliseconds(100) );
+    const boost::uint64_t c1 = bench_ticks();
+    const boost::posix_time::time_duration dt = boost::posix_time::microsec_clock::universal_time()-t0;
+    ticks_per_ns = (c1-c0)/( dt.total_microseconds()*1E3 );
+}
+
+inline bool pin_to_cpu( int cpu )
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    return pthread_setaffinity_np( pthread_self(), sizeof(set), &set )==0;
+#else
+    (void)cpu;
+    return true;
+#endif
+}
+
+struct Placement
+{
+    Placement( const std::string& _name, int _cpu_a, int _cpu_b ) : name(_name), cpu_a(_cpu_a), cpu_b(_cpu_b) {}
+    std::string name;
+    int cpu_a;
+    int cpu_b;
+};
+
+inline int read_topology( int cpu, const char* what )
+{
+    int value = -1;
+#if defined(__linux__)
+    std::stringstream path;
+    path << "/sys/devices/system/cpu/cpu" << cpu << "/topology/" << what;
+    std::ifstream f( path.str().c_str() );
+    f >> value;
+#else
+    (void)cpu;
+    (void)what;
+#endif
+    return value;
+}
+
+/*
+ * Same core (both threads on cpu 0), its SMT sibling, another core of the
+ * same socket and a core of another socket, when the machine has them.
+ */
+inline std::vector< Placement > find_placements()
+{
+    std::vector< Placement > placements;
+    placements.push_back( Placement( "same core", 0, 0 ) );
+    const int n_cpus = static_cast< int >( boost::thread::hardware_concurrency() );
+    const int package0 = read_topology( 0, "physical_package_id" );
+    const int core0 = read_topology( 0, "core_id" );
+    bool sibling = false, same_socket = false, cross_socket = false;
+    for( int cpu=1; cpu<n_cpus; ++cpu )
+    {
+        const int package = read_topology( cpu, "physical_package_id" );
+        const int core = read_topology( cpu, "core_id" );
+        if( package<0 || core<0 )
+            continue;
+        if( package==package0 && core==core0 && !sibling )
+        {
+            placements.push_back( Placement( "SMT sibling", 0, cpu ) );
+            sibling = true;
+        }
+        else if( package==package0 && core!=core0 && !same_socket )
+        {
+            placements.push_back( Placement( "same socket", 0, cpu ) );
+            same_socket = true;
+        }
+        else if( package!=package0 && !cross_socket )
+        {
+            placements.push_back( Placement( "cross socket", 0, cpu ) );
+            cross_socket = true;
+        }
+    }
+    return placements;
+}
+
+template< typename SYNC >
+struct PingPongBuffers
+{
+    PingPongBuffers() : ping(16), pong(16) {}
+    MTCircularBuffer< boost::uint64_t, SYNC > ping;
+    MTCircularBuffer< boost::uint64_t, SYNC > pong;
+};
+
+template< typename SYNC >
+inline boost::uint64_t pingpong_receive( MTCircularBuffer< boost::uint64_t, SYNC >& buff, bool poll )
+{
+    if( poll )
+        while( buff.num_consumable_slots()==0 )
+            boost::this_thread::yield();
+    typename MTCircularBuffer< boost::uint64_t, SYNC >::BufferSlotConsumeAccess ca;
+    buff.consume_next_available( ca );
+    return *(ca.data);
+}
+
+template< typename SYNC >
+inline void pingpong_send( MTCircularBuffer< boost::uint64_t, SYNC >& buff, boost::uint64_t value )
+{
+    typename MTCircularBuffer< boost::uint64_t, SYNC >::BufferSlotWriteAccess wa;
+    buff.write_next( wa );
+    *(wa.data) = value;
+}
+
+template< typename SYNC >
+struct PingPongEcho
+{
+    PingPongEcho( PingPongBuffers< SYNC >& _b, int _cpu, bool _poll, size_t _n ) : b(&_b), cpu(_cpu), poll(_poll), n(_n) {}
+
+    void operator()()
+    {
+        pin_to_cpu( cpu );
+        for( size_t i=0; i<n; ++i )
+            pingpong_send( b->pong, pingpong_receive( b->ping, poll )+1 );
+    }
+
+    PingPongBuffers< SYNC >* b;
+    int cpu;
+    bool poll;
+    size_t n;
+};
+
+template< typename SYNC >
+inline void run_pingpong( const std::string& name, const Placement& placement, bool poll, size_t n_rounds )
+{
+    const std::string full_name = "ping-pong: " + placement.name + ", " + name + ( poll ? ", poll" : ", block" );
+    if( !bench_filter.empty() && full_name.find( bench_filter )==std::string::npos )
+        return;
+
+    const size_t n_warmup = n_rounds/10;
+    PingPongBuffers< SYNC > b;
+    std::vector< boost::uint64_t > one_way_ticks( n_rounds );
+    boost::scoped_ptr< PerfCounters > counters( start_perf_counters() );  // before the echo thread, which is counted too
+    boost::thread echo( PingPongEcho< SYNC >( b, placement.cpu_b, poll, n_warmup+n_rounds ) );
+    const bool pinned = pin_to_cpu( placement.cpu_a );
+    for( size_t i=0; i<n_warmup+n_rounds; ++i )
+    {
+        const boost::uint64_t t0 = bench_ticks();
+        pingpong_send( b.ping, i );
+        const boost::uint64_t reply = pingpong_receive( b.pong, poll );
+        const boost::uint64_t t1 = bench_ticks();
+        if( reply!=i+1 )
+            std::cout << full_name << ": unexpected reply " << reply << std::endl;
+        if( i>=n_warmup )
+            one_way_ticks[i-n_warmup] = (t1-t0)/2;
+    }
+    echo.join();
+    if( counters )
+        counters->stop();
+#if defined(__linux__)
+    cpu_set_t all;
+    CPU_ZERO( &all );
+    for( int cpu=0; cpu<static_cast< int >( boost::thread::hardware_concurrency() ); ++cpu )
+        CPU_SET( cpu, &all );
+    pthread_setaffinity_np( pthread_self(), sizeof(all), &all );
+#endif
+
+    std::sort( one_way_ticks.begin(), one_way_ticks.end() );
+    const double scale = 1.0/ticks_per_ns;
+    std::cout << std::left << std::setw(48) << full_name << std::right << std::fixed << std::setprecision(0)
+              << "min " << one_way_ticks.front()*scale
+              << "  median " << one_way_ticks[ n_rounds/2 ]*scale
+              << "  p99 " << one_way_ticks[ n_rounds*99/100 ]*scale
+              << "  p99.9 " << one_way_ticks[ n_rounds*999/1000 ]*scale
+              << "  max " << one_way_ticks.back()*scale << " ns one-way"
+              << ( pinned ? "" : " (not pinned)" )
+              << ( counters ? counters->per_op( n_warmup+n_rounds ) : std::string() ) << std::endl;    // per round trip
+}
+
+
+int main( int argc, char** argv )
+{
+    for( int i=1; i<argc; ++i )
+    {
+        if( std::string( argv[i] )=="--perf" )
+            bench_perf = true;
+        else
+            bench_filter = argv[i];
+    }
+    if( bench_perf && !PerfCounters().any() )
+    {
+        std::cout << "perf events unavailable (see /proc/sys/kernel/perf_event_paranoid), reporting wall-clock times only" << std::endl;
+        bench_perf = false;
+    }
+
+    const size_t n_ops = 1000000;
+    run_bench( "prefetch: distance 0 (disabled)", n_ops, PrefetchBench( 0, n_ops ) );
+    run_bench( "prefetch: distance 1", n_ops, PrefetchBench( 1, n_ops ) );
+    run_bench( "prefetch: distance 2", n_ops, PrefetchBench( 2, n_ops ) );
+
+    const size_t n_copies = 200;
+    run_bench( "copy 4 MB in/out: memcpy", n_copies, StreamCopyBench( false, n_copies ) );
+    run_bench( "copy 4 MB in/out: write_copy/consume_copy", n_copies, StreamCopyBench( true, n_copies ) );
+
+    DeltaHistory history( 16*1024*1024 );
+    run_bench( "delta history: push", n_ops, DeltaHistoryPushBench( history, n_ops ) );
+    run_bench( "delta history: read_range", n_ops, DeltaHistoryReadBench( history, n_ops ) );
+
+    run_bench( "4 producers: write_next", n_ops, StageBench( 4, 0, n_ops ) );
+    run_bench( "4 producers: staged, batch 64", n_ops, StageBench( 4, 64, n_ops ) );
+
+    run_bench( "2 message types: shared_ptr slots", n_ops, VariantBench( false, n_ops ) );
+    run_bench( "2 message types: variant slots", n_ops, VariantBench( true, n_ops ) );
+
+    MTWorkloadConfig steady;
+    steady.n_producers = 2;
+    steady.n_consumers = 2;
+    steady.n_readers = 1;
+    steady.payload_bytes = 256;
+    run_workload< 256 >( "workload: 2p/2c/1r, unlimited rate", 1024, steady );
+
+    MTWorkloadConfig bursts = steady;
+    bursts.rate = 100000;
+    bursts.burst_size = 256;
+    bursts.consumer_hold = boost::posix_time::microseconds( 5 );
+    run_workload< 256 >( "workload: 2p/2c/1r, bursts of 256 at 100k/s", 1024, bursts );
+
+    calibrate_ticks();
+    const size_t n_rounds = 20000;
+    const std::vector< Placement > placements = find_placements();
+    for( size_t p=0; p<placements.size(); ++p )
+    {
+        run_pingpong< MTCircularBufferDefaultSync >( "default sync", placements[p], false, n_rounds );
+        run_pingpong< MTCircularBufferDefaultSync >( "default sync", placements[p], true, n_rounds );
+#if defined(MT_CIRCULAR_BUFFER_HAS_RT)
+        run_pingpong< MTCircularBufferRTSync >( "RT sync", placements[p], false, n_rounds );
+        run_pingpong< MTCircularBufferRTSync >( "RT sync", placements[p], true, n_rounds );
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,375 @@
+/**
+  *  MTCircularBufferExporter renders the statistics of MTCircularBuffer instances as OpenMetrics text
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  Buffers are registered with a name, that becomes the "buffer" label of their samples. Consumer
+  *  metrics (see MTCircularBuffer::ConsumerMetrics) can be registered too, with a "consumer" label.
+  *  render() returns the OpenMetrics text exposition (also accepted by Prometheus) of all of them;
+  *  write() sends it to a file descriptor, such as a pipe or a socket connected to a scrape sidecar.
+  *
+  *  The buffers are never locked: their counters are read with MTCircularBuffer::stats(), the consumer
+  *  metrics with ConsumerMetrics::sample(), so each sample may be slightly inconsistent with the others.
+  *  The exporter itself is locked while rendering, so registrations can happen at any time.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    MTCircularBufferExporter exporter;
+  *    exporter.add_buffer( "frames", buff );
+  *    exporter.add_consumer( "frames", "decoder", decoder_metrics );
+  *    ...
+  *    exporter.write( fd );    // or std::string text = exporter.render();
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_BUFFER_EXPORTER_HPP)
+#define MT_CIRCULAR_BUFFER_EXPORTER_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include "MTCircularBuffer.hpp"
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <cerrno>
+#include <locale>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+class MTCircularBufferExporter : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief BufferSample holds the values exported for a buffer (see MTCircularBuffer::Stats)
+     */
+    struct BufferSample
+    {
+        boost::uint64_t size;
+        boost::uint64_t occupancy;
+        boost::uint64_t peak_occupancy;
+        boost::uint64_t peak_lag;
+        boost::uint64_t n_written;
+        boost::uint64_t n_overwritten;
+        boost::uint64_t n_consumed;
+        boost::uint64_t n_deduplicated;
+        boost::uint64_t n_resizes;
+        boost::uint64_t recommended_size;
+    };
+
+    /**
+     * @brief ConsumerSample holds the values exported for a consumer (see MTCircularBuffer::ConsumerMetrics)
+     */
+    struct ConsumerSample
+    {
+        boost::uint64_t n_consumed;
+        boost::uint64_t lag;
+        boost::uint64_t lag_us;
+        boost::uint64_t blocked_us;
+        std::vector< boost::uint64_t > lag_us_bounds;   // upper bound of each bucket but the last one
+        std::vector< boost::uint64_t > lag_us_buckets;  // not cumulative
+        boost::uint64_t lag_us_sum;
+    };
+
+    /**
+     * @param _prefix Prefix of all the metric names
+     */
+    explicit MTCircularBufferExporter( const std::string& _prefix = "mtcircularbuffer" ) : prefix( _prefix ) {}
+
+    /**
+     * @brief add_buffer registers buff, that must outlive the exporter (or be removed first)
+     */
+    template< typename T, typename SYNC >
+    inline void add_buffer( const std::string& name, MTCircularBuffer< T, SYNC >& buff )
+    {
+        boost::unique_lock< boost::mutex > lock( mtx );
+        buffers.push_back( BufferEntry( name, &buff, StatsReader< MTCircularBuffer< T, SYNC > >( buff ) ) );
+    }
+
+    /**
+     * @brief add_consumer registers the metrics of a consumer of the buffer named buffer_name.
+     *        metrics must outlive the exporter (or be removed first)
+     */
+    template< typename METRICS >
+    inline void add_consumer( const std::string& buffer_name, const std::string& consumer_name, METRICS& metrics )
+    {
+        boost::unique_lock< boost::mutex > lock( mtx );
+        consumers.push_back( ConsumerEntry( buffer_name, consumer_name, &metrics, MetricsReader< METRICS >( metrics ) ) );
+    }
+
+    /**
+     * @brief remove unregisters a buffer or a consumer metrics object
+     * @return false if it was not registered
+     */
+    inline bool remove( const void* buff_or_metrics )
+    {
+        boost::unique_lock< boost::mutex > lock( mtx );
+        for( size_t i=0; i<buffers.size(); ++i )
+        {
+            if( buffers[i].source==buff_or_metrics )
+            {
+                buffers.erase( buffers.begin()+i );
+                return true;
+            }
+        }
+        for( size_t i=0; i<consumers.size(); ++i )
+        {
+            if( consumers[i].source==buff_or_metrics )
+            {
+                consumers.erase( consumers.begin()+i );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @return the OpenMetrics text exposition of all the registered buffers and consumers, terminated by "# EOF"
+     */
+    inline std::string render()
+    {
+        boost::unique_lock< boost::mutex > lock( mtx );
+
+        std::vector< BufferSample > bs( buffers.size() );
+        for( size_t i=0; i<buffers.size(); ++i )
+            buffers[i].read( bs[i] );
+        std::vector< ConsumerSample > cs( consumers.size() );
+        for( size_t i=0; i<consumers.size(); ++i )
+            consumers[i].read( cs[i] );
+
+        std::ostringstream out;
+        out.imbue( std::locale::classic() );
+        out.precision( 9 );
+
+        buffer_family( out, "size", "gauge", "Number of slots", bs, &BufferSample::size );
+        buffer_family( out, "occupancy", "gauge", "Items written and not consumed yet", bs, &BufferSample::occupancy );
+        buffer_family( out, "peak_occupancy", "gauge", "Highest occupancy", bs, &BufferSample::peak_occupancy );
+        buffer_family( out, "peak_lag_items", "gauge", "Highest number of items written after an item, when it was consumed", bs, &BufferSample::peak_lag );
+        buffer_family( out, "recommended_size", "gauge", "Capacity recommended by a tuner", bs, &BufferSample::recommended_size );
+        buffer_family( out, "written", "counter", "Published items", bs, &BufferSample::n_written );
+        buffer_family( out, "overwritten", "counter", "Items overwritten before being consumed", bs, &BufferSample::n_overwritten );
+        buffer_family( out, "consumed", "counter", "Consumed items", bs, &BufferSample::n_consumed );
+        buffer_family( out, "deduplicated", "counter", "Items discarded as duplicates", bs, &BufferSample::n_deduplicated );
+        buffer_family( out, "resizes", "counter", "Number of resizes", bs, &BufferSample::n_resizes );
+
+        if( !consumers.empty() )
+        {
+            consumer_family( out, "consumer_consumed", "counter", "Items consumed by the consumer", cs, &ConsumerSample::n_consumed, 1.0 );
+            consumer_family( out, "consumer_lag_items", "gauge", "Items published after the last consumed item, when it was consumed", cs, &ConsumerSample::lag, 1.0 );
+            consumer_family( out, "consumer_lag_seconds", "gauge", "Time between publication and consumption of the last consumed item", cs, &ConsumerSample::lag_us, 1e-6 );
+            consumer_family( out, "consumer_blocked_seconds", "counter", "Time spent waiting for items, slots or acknowledgments", cs, &ConsumerSample::blocked_us, 1e-6 );
+            lag_histogram( out, cs );
+        }
+        out << "# EOF\n";
+        return out.str();
+    }
+
+#if !defined(_WIN32)
+    /**
+     * @brief write renders the exposition and writes all of it to fd
+     * @return false if write(2) failed (errno is preserved)
+     */
+    inline bool write( int fd )
+    {
+        const std::string text = render();
+        size_t done = 0;
+        while( done < text.size() )
+        {
+            const ssize_t n = ::write( fd, text.data()+done, text.size()-done );
+            if( n<0 )
+            {
+                if( errno==EINTR )
+                    continue;
+                return false;
+            }
+            done += static_cast< size_t >( n );
+        }
+        return true;
+    }
+#endif
+
+private:
+
+    template< typename BUFFER >
+    struct StatsReader
+    {
+        explicit StatsReader( BUFFER& _buff ) : buff( &_buff ) {}
+        void operator()( BufferSample& s ) const
+        {
+            const typename BUFFER::Stats st = buff->stats();
+            s.size = st.size;
+            s.occupancy = st.occupancy;
+            s.peak_occupancy = st.peak_occupancy;
+            s.peak_lag = st.peak_lag;
+            s.n_written = st.n_written;
+            s.n_overwritten = st.n_overwritten;
+            s.n_consumed = st.n_consumed;
+            s.n_deduplicated = st.n_deduplicated;
+            s.n_resizes = st.n_resizes;
+            s.recommended_size = st.recommended_size;
+        }
+        BUFFER* buff;
+    };
+
+    template< typename METRICS >
+    struct MetricsReader
+    {
+        explicit MetricsReader( METRICS& _metrics ) : metrics( &_metrics ) {}
+        void operator()( ConsumerSample& s ) const
+        {
+            const typename METRICS::Sample sample = metrics->sample();
+            s.n_consumed = sample.n_consumed;
+            s.lag = sample.lag;
+            s.lag_us = sample.lag_us;
+            s.blocked_us = sample.blocked_us;
+            s.lag_us_bounds.resize( METRICS::LAG_BUCKETS-1 );
+            s.lag_us_buckets.resize( METRICS::LAG_BUCKETS );
+            for( size_t b=0; b<METRICS::LAG_BUCKETS; ++b )
+            {
+                if( b+1<METRICS::LAG_BUCKETS )
+                    s.lag_us_bounds[b] = METRICS::lag_bucket_bound( b );
+                s.lag_us_buckets[b] = sample.lag_us_buckets[b];
+            }
+            s.lag_us_sum = sample.lag_us_sum;
+        }
+        METRICS* metrics;
+    };
+
+    struct BufferEntry
+    {
+        BufferEntry( const std::string& _name, const void* _source, const boost::function< void ( BufferSample& ) >& _read ) :
+            name( _name ), source( _source ), read( _read ) {}
+        std::string name;
+        const void* source;
+        boost::function< void ( BufferSample& ) > read;
+    };
+
+    struct ConsumerEntry
+    {
+        ConsumerEntry( const std::string& _buffer_name, const std::string& _name, const void* _source, const boost::function< void ( ConsumerSample& ) >& _read ) :
+            buffer_name( _buffer_name ), name( _name ), source( _source ), read( _read ) {}
+        std::string buffer_name;
+        std::string name;
+        const void* source;
+        boost::function< void ( ConsumerSample& ) > read;
+    };
+
+    /**
+     * @return value escaped as an OpenMetrics label value
+     */
+    static inline std::string escape( const std::string& value )
+    {
+        std::string escaped;
+        for( size_t i=0; i<value.size(); ++i )
+        {
+            if( value[i]=='\\' )
+                escaped += "\\\\";
+            else if( value[i]=='"' )
+                escaped += "\\\"";
+            else if( value[i]=='\n' )
+                escaped += "\\n";
+            else
+                escaped += value[i];
+        }
+        return escaped;
+    }
+
+    inline void family_header( std::ostringstream& out, const std::string& name, const char* type, const char* help ) const
+    {
+        out << "# TYPE " << prefix << "_" << name << " " << type << "\n";
+        out << "# HELP " << prefix << "_" << name << " " << help << ".\n";
+    }
+
+    inline void buffer_family( std::ostringstream& out, const char* name, const char* type, const char* help,
+                               const std::vector< BufferSample >& samples, boost::uint64_t BufferSample::* field ) const
+    {
+        family_header( out, name, type, help );
+        const char* suffix = std::string( type )=="counter" ? "_total" : "";
+        for( size_t i=0; i<samples.size(); ++i )
+            out << prefix << "_" << name << suffix << "{buffer=\"" << escape( buffers[i].name ) << "\"} " << samples[i].*field << "\n";
+    }
+
+    inline void consumer_labels( std::ostringstream& out, size_t i ) const
+    {
+        out << "buffer=\"" << escape( consumers[i].buffer_name ) << "\",consumer=\"" << escape( consumers[i].name ) << "\"";
+    }
+
+    inline void consumer_family( std::ostringstream& out, const char* name, const char* type, const char* help,
+                                 const std::vector< ConsumerSample >& samples, boost::uint64_t ConsumerSample::* field, double scale ) const
+    {
+        family_header( out, name, type, help );
+        const char* suffix = std::string( type )=="counter" ? "_total" : "";
+        for( size_t i=0; i<samples.size(); ++i )
+        {
+            out << prefix << "_" << name << suffix << "{";
+            consumer_labels( out, i );
+            out << "} ";
+            if( scale==1.0 )
+                out << samples[i].*field << "\n";
+            else
+                out << samples[i].*field*scale << "\n";
+        }
+    }
+
+    inline void lag_histogram( std::ostringstream& out, const std::vector< ConsumerSample >& samples ) const
+    {
+        const std::string name = prefix+"_consumer_lag_distribution_seconds";
+        out << "# TYPE " << name << " histogram\n";
+        out << "# HELP " << name << " Time between publication and consumption of the consumed items.\n";
+        for( size_t i=0; i<samples.size(); ++i )
+        {
+            const ConsumerSample& s = samples[i];
+            boost::uint64_t cumulative = 0;
+            for( size_t b=0; b<s.lag_us_buckets.size(); ++b )
+            {
+                cumulative += s.lag_us_buckets[b];
+                out << name << "_bucket{";
+                consumer_labels( out, i );
+                if( b<s.lag_us_bounds.size() )
+                    out << ",le=\"" << s.lag_us_bounds[b]*1e-6 << "\"} " << cumulative << "\n";
+                else
+                    out << ",le=\"+Inf\"} " << cumulative << "\n";
+            }
+            out << name << "_count{";
+            consumer_labels( out, i );
+            out << "} " << cumulative << "\n";
+            out << name << "_sum{";
+            consumer_labels( out, i );
+            out << "} " << s.lag_us_sum*1e-6 << "\n";
+        }
+    }
+
+    std::string prefix;
+    boost::mutex mtx;
+    std::vector< BufferEntry > buffers;
+    std::vector< ConsumerEntry > consumers;
+};
+
+
+#endif
@@ -0,0 +1,177 @@
+/**
+  *  MTCircularBufferMerge merges several MTCircularBuffers into one timestamp-ordered stream
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  next() peeks the oldest item of each source buffer without blocking and converts the peek with the
+  *  smallest timestamp into a BufferSlotConsumeAccess (see MTCircularBuffer::consume_peeked), so items
+  *  are never copied. The other peeks are released before next() returns or backs off, so the heads of
+  *  the sources are never kept locked against their producers.
+  *
+  *  Sources added with must_wait=true are guaranteed to produce data: next() waits for them to have
+  *  an item before emitting anything, but never longer than the lateness bound. After that, the
+  *  oldest available item is emitted anyway.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    boost::int64_t stamp( const Sample& s ) { return s.timestamp_us; }
+  *
+  *    MTCircularBufferMerge< Sample > merge( &stamp, boost::posix_time::milliseconds(5) );
+  *    merge.add_source( camera_buffer, true );
+  *    merge.add_source( imu_buffer, true );
+  *
+  *    MTCircularBuffer< Sample >::BufferSlotConsumeAccess ca;
+  *    if( merge.next( ca ) == MTCircularBuffer< Sample >::ACQUIRE_OK )
+  *        ...
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_BUFFER_MERGE_HPP)
+#define MT_CIRCULAR_BUFFER_MERGE_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include "MTCircularBuffer.hpp"
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <vector>
+
+
+template < typename T, typename SYNC = MTCircularBufferDefaultSync >
+class MTCircularBufferMerge : private boost::noncopyable
+{
+public:
+
+    typedef MTCircularBuffer< T, SYNC > Buffer;
+    typedef boost::function< boost::int64_t ( const T& ) > timestamp_fn;
+
+    /**
+     * @brief MTCircularBufferMerge constructs an empty merge
+     * @param _timestamp Function returning the timestamp of an item
+     * @param _lateness Maximum time spent waiting for a must_wait source that has no data
+     */
+    MTCircularBufferMerge( const timestamp_fn& _timestamp, const boost::posix_time::time_duration& _lateness ) :
+        timestamp( _timestamp ), lateness( _lateness ) {}
+
+    inline ~MTCircularBufferMerge()
+    {
+        for( size_t i=0; i<sources.size(); ++i )
+            delete sources[i].head;
+    }
+
+    /**
+     * @brief add_source Adds a source buffer to the merge
+     * @param buff Source buffer. The merge competes with the other consumers of buff
+     * @param must_wait If true, next() waits (up to the lateness bound) until this source has data
+     */
+    inline void add_source( Buffer& buff, bool must_wait )
+    {
+        Source src;
+        src.buff = &buff;
+        src.head = new typename Buffer::BufferSlotPeekAccess();
+        src.stamp = 0;
+        src.must_wait = must_wait;
+        sources.push_back( src );
+    }
+
+    inline size_t num_sources() const { return sources.size(); }
+
+    /**
+     * @brief next Gain consume access to the item with the smallest timestamp among the heads of all sources
+     * @param acc A BufferSlotConsumeAccess that will represent slot ownership
+     * @param source If not null, is set to the index of the source the item comes from
+     * @return ACQUIRE_OK, or ACQUIRE_DATA_TIMEOUT if no source had data within the lateness bound
+     */
+    inline typename Buffer::AcquireResult next( typename Buffer::BufferSlotConsumeAccess& acc, size_t* source=0 )
+    {
+        const boost::system_time deadline = boost::get_system_time()+lateness;
+        unsigned n_polls = 0;
+
+        while( true )
+        {
+            bool waiting = false;
+            size_t oldest = sources.size();
+            for( size_t i=0; i<sources.size(); ++i )
+            {
+                Source& src = sources[i];
+                if( src.buff->try_peek_next_available( *src.head, boost::get_system_time() )==Buffer::ACQUIRE_OK )
+                {
+                    src.stamp = timestamp( *(src.head->data) );
+                    if( oldest==sources.size() || src.stamp < sources[oldest].stamp )
+                        oldest = i;
+                }
+                waiting = waiting || ( src.must_wait && src.head->data==0 );
+            }
+
+            const bool expired = boost::get_system_time() >= deadline;
+            const bool can_emit = oldest<sources.size() && ( !waiting || expired );
+            const bool emitted = can_emit && sources[oldest].buff->consume_peeked( *sources[oldest].head, acc );
+            release_heads();
+
+            if( emitted )
+            {
+                if( source )
+                    *source = oldest;
+                return Buffer::ACQUIRE_OK;
+            }
+            if( can_emit )
+                continue;   // another consumer took it, peek the new heads
+            if( expired )
+                return Buffer::ACQUIRE_DATA_TIMEOUT;
+
+            // Sources have no common condition to wait on: spin briefly, then back off
+            if( ++n_polls < 64 )
+                boost::this_thread::yield();
+            else
+                boost::this_thread::sleep( boost::posix_time::microseconds(100) );
+        }
+    }
+
+private:
+
+    inline void release_heads()
+    {
+        for( size_t i=0; i<sources.size(); ++i )
+            sources[i].head->release();
+    }
+
+    struct Source
+    {
+        Buffer* buff;
+        typename Buffer::BufferSlotPeekAccess* head;    // only granted within a next() call
+        boost::int64_t stamp;                           // timestamp of the peeked head
+        bool must_wait;
+    };
+
+    timestamp_fn timestamp;
+    boost::posix_time::time_duration lateness;
+    std::vector< Source > sources;
+};
+
+
+#endif
@@ -0,0 +1,325 @@
+/**
+  *  MTCircularBufferSocket bridges a MTCircularBuffer to a consumer running in another process
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  MTCircularBufferSocketSender consumes up to max_batch slots at once and sends them over a stream
+  *  socket (typically a local Unix domain socket) with a single sendmsg(2), gathering the items directly
+  *  from the slots. Each item is framed by a MTSocketFrameHeader holding its size and user tag.
+  *
+  *  MTCircularBufferSocketReceiver reads as many frames as available (up to max_batch) with a single
+  *  read(2) and writes them into a local buffer with write_next, so the transport costs one syscall per
+  *  burst on each side instead of one per item. T must be trivially copyable, and both processes must
+  *  agree on its layout (the frames are in host byte order).
+  *
+  *  Not available on Windows.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    // producer process                              // consumer process
+  *    MTCircularBufferSocketSender< Frame >            MTCircularBufferSocketReceiver< Frame >
+  *        sender( frames, fd );                            receiver( local_frames, fd );
+  *    while( sender.send_available() >= 0 ) {}        while( receiver.receive_available() >= 0 ) {}
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_BUFFER_SOCKET_HPP)
+#define MT_CIRCULAR_BUFFER_SOCKET_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include "MTCircularBuffer.hpp"
+
+#if !defined(_WIN32)
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_array.hpp>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(IOV_MAX)
+    #define MT_CIRCULAR_BUFFER_SOCKET_MAX_BATCH ( IOV_MAX/2 )
+#else
+    #define MT_CIRCULAR_BUFFER_SOCKET_MAX_BATCH 512
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+    #define MSG_NOSIGNAL 0  // SIGPIPE must be ignored by the application
+#endif
+
+
+/**
+ * @brief MTSocketFrameHeader precedes each item sent by MTCircularBufferSocketSender
+ */
+struct MTSocketFrameHeader
+{
+    boost::uint32_t bytes;  // size of the item that follows
+    boost::uint32_t tag;    // user tag of the item (see BufferSlotAccess::tag)
+};
+
+
+template < typename T, typename SYNC = MTCircularBufferDefaultSync >
+class MTCircularBufferSocketSender : private boost::noncopyable
+{
+    BOOST_STATIC_ASSERT( boost::has_trivial_copy<T>::value );
+
+public:
+
+    typedef MTCircularBuffer< T, SYNC > Buffer;
+
+    /**
+     * @brief MTCircularBufferSocketSender constructs a sender consuming from source
+     * @param _source The buffer whose items are sent
+     * @param _fd A connected stream socket
+     * @param max_batch Maximum number of items sent by a single send_available() call
+     */
+    MTCircularBufferSocketSender( Buffer& _source, int _fd, size_t max_batch=64 ) :
+        source( _source ),
+        fd( _fd ),
+        batch( max_batch>0 && max_batch<=MT_CIRCULAR_BUFFER_SOCKET_MAX_BATCH ? max_batch : MT_CIRCULAR_BUFFER_SOCKET_MAX_BATCH ),
+        accs( new typename Buffer::BufferSlotConsumeAccess[ batch ] ),
+        headers( batch ),
+        iov( 2*batch ),
+        n_sent( 0 ),
+        n_syscalls( 0 ),
+        n_dropped( 0 ) {}
+
+    /**
+     * @brief send_available waits for the source to have data (see try_consume_available), consumes
+     *        up to max_batch items and sends them with a single sendmsg (more only for partial sends).
+     * @return the number of items sent, 0 if no item was available in time, or -1 if the socket failed
+     *         (errno is preserved). The items of a failed batch are consumed and counted by num_dropped
+     */
+    inline int send_available()
+    {
+        size_t n = 0;
+        if( source.try_consume_available( accs.get(), batch, n )!=Buffer::ACQUIRE_OK )
+            return 0;
+
+        for( size_t i=0; i<n; ++i )
+        {
+            headers[i].bytes = sizeof(T);
+            headers[i].tag = accs[i].tag;
+            iov[2*i].iov_base = &headers[i];
+            iov[2*i].iov_len = sizeof(MTSocketFrameHeader);
+            iov[2*i+1].iov_base = accs[i].data;
+            iov[2*i+1].iov_len = sizeof(T);
+        }
+        const bool ok = send_all( &iov[0], 2*n );
+        const int saved_errno = errno;
+        for( size_t i=0; i<n; ++i )
+            accs[i].release();
+        errno = saved_errno;
+
+        if( !ok )
+        {
+            n_dropped += n;
+            return -1;
+        }
+        n_sent += n;
+        return static_cast< int >( n );
+    }
+
+    inline size_t max_batch() const { return batch; }
+    inline size_t num_sent() const { return n_sent; }
+    inline size_t num_syscalls() const { return n_syscalls; }
+    inline size_t num_dropped() const { return n_dropped; }
+
+private:
+
+    /**
+     * @brief send_all sends the n_iov buffers, resuming after partial sends and EINTR
+     */
+    inline bool send_all( struct iovec* v, size_t n_iov )
+    {
+        while( n_iov>0 )
+        {
+            struct msghdr msg;
+            std::memset( &msg, 0, sizeof(msg) );
+            msg.msg_iov = v;
+            msg.msg_iovlen = n_iov;
+            const ssize_t n = sendmsg( fd, &msg, MSG_NOSIGNAL );
+            n_syscalls++;
+            if( n<0 )
+            {
+                if( errno==EINTR )
+                    continue;
+                return false;
+            }
+            size_t done = static_cast< size_t >( n );
+            while( n_iov>0 && done>=v->iov_len )
+            {
+                done -= v->iov_len;
+                ++v;
+                --n_iov;
+            }
+            if( n_iov>0 )
+            {
+                v->iov_base = static_cast< char* >( v->iov_base )+done;
+                v->iov_len -= done;
+            }
+        }
+        return true;
+    }
+
+    Buffer& source;
+    const int fd;
+    const size_t batch;
+    boost::scoped_array< typename Buffer::BufferSlotConsumeAccess > accs;
+    std::vector< MTSocketFrameHeader > headers;
+    std::vector< struct iovec > iov;
+    size_t n_sent;
+    size_t n_syscalls;
+    size_t n_dropped;
+};
+
+
+template < typename T, typename SYNC = MTCircularBufferDefaultSync >
+class MTCircularBufferSocketReceiver : private boost::noncopyable
+{
+    BOOST_STATIC_ASSERT( boost::has_trivial_copy<T>::value );
+
+public:
+
+    typedef MTCircularBuffer< T, SYNC > Buffer;
+
+    enum { FRAME_BYTES = sizeof(MTSocketFrameHeader)+sizeof(T) };
+
+    /**
+     * @brief MTCircularBufferSocketReceiver constructs a receiver writing into dest
+     * @param _dest The buffer the received items are written to
+     * @param _fd A connected stream socket
+     * @param max_batch Maximum number of items read by a single receive_available() call
+     */
+    MTCircularBufferSocketReceiver( Buffer& _dest, int _fd, size_t max_batch=64 ) :
+        dest( _dest ),
+        fd( _fd ),
+        staging( ( max_batch>0 ? max_batch : 1 )*FRAME_BYTES ),
+        n_staged( 0 ),
+        is_closed( false ),
+        n_received( 0 ),
+        n_syscalls( 0 ) {}
+
+    /**
+     * @brief receive_available waits for data on the socket, reads up to max_batch frames with a single
+     *        read and writes every complete item into dest. A partial frame is kept for the next call.
+     *        If complete frames are still staged (see below), they are written without reading first.
+     * @return the number of items written, or -1 if the socket failed (errno is preserved), a frame
+     *         does not hold a T (errno is set to EPROTO: frames carry no marker to resynchronize on, so
+     *         the receiver is closed and the socket must be reconnected), a slot of dest could not be
+     *         acquired in time (errno is set to ETIMEDOUT; the frame is kept staged for the next call)
+     *         or the peer closed the socket (see closed()). Items written before a failure are counted
+     *         by num_received
+     */
+    inline int receive_available()
+    {
+        if( is_closed )
+            return -1;
+
+        if( n_staged < FRAME_BYTES )
+        {
+            ssize_t n;
+            do
+            {
+                n = read( fd, &staging[n_staged], staging.size()-n_staged );
+                n_syscalls++;
+            } while( n<0 && errno==EINTR );
+            if( n<0 )
+                return -1;
+            if( n==0 )
+            {
+                is_closed = true;
+                return -1;
+            }
+            n_staged += static_cast< size_t >( n );
+        }
+
+        size_t done = 0;
+        int n_items = 0;
+        int err = 0;
+        while( n_staged-done >= FRAME_BYTES )
+        {
+            MTSocketFrameHeader header;
+            std::memcpy( &header, &staging[done], sizeof(header) );
+            if( header.bytes!=sizeof(T) )
+            {
+                err = EPROTO;
+                break;
+            }
+            typename Buffer::BufferSlotWriteAccess wa;
+            if( dest.try_write_next( wa )!=Buffer::ACQUIRE_OK )
+            {
+                err = ETIMEDOUT;
+                break;
+            }
+            std::memcpy( wa.data, &staging[done+sizeof(header)], sizeof(T) );
+            wa.tag = header.tag;
+            done += FRAME_BYTES;
+            ++n_items;
+        }
+
+        // Drop the written frames, keeping the others at the beginning of the staging area
+        if( done>0 )
+            std::memmove( &staging[0], &staging[done], n_staged-done );
+        n_staged -= done;
+        n_received += n_items;
+        if( err==EPROTO )
+        {
+            is_closed = true;
+            n_staged = 0;
+        }
+        if( err!=0 )
+        {
+            errno = err;
+            return -1;
+        }
+        return n_items;
+    }
+
+    inline bool closed() const { return is_closed; }
+    inline size_t num_received() const { return n_received; }
+    inline size_t num_syscalls() const { return n_syscalls; }
+
+private:
+    Buffer& dest;
+    const int fd;
+    std::vector< char > staging;
+    size_t n_staged;
+    bool is_closed;
+    size_t n_received;
+    size_t n_syscalls;
+};
+
+#endif
+
+#endif
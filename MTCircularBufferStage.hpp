@@ -0,0 +1,173 @@
+/**
+  *  MTCircularBufferStage is a private, unsynchronized staging ring that feeds a shared MTCircularBuffer
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  Each producer thread owns its own stage (L1) and writes into it without any locking. Once
+  *  batch_size items are staged, or when the oldest staged item is older than max_delay, the whole
+  *  batch is moved into the shared buffer (L2) with a single MTCircularBuffer::write_batch, that is
+  *  one acquisition of the write position and one notification of the consumers.
+  *
+  *  Items from the same stage keep their order in L2. Items from different stages are interleaved
+  *  batch by batch. The extra latency is bounded by max_delay as long as the owning thread calls
+  *  poll() (or writes) often enough: the stage has no timer thread of its own.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    MTCircularBuffer< Event > shared( 4096 );
+  *
+  *    // in each producer thread
+  *    MTCircularBufferStage< Event > stage( shared, 64, boost::posix_time::milliseconds(1) );
+  *    stage.write_next() = ev;     // or stage.push( ev )
+  *    ...
+  *    stage.poll();                // flushes a partial batch after max_delay
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_BUFFER_STAGE_HPP)
+#define MT_CIRCULAR_BUFFER_STAGE_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include "MTCircularBuffer.hpp"
+#include <boost/cstdint.hpp>
+#include <vector>
+
+
+template < typename T, typename SYNC = MTCircularBufferDefaultSync >
+class MTCircularBufferStage : private boost::noncopyable
+{
+public:
+
+    typedef MTCircularBuffer< T, SYNC > Buffer;
+
+    /**
+     * @brief MTCircularBufferStage constructs a stage in front of a shared buffer
+     * @param _shared The shared (L2) buffer
+     * @param batch_size Number of items moved to the shared buffer at once (at most _shared.size())
+     * @param _max_delay Maximum time an item is kept in the stage, checked by poll() and write_next()
+     */
+    MTCircularBufferStage( Buffer& _shared, size_t batch_size, const boost::posix_time::time_duration& _max_delay ) :
+        shared( _shared ),
+        items( batch_size>0 && batch_size<=_shared.size() ? batch_size : _shared.size() ),
+        tags( items.size(), 0 ),
+        n_staged( 0 ),
+        max_delay( _max_delay ),
+        n_flushes( 0 ),
+        n_dropped( 0 ) {}
+
+    inline ~MTCircularBufferStage()
+    {
+        flush();
+    }
+
+    /**
+     * @brief write_next Returns the next staged item, to be filled by the caller. If the stage is
+     *        full (or the oldest staged item is older than max_delay), the staged batch is flushed first.
+     * @param tag The user tag of the item (see BufferSlotAccess::tag)
+     */
+    inline T& write_next( boost::uint32_t tag=0 )
+    {
+        if( n_staged==items.size() )
+            flush();
+        else
+            poll();
+
+        if( n_staged==0 )
+            oldest = boost::get_system_time();
+        tags[n_staged] = tag;
+        return items[n_staged++];
+    }
+
+    /**
+     * @brief push Stages a copy of item, flushing the batch as soon as it is full
+     */
+    inline void push( const T& item, boost::uint32_t tag=0 )
+    {
+        write_next( tag ) = item;
+        if( n_staged==items.size() )
+            flush();
+    }
+
+    /**
+     * @brief poll Flushes the staged items if the oldest one is older than max_delay
+     * @return ACQUIRE_OK if nothing had to be flushed, or the result of flush()
+     */
+    inline typename Buffer::AcquireResult poll()
+    {
+        if( n_staged>0 && boost::get_system_time()-oldest >= max_delay )
+            return flush();
+        return Buffer::ACQUIRE_OK;
+    }
+
+    /**
+     * @brief flush Moves all the staged items to the shared buffer, in several batches if the shared
+     *        buffer has been resized below the stage size. If the shared buffer cannot be acquired in
+     *        time, the items not written yet are dropped (and counted by num_dropped) as an overwritten
+     *        slot would be.
+     * @return ACQUIRE_OK or ACQUIRE_SLOT_TIMEOUT
+     */
+    inline typename Buffer::AcquireResult flush()
+    {
+        if( n_staged==0 )
+            return Buffer::ACQUIRE_OK;
+
+        typename Buffer::AcquireResult res = Buffer::ACQUIRE_OK;
+        size_t done = 0;
+        while( done<n_staged && res==Buffer::ACQUIRE_OK )
+        {
+            size_t n_written;
+            res = shared.try_write_batch( &items[done], n_staged-done, &tags[done], 0, &n_written );
+            done += n_written;
+        }
+        if( res==Buffer::ACQUIRE_OK )
+            n_flushes++;
+        else
+            n_dropped += n_staged-done;
+        n_staged = 0;
+        return res;
+    }
+
+    inline size_t num_staged() const { return n_staged; }
+    inline size_t batch_size() const { return items.size(); }
+    inline size_t num_flushes() const { return n_flushes; }
+    inline size_t num_dropped() const { return n_dropped; }
+
+private:
+    Buffer& shared;
+    std::vector< T > items;
+    std::vector< boost::uint32_t > tags;
+    size_t n_staged;
+    boost::system_time oldest;
+    boost::posix_time::time_duration max_delay;
+    size_t n_flushes;
+    size_t n_dropped;
+};
+
+
+#endif
@@ -6,6 +6,61 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch.hpp"
 #include "MTCircularBuffer.hpp"
+#include "MTCircularDeltaHistory.hpp"
+#include "MTCircularBufferMerge.hpp"
+#include "MTCircularBufferStage.hpp"
+#include "MTCircularBufferTuner.hpp"
+#include "MTCircularBufferExporter.hpp"
+#include "MTCircularBufferWorkload.hpp"
+#include "MTCircularBufferSocket.hpp"
+#include "MTCircularBufferVariant.hpp"
+#include <boost/bind/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <cstdlib>
+#include <deque>
+#include <new>
+
+
+// Global allocation counter, used to check that the real-time paths never allocate. The whole
+// (non aligned) operator new/delete family is replaced, so that every form pairs with malloc/free.
+// The deletes are not inlined: GCC would then see free() called on the result of operator new
+#if defined(__GNUC__)
+    #define TEST_NOINLINE __attribute__((noinline))
+#else
+    #define TEST_NOINLINE
+#endif
+static volatile bool count_allocations = false;
+static volatile size_t num_allocations = 0;
+
+static inline void* counted_malloc( std::size_t sz )
+{
+    if( count_allocations )
+        num_allocations = num_allocations+1;
+    return std::malloc( sz>0 ? sz : 1 );
+}
+
+void* operator new( std::size_t sz )
+{
+    void* p = counted_malloc( sz );
+    if( !p )
+        throw std::bad_alloc();
+    return p;
+}
+void* operator new[]( std::size_t sz )
+{
+    void* p = counted_malloc( sz );
+    if( !p )
+        throw std::bad_alloc();
+    return p;
+}
+void* operator new( std::size_t sz, const std::nothrow_t& ) throw() { return counted_malloc( sz ); }
+void* operator new[]( std::size_t sz, const std::nothrow_t& ) throw() { return counted_malloc( sz ); }
+TEST_NOINLINE void operator delete( void* p ) throw() { std::free( p ); }
+TEST_NOINLINE void operator delete[]( void* p ) throw() { std::free( p ); }
+TEST_NOINLINE void operator delete( void* p, std::size_t ) throw() { std::free( p ); }
+TEST_NOINLINE void operator delete[]( void* p, std::size_t ) throw() { std::free( p ); }
+TEST_NOINLINE void operator delete( void* p, const std::nothrow_t& ) throw() { std::free( p ); }
+TEST_NOINLINE void operator delete[]( void* p, const std::nothrow_t& ) throw() { std::free( p ); }
 
 
 SCENARIO("Basic single-threaded operations", "[Single]") 
@@ -231,194 +286,2566 @@ SCENARIO("Basic single-threaded operations", "[Single]")
 }
 
 
-class SimpleProducerThread
+SCENARIO("Software prefetch of upcoming slots", "[Prefetch]")
 {
-public:
-    SimpleProducerThread( MTCircularBuffer<int>& _buff ) : buff(_buff), running(true) { }
-    void operator()()
-    {
+    GIVEN( "Buffer with 4 slots and prefetch enabled" ) {
+        MTCircularBuffer< int > buff(4);
+        buff.set_prefetch( 10 );
 
-        while( running )
+        REQUIRE( buff.get_prefetch_distance() == 3 );
+
+        WHEN("Data is produced and consumed across the buffer boundary")
         {
+            for( int i=0; i<6; ++i )
             {
                 MTCircularBuffer<int>::BufferSlotWriteAccess wa;
-                bool overwrite = false;
-                try{
-                    buff.write_next( wa, &overwrite );
-                } catch( MTCircularBuffer<int>::SlotAcqTimeout& ex )
+                buff.write_next( wa );
+                *(wa.data) = i;
+            }
+            THEN("Consumers get the same data as without prefetching")
+            {
+                for( int i=2; i<6; ++i )
                 {
-                    std::cout << "Write lock timeout" << std::endl;
+                    MTCircularBuffer< int >::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i );
                 }
-
-                if( overwrite )
-                    std::cout << "Overwrite occurred" << std::endl;
-                boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+                REQUIRE( buff.num_consumable_slots()==0 );
             }
         }
     }
-    inline void kill()
-    {
-        running = false;
-    }
+}
 
-    bool running;
-    MTCircularBuffer<int>& buff;
+
+struct LargeFrame
+{
+    unsigned char bytes[64*1024+3];
 };
 
-class SimpleConsumerThread
+SCENARIO("Streaming copy-in/copy-out", "[StreamCopy]")
 {
-public:
-    SimpleConsumerThread( MTCircularBuffer<int>& _buff ) : buff(_buff), running(true) { }
-    void operator()()
-    {
+    GIVEN( "Buffer with 2 large slots" ) {
+        MTCircularBuffer< LargeFrame > buff(2);
+        std::vector< unsigned char > src( sizeof(LargeFrame)+1 );
+        for( size_t i=0; i<src.size(); ++i )
+            src[i] = static_cast<unsigned char>( i*7 );
 
-        while( running )
+        WHEN("A frame is copied in and out through unaligned pointers")
         {
+            bool overwrite = true;
+            buff.write_copy( &src[1], sizeof(LargeFrame), &overwrite );
+            REQUIRE( !overwrite );
+            REQUIRE( buff.num_consumable_slots()==1 );
+
+            std::vector< unsigned char > dst( sizeof(LargeFrame)+1 );
+            const size_t n = buff.consume_copy( &dst[1], sizeof(LargeFrame)+100 );
+
+            THEN("The content is preserved")
             {
-                MTCircularBuffer<int>::BufferSlotConsumeAccess ca;
-                try
-                {
-                    buff.consume_next_available( ca );
-                } catch( MTCircularBuffer<int>::DataAvailableTimeout& ex )
-                {
-                    std::cout << "DataAvailableTimeout" << std::endl;
-                }
+                REQUIRE( n == sizeof(LargeFrame) );
+                REQUIRE( std::memcmp( &dst[1], &src[1], sizeof(LargeFrame) )==0 );
+                REQUIRE( buff.num_consumable_slots()==0 );
+            }
+        }
+    }
+}
 
-                boost::this_thread::sleep(boost::posix_time::milliseconds(2000));
+
+SCENARIO("Random access by sequence number", "[Seq]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 4 slots, 6 items written" ) {
+        Buffer buff(4);
+        for( int i=0; i<6; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            REQUIRE( wa.seq == Buffer::seq_type(i) );
+            *(wa.data) = i*10;
+        }
+        REQUIRE( buff.next_seq() == 6 );
+
+        WHEN("A resident item is requested")
+        {
+            Buffer::BufferSlotReadAccess ra;
+            THEN("Read access is granted to the item with that sequence number")
+            {
+                REQUIRE( buff.read_seq( 3, ra )==Buffer::ACQUIRE_OK );
+                REQUIRE( ra.seq == 3 );
+                REQUIRE( ra.slot == 3 );
+                REQUIRE( *(ra.data) == 30 );
+            }
+        }
+        WHEN("An overwritten item is requested")
+        {
+            Buffer::BufferSlotReadAccess ra;
+            THEN("It is reported as too old")
+            {
+                REQUIRE( buff.read_seq( 1, ra )==Buffer::ACQUIRE_TOO_OLD );
+                REQUIRE( ra.data == 0 );
+            }
+        }
+        WHEN("A future item is requested")
+        {
+            Buffer::BufferSlotReadAccess ra;
+            THEN("It is reported as not yet available")
+            {
+                REQUIRE( buff.read_seq( 6, ra )==Buffer::ACQUIRE_NOT_YET );
+            }
+        }
+        WHEN("The next item is being written")
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            Buffer::BufferSlotReadAccess ra;
+            THEN("It is not yet available, and the item it replaces is too old")
+            {
+                REQUIRE( buff.read_seq( 6, ra )==Buffer::ACQUIRE_NOT_YET );
+                REQUIRE( buff.read_seq( 2, ra )==Buffer::ACQUIRE_TOO_OLD );
+            }
+        }
+        WHEN("The buffer is cleared")
+        {
+            buff.clear();
+            Buffer::BufferSlotReadAccess ra;
+            THEN("All the previous items are too old and sequence numbers are not reused")
+            {
+                REQUIRE( buff.read_seq( 5, ra )==Buffer::ACQUIRE_TOO_OLD );
+                REQUIRE( buff.next_seq() >= 6 );
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                REQUIRE( wa.slot == 0 );
+                REQUIRE( wa.seq >= 6 );
             }
         }
     }
-    inline void kill()
+}
+
+
+class DelayedWriterThread
+{
+public:
+    DelayedWriterThread( MTCircularBuffer<int>& _buff, int _value ) : buff(_buff), value(_value) { }
+    void operator()()
     {
-        running = false;
+        boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+        MTCircularBuffer<int>::BufferSlotWriteAccess wa;
+        buff.write_next( wa );
+        *(wa.data) = value;
     }
 
-    bool running;
     MTCircularBuffer<int>& buff;
+    int value;
 };
 
-class SimpleReaderThread
+SCENARIO("Late-joining history readers", "[History]")
 {
-public:
-    SimpleReaderThread( MTCircularBuffer<int>& _buff ) : buff(_buff), running(true) { }
-    void operator()()
-    {
+    typedef MTCircularBuffer< int > Buffer;
 
-        while( running )
+    GIVEN( "Buffer with 4 slots, 6 items written" ) {
+        Buffer buff(4);
+        for( int i=0; i<6; ++i )
         {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+        REQUIRE( buff.oldest_seq() == 2 );
+
+        WHEN("A reader subscribes from the oldest item")
+        {
+            Buffer::HistoryReader reader;
+            buff.subscribe( reader, Buffer::START_OLDEST );
+
+            THEN("It reads the whole history in order, without consuming it")
             {
-                MTCircularBuffer<int>::BufferSlotReadAccess ra;
-                try
-                {
-                    buff.read_newest_available( ra );
-                } catch( ... )
+                for( int i=2; i<6; ++i )
                 {
+                    Buffer::BufferSlotReadAccess ra;
+                    REQUIRE( buff.read_next( reader, ra )==Buffer::ACQUIRE_OK );
+                    REQUIRE( *(ra.data) == i );
                 }
+                REQUIRE( reader.position() == 6 );
+                REQUIRE( reader.num_missed() == 0 );
+                REQUIRE( buff.num_consumable_slots() == 4 );
+            }
+        }
+        WHEN("A reader subscribes from the newest item")
+        {
+            Buffer::HistoryReader reader;
+            buff.subscribe( reader, Buffer::START_NEWEST );
+            Buffer::BufferSlotReadAccess ra;
 
-                boost::this_thread::sleep(boost::posix_time::milliseconds(600));
+            THEN("It reads the newest item, then waits for new data")
+            {
+                REQUIRE( buff.read_next( reader, ra )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ra.data) == 5 );
+
+                DelayedWriterThread writer( buff, 6 );
+                boost::thread writer_t( boost::ref( writer ) );
+                Buffer::BufferSlotReadAccess ra2;
+                REQUIRE( buff.read_next( reader, ra2 )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ra2.data) == 6 );
+                writer_t.join();
             }
         }
-    }
-    inline void kill()
-    {
-        running = false;
-    }
+        WHEN("A reader subscribes at an overwritten sequence number")
+        {
+            Buffer::HistoryReader reader;
+            buff.subscribe_at( reader, 0 );
+            Buffer::BufferSlotReadAccess ra;
 
-    bool running;
-    MTCircularBuffer<int>& buff;
-};
+            THEN("It skips to the oldest stored item and reports the missed ones")
+            {
+                REQUIRE( buff.read_next( reader, ra )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ra.data) == 2 );
+                REQUIRE( reader.num_missed() == 2 );
+            }
+        }
+    }
+}
 
 
-SCENARIO( "MultiThreaded single producer test", "[MT_Single_Producer]")
+SCENARIO("Peek the oldest item without consuming it", "[Peek]")
 {
-    GIVEN( "Buffer with 10 slots" ) {
-        std::cout << "MultiThreaded single producer test" << std::endl;
-        const int test_duration_sec=10;
-        MTCircularBuffer< int > buff(10);
+    typedef MTCircularBuffer< int > Buffer;
 
-        SimpleProducerThread pr_thread( buff );
-        boost::thread pr_thread_t( boost::ref( pr_thread ) );
+    GIVEN( "Buffer with 4 slots, 2 items written" ) {
+        Buffer buff(4);
+        for( int i=0; i<2; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
 
-        std::cout << std::endl;
-        for( int i=0; i<test_duration_sec*10; ++i )
+        WHEN("The oldest item is peeked")
         {
-            std::cout << "\r\r" << buff.to_string() << "    ";
-            std::flush( std::cout );
-            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            Buffer::BufferSlotPeekAccess pa;
+            buff.peek_next_available( pa );
+
+            THEN("It is not consumed")
+            {
+                REQUIRE( *(pa.data) == 0 );
+                REQUIRE( buff.is_read( pa.slot ) );
+                REQUIRE( buff.num_consumable_slots() == 2 );
+            }
+            THEN("It can be converted into a consume access in place")
+            {
+                const size_t slot = pa.slot;
+                Buffer::BufferSlotConsumeAccess ca;
+                REQUIRE( buff.consume_peeked( pa, ca ) );
+                REQUIRE( pa.data == 0 );
+                REQUIRE( ca.slot == slot );
+                REQUIRE( *(ca.data) == 0 );
+                REQUIRE( buff.num_concurrent_read( slot ) == 1 );
+                REQUIRE( buff.num_consumable_slots() == 1 );
+            }
+            THEN("The conversion fails if another consumer took the item")
+            {
+                {
+                    Buffer::BufferSlotConsumeAccess other;
+                    buff.consume_next_available( other );
+                    REQUIRE( *(other.data) == 0 );
+                }
+                Buffer::BufferSlotConsumeAccess ca;
+                REQUIRE( !buff.consume_peeked( pa, ca ) );
+                REQUIRE( ca.data == 0 );
+                REQUIRE( pa.data != 0 );
+            }
         }
-        std::cout << std::endl << "Killing producer thread..." << std::endl;
-        pr_thread.kill();
-        pr_thread_t.join();
-        std::cout << std::endl << "Test done." << std::endl;
-        REQUIRE(true);
     }
-
 }
 
-SCENARIO( "MultiThreaded producer/consumer test", "[MT_Producer_consumer]")
+
+static bool is_odd_tag( boost::uint32_t tag ) { return (tag & 1)!=0; }
+
+SCENARIO("Predicate-filtered subscriptions", "[Filter]")
 {
-    GIVEN( "Buffer with 10 slots" ) {
-        std::cout << "MultiThreaded producer/consumer test" << std::endl;
+    typedef MTCircularBuffer< int > Buffer;
 
-        const int test_duration_sec=13;
-        MTCircularBuffer< int > buff(10);
+    GIVEN( "Buffer with 8 slots and a subscription to odd tags" ) {
+        Buffer buff(8);
+        Buffer::FilteredSubscription sub( &is_odd_tag );
+        buff.subscribe( sub );
 
-        SimpleProducerThread pr_thread( buff );
-        boost::thread pr_thread_t( boost::ref( pr_thread ) );
-        SimpleConsumerThread cn_thread( buff );
-        boost::thread cn_thread_t( boost::ref( cn_thread ) );
+        WHEN("Items with different tags are produced")
+        {
+            for( int i=0; i<6; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = i*10;
+                wa.tag = i;
+            }
 
-        std::cout << std::endl;
-        for( int i=0; i<test_duration_sec*10; ++i )
+            THEN("The subscriber only receives the matching items, in order")
+            {
+                for( int i=1; i<6; i+=2 )
+                {
+                    Buffer::BufferSlotReadAccess ra;
+                    REQUIRE( buff.consume_next_matching( sub, ra )==Buffer::ACQUIRE_OK );
+                    REQUIRE( *(ra.data) == i*10 );
+                    REQUIRE( ra.tag == boost::uint32_t(i) );
+                }
+                REQUIRE( sub.num_filtered() == 3 );
+                REQUIRE( sub.num_missed() == 0 );
+            }
+            THEN("Other consumers of the buffer are not affected")
+            {
+                REQUIRE( buff.num_consumable_slots() == 6 );
+            }
+        }
+        WHEN("Matching items are overwritten before being consumed")
         {
-            std::cout << "\r\r" << buff.to_string() << "    ";
-            std::flush( std::cout );
-            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            for( int i=0; i<12; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = i;
+                wa.tag = 1;
+            }
+
+            THEN("They are reported as missed")
+            {
+                Buffer::BufferSlotReadAccess ra;
+                REQUIRE( buff.consume_next_matching( sub, ra )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ra.data) == 4 );
+                REQUIRE( sub.num_missed() == 4 );
+            }
         }
-        std::cout << std::endl << "Killing producer thread..." << std::endl;
-        pr_thread.kill();
-        pr_thread_t.join();
-        std::cout << std::endl << "Killing consumer thread..." << std::endl;
-        cn_thread.kill();
-        cn_thread_t.join();
-        std::cout << std::endl << "Test done." << std::endl;
-        REQUIRE(true);
     }
 }
 
-SCENARIO( "MultiThreaded producer/consumer/reader test", "[MT_Producer_consumer_reader]")
-{
-    GIVEN( "Buffer with 10 slots" ) {
-        std::cout << "MultiThreaded producer/consumer test" << std::endl;
 
-        const int test_duration_sec=15;
-        MTCircularBuffer< int > buff(10);
+static size_t tens_hash( const int& v ) { return static_cast<size_t>( v/10 ); }
 
-        SimpleProducerThread pr_thread( buff );
-        boost::thread pr_thread_t( boost::ref( pr_thread ) );
-        SimpleConsumerThread cn_thread( buff );
-        boost::thread cn_thread_t( boost::ref( cn_thread ) );
-        SimpleReaderThread rd_thread( buff );
-        boost::thread rd_thread_t( boost::ref( rd_thread ) );
+SCENARIO("Write deduplication", "[Dedup]")
+{
+    typedef MTCircularBuffer< int > Buffer;
 
-        std::cout << std::endl;
-        for( int i=0; i<test_duration_sec*10; ++i )
+    GIVEN( "Buffer with 4 slots and deduplication enabled" ) {
+        Buffer buff(4);
+        buff.enable_dedup();
+
+        WHEN("The same value is written several times")
         {
-            std::cout << "\r\r" << buff.to_string() << "    ";
-            std::flush( std::cout );
-            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            const int values[] = { 1, 1, 1, 2, 2, 3 };
+            for( int i=0; i<6; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = values[i];
+            }
+
+            THEN("Only changes are published, and repeats are counted on the previous item")
+            {
+                REQUIRE( buff.num_consumable_slots() == 3 );
+                REQUIRE( buff.num_deduplicated() == 3 );
+                REQUIRE( buff.next_seq() == 3 );
+
+                const int expected_repeats[] = { 2, 1, 0 };
+                for( int i=0; i<3; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i+1 );
+                    REQUIRE( ca.repeats == boost::uint32_t(expected_repeats[i]) );
+                    REQUIRE( ca.seq == Buffer::seq_type(i) );
+                }
+            }
         }
-        std::cout << std::endl << "Killing reader thread..." << std::endl;
-        rd_thread.kill();
-        rd_thread_t.join();
-        std::cout << std::endl << "Killing producer thread..." << std::endl;
-        pr_thread.kill();
-        pr_thread_t.join();
-        std::cout << std::endl << "Killing consumer thread..." << std::endl;
-        cn_thread.kill();
-        cn_thread_t.join();
-        std::cout << std::endl << "Test done." << std::endl;
-        REQUIRE(true);
-    }
+        WHEN("A user hash is used")
+        {
+            buff.enable_dedup( &tens_hash );
+            const int values[] = { 10, 11, 25 };
+            for( int i=0; i<3; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = values[i];
+            }
 
-}
+            THEN("Items with the same hash are deduplicated")
+            {
+                REQUIRE( buff.num_consumable_slots() == 2 );
+                REQUIRE( buff.num_deduplicated() == 1 );
+            }
+        }
+        WHEN("The ring is full and a duplicate is written")
+        {
+            for( int i=0; i<4; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = i;
+            }
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = 3;
+            }
+
+            THEN("The overwritten oldest item is no longer reported as stored")
+            {
+                REQUIRE( buff.num_deduplicated() == 1 );
+                REQUIRE( buff.next_seq() == 4 );
+                REQUIRE( buff.oldest_seq() == 1 );
+
+                Buffer::BufferSlotReadAccess ra;
+                REQUIRE( buff.read_seq( 0, ra )==Buffer::ACQUIRE_TOO_OLD );
+
+                Buffer::HistoryReader reader;
+                buff.subscribe( reader, Buffer::START_OLDEST );
+                for( int i=1; i<4; ++i )
+                {
+                    Buffer::BufferSlotReadAccess hr;
+                    REQUIRE( buff.read_next( reader, hr )==Buffer::ACQUIRE_OK );
+                    REQUIRE( *(hr.data) == i );
+                }
+            }
+        }
+        WHEN("The previous item is being read while a duplicate is written")
+        {
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = 7;
+            }
+            Buffer::BufferSlotReadAccess ra;
+            REQUIRE( buff.read_seq( 0, ra )==Buffer::ACQUIRE_OK );
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = 7;
+            }
+
+            THEN("The duplicate is discarded, since readers share the slot")
+            {
+                REQUIRE( buff.num_deduplicated() == 1 );
+                REQUIRE( buff.next_seq() == 1 );
+            }
+        }
+    }
+#if defined(MT_CIRCULAR_BUFFER_HAS_RT)
+    GIVEN( "Real-time buffer with 4 slots and deduplication enabled" ) {
+        typedef MTCircularBuffer< int, MTCircularBufferRTSync > RTBuffer;
+        RTBuffer buff(4);
+        buff.enable_dedup();
+
+        WHEN("The previous item is being read while a duplicate is written")
+        {
+            {
+                RTBuffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = 7;
+            }
+            RTBuffer::BufferSlotReadAccess ra;
+            REQUIRE( buff.read_seq( 0, ra )==RTBuffer::ACQUIRE_OK );
+            {
+                RTBuffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = 7;
+            }
+
+            THEN("The release does not wait for the reader: the duplicate is published")
+            {
+                REQUIRE( buff.num_deduplicated() == 0 );
+                REQUIRE( buff.next_seq() == 2 );
+            }
+        }
+    }
+#endif
+}
+
+
+SCENARIO("Delta-compressed history", "[DeltaHistory]")
+{
+    GIVEN( "A 16 KB integer history with 1 KB blocks" ) {
+        typedef MTCircularDeltaHistory< int, 2 > History;
+        History history( 16*1024, 1024 );
+
+        WHEN("Slowly varying records are pushed")
+        {
+            const int n = 20000;
+            for( int i=0; i<n; ++i )
+            {
+                const int rec[2] = { 1000000+i/3, -i };
+                REQUIRE( history.push( rec ) == History::seq_type(i) );
+            }
+
+            THEN("They take much less space than the raw records")
+            {
+                REQUIRE( history.bytes_per_record() < History::RECORD_BYTES/2.0 );
+                REQUIRE( history.size() > 16*1024/History::RECORD_BYTES );
+            }
+            THEN("Stored records are decoded exactly")
+            {
+                const History::seq_type oldest = history.oldest_seq();
+                REQUIRE( oldest > 0 );
+                for( History::seq_type s=oldest; s<History::seq_type(n); s+=777 )
+                {
+                    int rec[2];
+                    REQUIRE( history.read( s, rec ) == History::READ_OK );
+                    REQUIRE( rec[0] == 1000000+int(s)/3 );
+                    REQUIRE( rec[1] == -int(s) );
+                }
+
+                std::vector< int > range( 2*5000 );
+                size_t n_read = 0;
+                REQUIRE( history.read_range( n-4000, 5000, &range[0], &n_read ) == History::READ_OK );
+                REQUIRE( n_read == 4000 );
+                for( size_t i=0; i<n_read; ++i )
+                    REQUIRE( range[2*i+1] == -int(n-4000+i) );
+            }
+            THEN("Dropped and future records are reported")
+            {
+                int rec[2];
+                REQUIRE( history.read( 0, rec ) == History::READ_TOO_OLD );
+                REQUIRE( history.read( n, rec ) == History::READ_NOT_YET );
+            }
+        }
+    }
+
+    GIVEN( "A floating point history" ) {
+        typedef MTCircularDeltaHistory< double > History;
+        History history( 64*1024, 1024 );
+
+        WHEN("A slowly varying signal is pushed")
+        {
+            std::vector< double > values;
+            for( int i=0; i<1000; ++i )
+            {
+                values.push_back( 20.0 + (i/10)*0.5 );
+                history.push( values.back() );
+            }
+
+            THEN("It is decoded bit-exactly and compressed")
+            {
+                for( int i=0; i<1000; ++i )
+                {
+                    double v;
+                    REQUIRE( history.read( i, &v ) == History::READ_OK );
+                    REQUIRE( v == values[i] );
+                }
+                REQUIRE( history.bytes_per_record() < sizeof(double)/2.0 );
+            }
+        }
+    }
+}
+
+
+SCENARIO("Batched consumption and range views", "[Views]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 8 slots, 5 items written" ) {
+        Buffer buff(8);
+        for( int i=0; i<5; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+
+        WHEN("Items are consumed in a batch")
+        {
+            Buffer::BufferSlotConsumeAccess accs[3];
+            size_t n = 0;
+            REQUIRE( buff.try_consume_available( accs, 3, n )==Buffer::ACQUIRE_OK );
+
+            THEN("Up to the batch size are granted at once, in order")
+            {
+                REQUIRE( n == 3 );
+                for( int i=0; i<3; ++i )
+                    REQUIRE( *(accs[i].data) == i );
+                REQUIRE( buff.num_consumable_slots() == 2 );
+            }
+            THEN("Each access can be released early")
+            {
+                const size_t slot = accs[0].slot;
+                accs[0].release();
+                REQUIRE( accs[0].data == 0 );
+                REQUIRE( !buff.is_read( slot ) );
+            }
+        }
+
+#if defined(MT_CIRCULAR_BUFFER_HAS_RANGES)
+        WHEN("The buffer is consumed through a range pipeline")
+        {
+            std::vector< int > out;
+            for( int v : buff.consume_view<2>() | std::views::transform( []( const int& x ) { return x*10; } ) )
+                out.push_back( v );
+
+            THEN("All the items are consumed lazily, in order")
+            {
+                REQUIRE( out.size() == 5 );
+                for( int i=0; i<5; ++i )
+                    REQUIRE( out[i] == i*10 );
+                REQUIRE( buff.num_consumable_slots() == 0 );
+                for( size_t s=0; s<buff.size(); ++s )
+                    REQUIRE( !buff.is_read( s ) );
+            }
+        }
+        WHEN("The history is iterated through a range")
+        {
+            std::vector< int > out;
+            for( int v : buff.history_view() | std::views::filter( []( const int& x ) { return x%2==0; } ) )
+                out.push_back( v );
+
+            THEN("Items are read in order without being consumed")
+            {
+                REQUIRE( out.size() == 3 );
+                REQUIRE( out[2] == 4 );
+                REQUIRE( buff.num_consumable_slots() == 5 );
+            }
+        }
+#endif
+    }
+}
+
+
+static boost::int64_t int_stamp( const int& x ) { return x; }
+
+SCENARIO("Timestamp-ordered merge of several buffers", "[Merge]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+    typedef MTCircularBufferMerge< int > Merge;
+
+    GIVEN( "Three buffers with interleaved timestamps" ) {
+        Buffer b0(8), b1(8), b2(8);
+        Buffer* bs[3] = { &b0, &b1, &b2 };
+        for( int i=0; i<12; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            bs[ (i*7)%3 ]->write_next( wa );
+            *(wa.data) = i;
+        }
+        Merge merge( &int_stamp, boost::posix_time::milliseconds(20) );
+        merge.add_source( b0, true );
+        merge.add_source( b1, true );
+        merge.add_source( b2, false );
+        REQUIRE( merge.num_sources() == 3 );
+
+        WHEN("All items are merged")
+        {
+            THEN("They come out in timestamp order, each from its own source")
+            {
+                for( int i=0; i<12; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    size_t src = 3;
+                    REQUIRE( merge.next( ca, &src )==Buffer::ACQUIRE_OK );
+                    REQUIRE( *(ca.data) == i );
+                    REQUIRE( src == size_t( (i*7)%3 ) );
+                }
+                REQUIRE( b0.num_consumable_slots()+b1.num_consumable_slots()+b2.num_consumable_slots() == 0 );
+            }
+        }
+        WHEN("A must_wait source runs dry")
+        {
+            for( int i=0; i<12; ++i )
+            {
+                Buffer::BufferSlotConsumeAccess ca;
+                merge.next( ca );
+            }
+            Buffer::BufferSlotWriteAccess wa;
+            b1.write_next( wa );
+            *(wa.data) = 100;
+            wa.release();
+
+            THEN("The other sources are emitted once the lateness bound expires")
+            {
+                const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+                Buffer::BufferSlotConsumeAccess ca;
+                size_t src = 3;
+                REQUIRE( merge.next( ca, &src )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ca.data) == 100 );
+                REQUIRE( src == 1 );
+                REQUIRE( ( boost::posix_time::microsec_clock::universal_time()-start ).total_milliseconds() >= 19 );
+                ca.release();
+                REQUIRE( merge.next( ca )==Buffer::ACQUIRE_DATA_TIMEOUT );
+            }
+        }
+        WHEN("Another consumer takes a peeked head")
+        {
+            Buffer::BufferSlotConsumeAccess first;
+            REQUIRE( merge.next( first )==Buffer::ACQUIRE_OK );
+            {
+                Buffer::BufferSlotConsumeAccess other;
+                b1.consume_next_available( other );
+                REQUIRE( *(other.data) == 1 );
+            }
+            THEN("The merge skips to the new head of that source")
+            {
+                Buffer::BufferSlotConsumeAccess ca;
+                REQUIRE( merge.next( ca )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ca.data) == 2 );
+                ca.release();
+                REQUIRE( merge.next( ca )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ca.data) == 3 );
+            }
+        }
+        WHEN("A source wraps around while its head is not the oldest")
+        {
+            Buffer::BufferSlotConsumeAccess first;
+            REQUIRE( merge.next( first )==Buffer::ACQUIRE_OK );
+            REQUIRE( *(first.data) == 0 );
+
+            THEN("Its producer is not blocked by the merge")
+            {
+                for( int i=0; i<8; ++i )
+                {
+                    Buffer::BufferSlotWriteAccess wa;
+                    REQUIRE( b1.try_write_next( wa )==Buffer::ACQUIRE_OK );
+                    *(wa.data) = 100+i;
+                }
+                REQUIRE( b1.num_consumable_slots() == 8 );
+            }
+        }
+    }
+}
+
+
+class StagedProducerThread
+{
+public:
+    StagedProducerThread( MTCircularBuffer<int>& _buff, int _id, int _n ) : buff(_buff), id(_id), n(_n) { }
+    void operator()()
+    {
+        MTCircularBufferStage< int > stage( buff, 16, boost::posix_time::milliseconds(1) );
+        for( int i=0; i<n; ++i )
+            stage.push( i, id );
+    }
+
+    MTCircularBuffer<int>& buff;
+    int id;
+    int n;
+};
+
+SCENARIO("Staged producers feeding a shared buffer", "[Stage]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 8 slots" ) {
+        Buffer buff(8);
+
+        WHEN("A batch is written")
+        {
+            const int items[5] = { 10, 11, 12, 13, 14 };
+            const boost::uint32_t tags[5] = { 0, 1, 2, 3, 4 };
+            size_t n_overwritten = 99;
+            buff.write_batch( items, 5, tags, &n_overwritten );
+
+            THEN("Items get consecutive sequence numbers and are consumed in order")
+            {
+                REQUIRE( n_overwritten == 0 );
+                REQUIRE( buff.next_seq() == 5 );
+                REQUIRE( buff.num_consumable_slots() == 5 );
+                for( int i=0; i<5; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == 10+i );
+                    REQUIRE( ca.tag == boost::uint32_t(i) );
+                    REQUIRE( ca.seq == Buffer::seq_type(i) );
+                }
+            }
+            THEN("A second batch overwrites the oldest non consumed slots")
+            {
+                buff.write_batch( items, 5, 0, &n_overwritten );
+                REQUIRE( n_overwritten == 2 );
+                REQUIRE( buff.num_consumable_slots() == 8 );
+                Buffer::BufferSlotConsumeAccess ca;
+                buff.consume_next_available( ca );
+                REQUIRE( *(ca.data) == 12 );
+            }
+        }
+
+        WHEN("A batch is larger than the buffer")
+        {
+            int items[12];
+            for( int i=0; i<12; ++i )
+                items[i] = i;
+
+            THEN("A single try_write_batch writes size() items and reports them")
+            {
+                size_t n_written = 0;
+                REQUIRE( buff.try_write_batch( items, 12, 0, 0, &n_written )==Buffer::ACQUIRE_OK );
+                REQUIRE( n_written == 8 );
+                REQUIRE( buff.next_seq() == 8 );
+            }
+            THEN("write_batch writes all of them, as several batches")
+            {
+                size_t n_overwritten = 0;
+                buff.write_batch( items, 12, 0, &n_overwritten );
+                REQUIRE( buff.next_seq() == 12 );
+                REQUIRE( n_overwritten == 4 );
+            }
+            THEN("A stage flushed after the buffer shrinks writes all of them")
+            {
+                MTCircularBufferStage< int > stage( buff, 8, boost::posix_time::seconds(10) );
+                for( int i=0; i<7; ++i )
+                    stage.push( i );
+                buff.resize( 4 );
+                REQUIRE( stage.flush()==Buffer::ACQUIRE_OK );
+                REQUIRE( stage.num_dropped() == 0 );
+                REQUIRE( buff.next_seq() == 7 );
+                Buffer::BufferSlotConsumeAccess ca;
+                buff.consume_next_available( ca );
+                REQUIRE( *(ca.data) == 3 );
+            }
+        }
+
+        WHEN("A slot of the next batch is held by a reader")
+        {
+            for( int i=0; i<8; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = i;
+            }
+            Buffer::BufferSlotReadAccess ra;
+            REQUIRE( buff.read_seq( 1, ra )==Buffer::ACQUIRE_OK );
+
+            THEN("The batch times out without writing anything")
+            {
+                const int items[4] = { 10, 11, 12, 13 };
+                REQUIRE( buff.try_write_batch( items, 4 )==Buffer::ACQUIRE_SLOT_TIMEOUT );
+                REQUIRE( buff.next_seq() == 8 );
+                REQUIRE( buff.num_consumable_slots() == 8 );
+                ra.release();
+                Buffer::BufferSlotConsumeAccess ca;
+                buff.consume_next_available( ca );
+                REQUIRE( *(ca.data) == 0 );
+            }
+            THEN("A stage flushing that batch counts all its items as dropped")
+            {
+                MTCircularBufferStage< int > stage( buff, 4, boost::posix_time::seconds(10) );
+                for( int i=0; i<4; ++i )
+                    stage.push( 10+i );
+                REQUIRE( stage.num_flushes() == 0 );
+                REQUIRE( stage.num_dropped() == 4 );
+                REQUIRE( buff.next_seq() == 8 );
+            }
+        }
+
+        WHEN("Items are pushed through a stage")
+        {
+            MTCircularBufferStage< int > stage( buff, 4, boost::posix_time::milliseconds(20) );
+            for( int i=0; i<6; ++i )
+                stage.push( i );
+
+            THEN("Only full batches reach the shared buffer")
+            {
+                REQUIRE( stage.num_flushes() == 1 );
+                REQUIRE( stage.num_staged() == 2 );
+                REQUIRE( buff.num_consumable_slots() == 4 );
+            }
+            THEN("A partial batch is flushed by poll after the delay")
+            {
+                REQUIRE( stage.poll() == Buffer::ACQUIRE_OK );
+                REQUIRE( stage.num_staged() == 2 );
+                boost::this_thread::sleep( boost::posix_time::milliseconds(25) );
+                REQUIRE( stage.poll() == Buffer::ACQUIRE_OK );
+                REQUIRE( stage.num_staged() == 0 );
+                REQUIRE( buff.num_consumable_slots() == 6 );
+                for( int i=0; i<6; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i );
+                }
+            }
+        }
+    }
+
+    GIVEN( "Several staged producer threads" ) {
+        Buffer buff(4096);
+        const int n_threads = 3;
+        const int n_items = 1000;
+        boost::thread_group producers;
+        for( int t=0; t<n_threads; ++t )
+            producers.create_thread( StagedProducerThread( buff, t, n_items ) );
+        producers.join_all();
+
+        THEN("Every item arrives, in order within each producer")
+        {
+            REQUIRE( buff.num_consumable_slots() == size_t(n_threads*n_items) );
+            int expected[n_threads] = { 0, 0, 0 };
+            for( int i=0; i<n_threads*n_items; ++i )
+            {
+                Buffer::BufferSlotConsumeAccess ca;
+                buff.consume_next_available( ca );
+                REQUIRE( *(ca.data) == expected[ca.tag]++ );
+            }
+        }
+    }
+}
+
+
+class SeqWriterThread
+{
+public:
+    SeqWriterThread( MTCircularBuffer<int>& _buff, volatile bool& _running ) : buff(_buff), running(_running) { }
+    void operator()()
+    {
+        while( running )
+        {
+            MTCircularBuffer<int>::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = static_cast<int>( wa.seq );
+        }
+    }
+
+    MTCircularBuffer<int>& buff;
+    volatile bool& running;
+};
+
+SCENARIO("Whole-ring freeze snapshot", "[Freeze]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 8 slots, 5 items written" ) {
+        Buffer buff(8);
+        for( int i=0; i<5; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+
+        WHEN("The buffer is frozen and the producer continues")
+        {
+            Buffer::FrozenRing ring;
+            REQUIRE( buff.freeze( ring ) );
+            for( int i=5; i<10; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = i;
+            }
+
+            THEN("The frozen ring keeps the content at freeze time")
+            {
+                REQUIRE( ring.first_seq() == 0 );
+                REQUIRE( ring.end_seq() == 5 );
+                for( int i=0; i<5; ++i )
+                    REQUIRE( *ring( i ) == i );
+                REQUIRE( ring( 5 ) == 0 );
+            }
+            THEN("The buffer sees all the items")
+            {
+                for( int i=2; i<10; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i );
+                }
+            }
+            THEN("Only one frozen ring can exist at a time")
+            {
+                Buffer::FrozenRing other;
+                REQUIRE( !buff.freeze( other ) );
+                REQUIRE( !other.valid() );
+            }
+            THEN("Released items are copied back and the buffer can be frozen again")
+            {
+                ring.release();
+                REQUIRE( !ring.valid() );
+                Buffer::BufferSlotReadAccess ra;
+                REQUIRE( buff.read_seq( 3, ra )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ra.data) == 3 );
+                ra.release();
+
+                REQUIRE( buff.freeze( ring ) );
+                REQUIRE( ring.first_seq() == 2 );
+                REQUIRE( ring.end_seq() == 10 );
+                for( int i=2; i<10; ++i )
+                    REQUIRE( *ring( i ) == i );
+            }
+        }
+    }
+
+    GIVEN( "A producer writing continuously" ) {
+        Buffer buff(64);
+        volatile bool running = true;
+        boost::thread producer( SeqWriterThread( buff, running ) );
+
+        THEN("Every frozen ring is consistent")
+        {
+            size_t n_checked = 0;
+            for( int k=0; k<200; ++k )
+            {
+                Buffer::FrozenRing ring;
+                REQUIRE( buff.freeze( ring ) );
+                for( Buffer::seq_type seq=ring.first_seq(); seq<ring.end_seq(); ++seq )
+                {
+                    if( *ring( seq ) != static_cast<int>( seq ) )
+                        FAIL( "Inconsistent item " << seq );
+                    ++n_checked;
+                }
+                boost::this_thread::yield();
+            }
+            REQUIRE( n_checked > 0 );
+        }
+        running = false;
+        producer.join();
+    }
+}
+
+
+SCENARIO("Online resize", "[Resize]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 8 slots, 6 items written and 2 consumed" ) {
+        Buffer buff(8);
+        for( int i=0; i<6; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+        for( int i=0; i<2; ++i )
+        {
+            Buffer::BufferSlotConsumeAccess ca;
+            buff.consume_next_available( ca );
+        }
+
+        WHEN("The buffer grows")
+        {
+            buff.resize( 16 );
+            THEN("Items keep their sequence numbers and consumed state")
+            {
+                REQUIRE( buff.size() == 16 );
+                REQUIRE( buff.next_seq() == 6 );
+                REQUIRE( buff.num_consumable_slots() == 4 );
+                for( int i=0; i<6; ++i )
+                {
+                    Buffer::BufferSlotReadAccess ra;
+                    REQUIRE( buff.read_seq( i, ra )==Buffer::ACQUIRE_OK );
+                    REQUIRE( *(ra.data) == i );
+                }
+            }
+            THEN("The new slots are used without overwriting")
+            {
+                for( int i=6; i<18; ++i )
+                {
+                    Buffer::BufferSlotWriteAccess wa;
+                    bool overwrite = true;
+                    buff.write_next( wa, &overwrite );
+                    REQUIRE( !overwrite );
+                    *(wa.data) = i;
+                }
+                for( int i=2; i<18; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i );
+                }
+            }
+        }
+        WHEN("The buffer shrinks below the number of stored items")
+        {
+            buff.resize( 3 );
+            THEN("Only the newest items are kept")
+            {
+                REQUIRE( buff.size() == 3 );
+                REQUIRE( buff.oldest_seq() == 3 );
+                REQUIRE( buff.num_consumable_slots() == 3 );
+                Buffer::BufferSlotReadAccess ra;
+                REQUIRE( buff.read_seq( 2, ra )==Buffer::ACQUIRE_TOO_OLD );
+                for( int i=3; i<6; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i );
+                }
+            }
+        }
+        WHEN("Accesses are held across a resize")
+        {
+            Buffer::BufferSlotConsumeAccess ca;
+            buff.consume_next_available( ca );
+            Buffer::BufferSlotReadAccess ra;
+            REQUIRE( buff.read_seq( 0, ra )==Buffer::ACQUIRE_OK );
+            buff.resize( 4 );
+            buff.resize( 32 );
+
+            THEN("They stay valid until released")
+            {
+                REQUIRE( *(ca.data) == 2 );
+                REQUIRE( *(ra.data) == 0 );
+                ca.release();
+                ra.release();
+                REQUIRE( buff.num_consumable_slots() == 3 );
+                Buffer::BufferSlotConsumeAccess next;
+                buff.consume_next_available( next );
+                REQUIRE( *(next.data) == 3 );
+            }
+        }
+        WHEN("A write access is in flight")
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            THEN("The resize times out")
+            {
+                REQUIRE( buff.try_resize( 16 )==Buffer::ACQUIRE_SLOT_TIMEOUT );
+                REQUIRE( buff.size() == 8 );
+            }
+        }
+    }
+
+    GIVEN( "A producer and a consumer running" ) {
+        Buffer buff(16);
+        volatile bool running = true;
+        boost::thread producer( SeqWriterThread( buff, running ) );
+
+        THEN("Items are consumed in order while the buffer is resized")
+        {
+            const size_t sizes[4] = { 64, 4, 1, 32 };
+            int last = -1;
+            for( int k=0; k<200; ++k )
+            {
+                REQUIRE( buff.try_resize( sizes[k%4] )==Buffer::ACQUIRE_OK );
+                for( int j=0; j<8; ++j )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    if( buff.try_consume_next_available( ca )!=Buffer::ACQUIRE_OK )
+                        continue;
+                    if( *(ca.data) <= last || *(ca.data) != static_cast<int>( ca.seq ) )
+                        FAIL( "Out of order item " << *(ca.data) << " after " << last );
+                    last = *(ca.data);
+                }
+            }
+            REQUIRE( last > 0 );
+        }
+        running = false;
+        producer.join();
+    }
+}
+
+
+SCENARIO("Statistics and capacity tuning", "[Tuner]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 4 slots, 6 items written and 1 consumed" ) {
+        Buffer buff(4);
+        for( int i=0; i<6; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+        {
+            Buffer::BufferSlotConsumeAccess ca;
+            buff.consume_next_available( ca );
+        }
+
+        THEN("The counters describe the traffic")
+        {
+            const Buffer::Stats st = buff.stats( true );
+            REQUIRE( st.size == 4 );
+            REQUIRE( st.occupancy == 3 );
+            REQUIRE( st.peak_occupancy == 4 );
+            REQUIRE( st.peak_lag == 3 );
+            REQUIRE( st.n_written == 6 );
+            REQUIRE( st.n_overwritten == 2 );
+            REQUIRE( st.n_consumed == 1 );
+            REQUIRE( st.recommended_size == 0 );
+
+            const Buffer::Stats after = buff.stats();
+            REQUIRE( after.peak_occupancy == 3 );
+            REQUIRE( after.peak_lag == 0 );
+            REQUIRE( after.n_written == 6 );
+        }
+    }
+
+    GIVEN( "A tuner on a buffer with 8 slots" ) {
+        Buffer buff(8);
+        MTCircularBufferTuner< int > tuner( buff, 4, 64, boost::posix_time::time_duration(0,0,0), true, 1.5, 3 );
+
+        WHEN("A burst overflows the buffer")
+        {
+            for( int i=0; i<20; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = i;
+            }
+            REQUIRE( tuner.update() );
+
+            THEN("The buffer grows to hold the burst with some headroom")
+            {
+                REQUIRE( tuner.last_decision().n_overwritten == 12 );
+                REQUIRE( tuner.last_decision().recommended_size == 30 );
+                REQUIRE( tuner.last_decision().applied );
+                REQUIRE( buff.size() == 30 );
+                REQUIRE( buff.stats().recommended_size == 30 );
+                REQUIRE( buff.stats().n_resizes == 1 );
+            }
+            THEN("It shrinks back after enough quiet windows")
+            {
+                for( int i=0; i<8; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                }
+                for( int k=0; k<2; ++k )
+                {
+                    REQUIRE( tuner.update() );
+                    REQUIRE( buff.size() == 30 );
+                }
+                REQUIRE( tuner.update() );
+                REQUIRE( tuner.last_decision().recommended_size == 4 );
+                REQUIRE( buff.size() == 4 );
+            }
+            THEN("The peaks reported by stats() are not reset by the tuner")
+            {
+                for( int i=0; i<4; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    buff.consume_next_available( ca );
+                }
+                REQUIRE( tuner.update() );
+                REQUIRE( tuner.last_decision().peak_occupancy == 8 );
+                REQUIRE( tuner.update() );
+                REQUIRE( tuner.last_decision().peak_occupancy == 4 );
+                REQUIRE( buff.stats().peak_occupancy == 8 );
+            }
+        }
+        WHEN("The buffer is resized above max_size")
+        {
+            buff.resize( 100 );
+            REQUIRE( tuner.update() );
+
+            THEN("The recommendation is clamped to max_size right away")
+            {
+                REQUIRE( tuner.last_decision().recommended_size == 64 );
+                REQUIRE( buff.size() == 64 );
+            }
+        }
+    }
+}
+
+
+SCENARIO("Newest snapshots that never block the writer", "[Snapshot]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 4 slots and 2 snapshot cells" ) {
+        Buffer buff(4);
+        buff.enable_snapshots( 2 );
+        Buffer::Snapshot s1;
+        REQUIRE( buff.try_read_newest_snapshot( s1 )==Buffer::ACQUIRE_NOT_YET );
+
+        for( int i=0; i<4; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+        buff.read_newest_snapshot( s1 );
+        REQUIRE( s1.seq == 3 );
+        REQUIRE( *(s1.data) == 3 );
+
+        WHEN("The producer wraps around while the snapshot is held")
+        {
+            const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+            for( int i=4; i<12; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                REQUIRE( buff.try_write_next( wa )==Buffer::ACQUIRE_OK );
+                *(wa.data) = i;
+            }
+            THEN("Writes do not wait and the snapshot keeps its item")
+            {
+                REQUIRE( ( boost::posix_time::microsec_clock::universal_time()-start ).total_milliseconds() < 500 );
+                REQUIRE( *(s1.data) == 3 );
+                for( int i=8; i<12; ++i )
+                {
+                    Buffer::BufferSlotReadAccess ra;
+                    REQUIRE( buff.read_seq( i, ra )==Buffer::ACQUIRE_OK );
+                    REQUIRE( *(ra.data) == i );
+                }
+            }
+            THEN("At most max_snapshots snapshots can be held")
+            {
+                Buffer::Snapshot s2, s3;
+                buff.read_newest_snapshot( s2 );
+                REQUIRE( *(s2.data) == 11 );
+                REQUIRE( buff.try_read_newest_snapshot( s3 )==Buffer::ACQUIRE_SLOT_TIMEOUT );
+                s1.release();
+                REQUIRE( buff.try_read_newest_snapshot( s3 )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(s3.data) == 11 );
+            }
+        }
+        WHEN("Snapshots are enabled")
+        {
+            Buffer::FrozenRing ring;
+            THEN("The buffer cannot be frozen")
+            {
+                REQUIRE( !buff.freeze( ring ) );
+            }
+        }
+    }
+
+    GIVEN( "A producer writing continuously" ) {
+        Buffer buff(8);
+        buff.enable_snapshots( 3 );
+        volatile bool running = true;
+        boost::thread producer( SeqWriterThread( buff, running ) );
+
+        THEN("Held snapshots keep their item")
+        {
+            Buffer::Snapshot held[3];
+            size_t n_taken = 0;
+            size_t n_overwritten = 0;
+            for( int k=0; k<3000 || n_taken==0; ++k )
+            {
+                Buffer::Snapshot& snap = held[ k%3 ];
+                if( buff.try_read_newest_snapshot( snap )!=Buffer::ACQUIRE_OK )
+                {
+                    boost::this_thread::yield();
+                    continue;
+                }
+                ++n_taken;
+                for( int h=0; h<3; ++h )
+                {
+                    if( held[h].data && *(held[h].data) != static_cast<int>( held[h].seq ) )
+                        ++n_overwritten;
+                }
+                if( k%100==0 )
+                    boost::this_thread::yield();
+            }
+            running = false;
+            producer.join();
+            REQUIRE( n_taken > 0 );
+            REQUIRE( n_overwritten == 0 );
+        }
+        running = false;
+        if( producer.joinable() )
+            producer.join();
+    }
+}
+
+
+class AckLaterThread
+{
+public:
+    AckLaterThread( MTCircularBuffer<int>& _buff, MTCircularBuffer<int>::AckToken& _token, int& _seen ) : buff(_buff), token(_token), seen(_seen) { }
+    void operator()()
+    {
+        boost::this_thread::sleep( boost::posix_time::milliseconds(50) );
+        seen = *(token.data);
+        buff.ack( token );
+    }
+
+    MTCircularBuffer<int>& buff;
+    MTCircularBuffer<int>::AckToken& token;
+    int& seen;
+};
+
+struct AckDispatchQueue
+{
+    AckDispatchQueue() : done(false) {}
+    boost::mutex mtx;
+    std::deque< MTCircularBuffer<int>::AckToken > tokens;
+    volatile bool done;
+};
+
+class AckWorkerThread
+{
+public:
+    AckWorkerThread( MTCircularBuffer<int>& _buff, AckDispatchQueue& _queue, size_t& _n_corrupted ) : buff(_buff), queue(_queue), n_corrupted(_n_corrupted) { }
+    void operator()()
+    {
+        MTCircularBuffer<int>::AckToken held[2];
+        while( true )
+        {
+            size_t n = 0;
+            {
+                boost::unique_lock< boost::mutex > lock( queue.mtx );
+                if( queue.tokens.empty() && queue.done )
+                    return;
+                while( n<2 && !queue.tokens.empty() )
+                {
+                    held[n++] = queue.tokens.front();
+                    queue.tokens.pop_front();
+                }
+            }
+            // acknowledged in reverse consume order
+            while( n>0 )
+            {
+                --n;
+                if( *(held[n].data) != static_cast<int>( held[n].seq ) )
+                    ++n_corrupted;
+                buff.ack( held[n] );
+            }
+            boost::this_thread::yield();
+        }
+    }
+
+    MTCircularBuffer<int>& buff;
+    AckDispatchQueue& queue;
+    size_t& n_corrupted;
+};
+
+SCENARIO("Out-of-order acknowledgment window", "[Ack]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 4 slots, a window of 3 and 3 items consumed" ) {
+        Buffer buff(4);
+        buff.enable_ack_window( 3 );
+        for( int i=0; i<4; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+        Buffer::AckToken t0, t1, t2;
+        buff.consume_next_available( t0 );
+        buff.consume_next_available( t1 );
+        buff.consume_next_available( t2 );
+        REQUIRE( t0.seq == 0 );
+        REQUIRE( *(t2.data) == 2 );
+        REQUIRE( buff.num_in_flight() == 3 );
+        REQUIRE( buff.num_consumable_slots() == 1 );
+
+        WHEN("Items are acknowledged out of order")
+        {
+            REQUIRE( buff.ack( t2 ) );
+            REQUIRE( buff.ack( t1 ) );
+            THEN("Slots are freed only with the acknowledged prefix")
+            {
+                REQUIRE( buff.acked_seq() == 0 );
+                REQUIRE( buff.num_in_flight() == 3 );
+                REQUIRE( buff.ack( t0 ) );
+                REQUIRE( buff.acked_seq() == 3 );
+                REQUIRE( buff.num_in_flight() == 0 );
+            }
+            THEN("Tokens cannot be acknowledged twice")
+            {
+                Buffer::AckToken copy = t0;
+                REQUIRE( buff.ack( t0 ) );
+                REQUIRE( !t0.valid() );
+                REQUIRE( !buff.ack( copy ) );
+            }
+        }
+        WHEN("The window is full")
+        {
+            int seen = -1;
+            boost::thread acker( AckLaterThread( buff, t0, seen ) );
+            Buffer::AckToken t3;
+            REQUIRE( buff.try_consume_next_available( t3 )==Buffer::ACQUIRE_OK );
+            acker.join();
+            THEN("Consumers wait for a place")
+            {
+                REQUIRE( seen == 0 );
+                REQUIRE( t3.seq == 3 );
+                REQUIRE( buff.num_in_flight() == 3 );
+            }
+        }
+        WHEN("The producer reaches an item in flight")
+        {
+            REQUIRE( buff.ack( t0 ) );
+            REQUIRE( buff.ack( t1 ) );
+            for( int i=4; i<6; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = i;
+            }
+            int seen = -1;
+            boost::thread acker( AckLaterThread( buff, t2, seen ) );
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = 6;
+            }
+            acker.join();
+            THEN("It waits until the item is acknowledged")
+            {
+                REQUIRE( seen == 2 );
+                Buffer::BufferSlotReadAccess ra;
+                REQUIRE( buff.read_seq( 6, ra )==Buffer::ACQUIRE_OK );
+                REQUIRE( *(ra.data) == 6 );
+            }
+        }
+        WHEN("The ack window is enabled")
+        {
+            Buffer::FrozenRing ring;
+            THEN("The buffer cannot be frozen")
+            {
+                REQUIRE( !buff.freeze( ring ) );
+            }
+        }
+    }
+
+    GIVEN( "A producer writing continuously and two workers acknowledging out of order" ) {
+        Buffer buff(8);
+        buff.enable_ack_window( 6 );
+        volatile bool running = true;
+        boost::thread producer( SeqWriterThread( buff, running ) );
+
+        THEN("Items in flight are never overwritten")
+        {
+            AckDispatchQueue queue;
+            size_t n_corrupted[2] = { 0, 0 };
+            boost::thread w1( AckWorkerThread( buff, queue, n_corrupted[0] ) );
+            boost::thread w2( AckWorkerThread( buff, queue, n_corrupted[1] ) );
+            for( int k=0; k<3000; ++k )
+            {
+                Buffer::AckToken token;
+                buff.consume_next_available( token );
+                boost::unique_lock< boost::mutex > lock( queue.mtx );
+                queue.tokens.push_back( token );
+            }
+            queue.done = true;
+            w1.join();
+            w2.join();
+            running = false;
+            producer.join();
+            REQUIRE( n_corrupted[0]+n_corrupted[1] == 0 );
+            REQUIRE( buff.num_in_flight() == 0 );
+        }
+        running = false;
+        if( producer.joinable() )
+            producer.join();
+    }
+}
+
+
+class RegisteredConsumerThread
+{
+public:
+    RegisteredConsumerThread( MTCircularBuffer<int>& _buff, MTCircularBuffer<int>::ConsumerMetrics* _metrics ) : buff(_buff), metrics(_metrics) { }
+    void operator()()
+    {
+        buff.register_consumer( metrics );
+        MTCircularBuffer<int>::BufferSlotConsumeAccess ca;
+        buff.consume_next_available( ca );
+        buff.register_consumer( 0 );
+    }
+
+    MTCircularBuffer<int>& buff;
+    MTCircularBuffer<int>::ConsumerMetrics* metrics;
+};
+
+SCENARIO("Per-consumer lag and throughput metrics", "[Metrics]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "Buffer with 8 slots and a consumer registered in a group" ) {
+        Buffer buff(8);
+        Buffer::ConsumerMetrics group;
+        Buffer::ConsumerMetrics mine( &group );
+        buff.register_consumer( &mine );
+        for( int i=0; i<5; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+        REQUIRE( buff.num_consumable_slots() == 5 );
+
+        WHEN("An item is consumed some time after being published")
+        {
+            boost::this_thread::sleep( boost::posix_time::milliseconds(20) );
+            {
+                Buffer::BufferSlotConsumeAccess ca;
+                buff.consume_next_available( ca );
+            }
+            THEN("Its lag is recorded for the consumer and its group")
+            {
+                const Buffer::ConsumerMetrics::Sample s = mine.sample();
+                REQUIRE( s.n_consumed == 1 );
+                REQUIRE( s.lag == 4 );
+                REQUIRE( s.lag_us >= 15000 );
+                REQUIRE( s.rate > 0.0 );
+                REQUIRE( group.sample().n_consumed == 1 );
+                REQUIRE( group.sample().lag == 4 );
+                REQUIRE( buff.num_consumable_slots() == 4 );
+            }
+        }
+        WHEN("Other threads consume")
+        {
+            Buffer::ConsumerMetrics other( &group );
+            boost::thread t1( RegisteredConsumerThread( buff, &other ) );
+            t1.join();
+            boost::thread t2( RegisteredConsumerThread( buff, 0 ) );
+            t2.join();
+            THEN("Only registered consumers are counted")
+            {
+                REQUIRE( mine.sample().n_consumed == 0 );
+                REQUIRE( other.sample().n_consumed == 1 );
+                REQUIRE( group.sample().n_consumed == 1 );
+                REQUIRE( buff.stats().n_consumed == 2 );
+            }
+        }
+        WHEN("A consumer waits for data")
+        {
+            buff.clear();
+            Buffer::ConsumerMetrics waiting;
+            boost::thread consumer( RegisteredConsumerThread( buff, &waiting ) );
+            boost::this_thread::sleep( boost::posix_time::milliseconds(50) );
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                buff.write_next( wa );
+                *(wa.data) = 5;
+            }
+            consumer.join();
+            THEN("The time spent blocked is recorded")
+            {
+                const Buffer::ConsumerMetrics::Sample s = waiting.sample( true );
+                REQUIRE( s.n_consumed == 1 );
+                REQUIRE( s.blocked_us >= 40000 );
+                REQUIRE( s.lag == 0 );
+                REQUIRE( waiting.sample().rate == 0.0 );
+            }
+        }
+        buff.register_consumer( 0 );
+    }
+}
+
+
+SCENARIO("OpenMetrics text exporter", "[Export]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "A buffer with 3 items written, one consumed, registered with its consumer" ) {
+        Buffer buff(8);
+        Buffer::ConsumerMetrics decoder;
+        buff.register_consumer( &decoder );
+        for( int i=0; i<3; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            buff.write_next( wa );
+            *(wa.data) = i;
+        }
+        {
+            Buffer::BufferSlotConsumeAccess ca;
+            buff.consume_next_available( ca );
+        }
+        buff.register_consumer( 0 );
+
+        MTCircularBufferExporter exporter;
+        exporter.add_buffer( "frames", buff );
+        exporter.add_consumer( "frames", "decoder", decoder );
+
+        WHEN("The exposition is rendered")
+        {
+            const std::string text = exporter.render();
+            THEN("It holds the buffer counters and the consumer histogram")
+            {
+                REQUIRE( text.find( "# TYPE mtcircularbuffer_written counter\n" ) != std::string::npos );
+                REQUIRE( text.find( "mtcircularbuffer_written_total{buffer=\"frames\"} 3\n" ) != std::string::npos );
+                REQUIRE( text.find( "mtcircularbuffer_occupancy{buffer=\"frames\"} 2\n" ) != std::string::npos );
+                REQUIRE( text.find( "mtcircularbuffer_size{buffer=\"frames\"} 8\n" ) != std::string::npos );
+                REQUIRE( text.find( "mtcircularbuffer_consumer_consumed_total{buffer=\"frames\",consumer=\"decoder\"} 1\n" ) != std::string::npos );
+                REQUIRE( text.find( "mtcircularbuffer_consumer_lag_items{buffer=\"frames\",consumer=\"decoder\"} 2\n" ) != std::string::npos );
+                REQUIRE( text.find( "_bucket{buffer=\"frames\",consumer=\"decoder\",le=\"+Inf\"} 1\n" ) != std::string::npos );
+                REQUIRE( text.find( "mtcircularbuffer_consumer_lag_distribution_seconds_count{buffer=\"frames\",consumer=\"decoder\"} 1\n" ) != std::string::npos );
+                REQUIRE( text.size() >= 6 );
+                REQUIRE( text.substr( text.size()-6 ) == "# EOF\n" );
+            }
+            THEN("It can be written to a file descriptor")
+            {
+                int fds[2];
+                REQUIRE( pipe( fds )==0 );
+                REQUIRE( exporter.write( fds[1] ) );
+                close( fds[1] );
+                std::string received;
+                char chunk[256];
+                ssize_t n;
+                while( ( n = read( fds[0], chunk, sizeof(chunk) ) ) > 0 )
+                    received.append( chunk, n );
+                close( fds[0] );
+                REQUIRE( received == exporter.render() );
+            }
+        }
+        WHEN("Label values need escaping and a buffer is removed")
+        {
+            Buffer other(4);
+            exporter.add_buffer( "a \"quoted\"\\name", other );
+            REQUIRE( exporter.render().find( "{buffer=\"a \\\"quoted\\\"\\\\name\"} 4\n" ) != std::string::npos );
+            REQUIRE( exporter.remove( &buff ) );
+            REQUIRE( !exporter.remove( &buff ) );
+            THEN("Only the remaining buffer is exported")
+            {
+                const std::string text = exporter.render();
+                REQUIRE( text.find( "buffer=\"frames\"} 8" ) == std::string::npos );
+                REQUIRE( text.find( "mtcircularbuffer_size{buffer=" ) != std::string::npos );
+            }
+        }
+    }
+}
+
+
+SCENARIO("Workload generator", "[Workload]")
+{
+    GIVEN( "A latency histogram with the values 1..1000 us" ) {
+        MTLatencyHistogram h;
+        for( boost::uint64_t us=1; us<=1000; ++us )
+            h.record( us );
+
+        THEN("Percentiles are within the histogram resolution")
+        {
+            REQUIRE( h.count() == 1000 );
+            REQUIRE( h.max() == 1000 );
+            REQUIRE( h.percentile( 0.05 ) == 50 );
+            REQUIRE( h.percentile( 0.5 ) >= 500 );
+            REQUIRE( h.percentile( 0.5 ) <= 500+500/32 );
+            REQUIRE( h.percentile( 0.99 ) >= 990 );
+            REQUIRE( h.percentile( 1.0 ) == 1000 );
+        }
+    }
+
+    GIVEN( "Two bursty producers, a consumer and a reader on a small buffer" ) {
+        typedef MTCircularBufferWorkload< 128 > Workload;
+        Workload::Buffer buff( 32 );
+        MTWorkloadConfig cfg;
+        cfg.n_producers = 2;
+        cfg.n_readers = 1;
+        cfg.rate = 20000;
+        cfg.burst_size = 16;
+        cfg.payload_bytes = 128;
+        cfg.duration = boost::posix_time::milliseconds( 200 );
+
+        WHEN("The workload runs")
+        {
+            const MTWorkloadReport report = Workload( buff, cfg ).run();
+
+            THEN("Every produced item is either consumed or lost")
+            {
+                REQUIRE( report.seconds >= 0.2 );
+                REQUIRE( report.n_produced > 0 );
+                REQUIRE( report.n_consumed > 0 );
+                REQUIRE( report.n_produced <= 2*20000*report.seconds+2*16 );
+                REQUIRE( report.n_consumed+report.n_lost == report.n_produced );
+                REQUIRE( report.latency_us_p50 <= report.latency_us_p99 );
+                REQUIRE( report.latency_us_p99 <= report.latency_us_max );
+                REQUIRE( report.to_string().find( "produced " ) == 0 );
+            }
+        }
+    }
+}
+
+
+/*
+ * Torture harness: producers, consumers and readers hammer a buffer with randomly chosen access
+ * types until every producer has written its items. Each item carries its producer, its per-producer
+ * sequence number and a check word, so that torn, duplicated and reordered items can be detected.
+ */
+struct TortureItem
+{
+    boost::uint32_t producer;
+    boost::uint64_t seq;
+    boost::uint64_t check;
+};
+
+inline boost::uint64_t torture_check( boost::uint32_t producer, boost::uint64_t seq )
+{
+    return ( seq*0x9E3779B97F4A7C15ULL ) ^ ( static_cast< boost::uint64_t >( producer ) << 48 );
+}
+
+struct TortureResult
+{
+    double seconds;
+    size_t n_ops;
+    size_t n_produced;
+    size_t n_consumed;
+    size_t n_overwritten;       // as reported to the producers
+    size_t n_torn;
+    size_t n_duplicated;
+    size_t n_reordered;
+    size_t n_left;              // items still consumable after the consumers stopped
+};
+
+template< typename SYNC >
+class TortureHarness
+{
+public:
+    typedef MTCircularBuffer< TortureItem, SYNC > Buffer;
+
+    TortureHarness( Buffer& _buff, size_t _n_producers, size_t _n_consumers, size_t _n_readers, size_t _n_items, bool _snapshots ) :
+        buff(_buff), n_producers(_n_producers), n_consumers(_n_consumers), n_readers(_n_readers), n_items(_n_items), snapshots(_snapshots),
+        consumed( new boost::atomic< boost::uint8_t >[ _n_producers*_n_items ] ), producers_done(false), n_ops(0), n_consumed(0),
+        n_overwritten(0), n_torn(0), n_duplicated(0), n_reordered(0)
+    {
+        for( size_t i=0; i<n_producers*n_items; ++i )
+            consumed[i] = 0;
+    }
+
+    inline TortureResult run()
+    {
+        const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+        boost::thread_group producers, others;
+        for( size_t i=0; i<n_producers; ++i )
+            producers.create_thread( boost::bind( &TortureHarness::produce, this, static_cast< boost::uint32_t >( i ) ) );
+        for( size_t i=0; i<n_consumers; ++i )
+            others.create_thread( boost::bind( &TortureHarness::consume, this, static_cast< boost::uint32_t >( 100+i ) ) );
+        for( size_t i=0; i<n_readers; ++i )
+            others.create_thread( boost::bind( &TortureHarness::read, this, static_cast< boost::uint32_t >( 200+i ) ) );
+        producers.join_all();
+        producers_done = true;
+        others.join_all();
+
+        TortureResult res;
+        res.seconds = ( boost::posix_time::microsec_clock::universal_time()-t0 ).total_microseconds()*1E-6;
+        res.n_ops = n_ops;
+        res.n_produced = n_producers*n_items;
+        res.n_consumed = n_consumed;
+        res.n_overwritten = n_overwritten;
+        res.n_torn = n_torn;
+        res.n_duplicated = n_duplicated;
+        res.n_reordered = n_reordered;
+        res.n_left = buff.num_consumable_slots();
+        return res;
+    }
+
+private:
+
+    static inline boost::uint32_t next_random( boost::uint32_t& state )
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    inline bool valid( const TortureItem& item )
+    {
+        if( item.producer < n_producers && item.seq < n_items && item.check==torture_check( item.producer, item.seq ) )
+            return true;
+        n_torn++;
+        return false;
+    }
+
+    inline void produce( boost::uint32_t id )
+    {
+        boost::uint32_t state = 2463534242U+id;
+        TortureItem batch[8];
+        boost::uint64_t seq = 0;
+        while( seq < n_items )
+        {
+            if( next_random( state )%4 == 0 )
+            {
+                size_t n = 1+next_random( state )%8;
+                if( n > n_items-seq )
+                    n = static_cast< size_t >( n_items-seq );
+                for( size_t k=0; k<n; ++k, ++seq )
+                {
+                    batch[k].producer = id;
+                    batch[k].seq = seq;
+                    batch[k].check = torture_check( id, seq );
+                }
+                size_t overwritten = 0;
+                buff.write_batch( batch, n, 0, &overwritten );
+                n_overwritten += overwritten;
+                n_ops += n;
+            }
+            else
+            {
+                typename Buffer::BufferSlotWriteAccess wa;
+                bool overwritten = false;
+                buff.write_next( wa, &overwritten );
+                wa.data->producer = id;
+                wa.data->seq = seq;
+                wa.data->check = torture_check( id, seq );
+                ++seq;
+                if( overwritten )
+                    n_overwritten++;
+                n_ops++;
+            }
+        }
+    }
+
+    inline void consumed_item( const TortureItem& item, std::vector< boost::int64_t >& last_seq )
+    {
+        n_ops++;
+        if( !valid( item ) )
+            return;
+        n_consumed++;
+        if( consumed[ item.producer*n_items+item.seq ].exchange( 1 )!=0 )
+            n_duplicated++;
+        if( static_cast< boost::int64_t >( item.seq ) <= last_seq[ item.producer ] )
+            n_reordered++;
+        last_seq[ item.producer ] = static_cast< boost::int64_t >( item.seq );
+    }
+
+    inline void consume( boost::uint32_t id )
+    {
+        boost::uint32_t state = 2463534242U+id;
+        std::vector< boost::int64_t > last_seq( n_producers, -1 );
+        typename Buffer::BufferSlotConsumeAccess accs[8];
+        while( !producers_done || buff.num_consumable_slots()>0 )
+        {
+            if( next_random( state )%2 == 0 )
+            {
+                typename Buffer::BufferSlotConsumeAccess ca;
+                if( buff.try_consume_next_available( ca )==Buffer::ACQUIRE_OK )
+                    consumed_item( *(ca.data), last_seq );
+            }
+            else
+            {
+                size_t n = 0;
+                if( buff.try_consume_available( accs, 1+next_random( state )%8, n )==Buffer::ACQUIRE_OK )
+                {
+                    for( size_t k=0; k<n; ++k )
+                    {
+                        consumed_item( *(accs[k].data), last_seq );
+                        accs[k].release();
+                    }
+                }
+            }
+        }
+    }
+
+    inline void read( boost::uint32_t id )
+    {
+        boost::uint32_t state = 2463534242U+id;
+        while( !producers_done )
+        {
+            const boost::uint32_t op = next_random( state )%3;
+            if( op==0 && snapshots )
+            {
+                typename Buffer::Snapshot snap;
+                if( buff.try_read_newest_snapshot( snap )==Buffer::ACQUIRE_OK )
+                    valid( *(snap.data) );
+            }
+            else if( op==1 )
+            {
+                typename Buffer::BufferSlotPeekAccess pa;
+                if( buff.try_peek_next_available( pa )==Buffer::ACQUIRE_OK )
+                    valid( *(pa.data) );
+            }
+            else
+            {
+                typename Buffer::BufferSlotReadAccess ra;
+                if( buff.try_read_newest_available( ra )==Buffer::ACQUIRE_OK )
+                    valid( *(ra.data) );
+            }
+            n_ops++;
+        }
+    }
+
+    Buffer& buff;
+    const size_t n_producers;
+    const size_t n_consumers;
+    const size_t n_readers;
+    const size_t n_items;
+    const bool snapshots;
+    boost::scoped_array< boost::atomic< boost::uint8_t > > consumed;
+    boost::atomic< bool > producers_done;
+    boost::atomic< size_t > n_ops;
+    boost::atomic< size_t > n_consumed;
+    boost::atomic< size_t > n_overwritten;
+    boost::atomic< size_t > n_torn;
+    boost::atomic< size_t > n_duplicated;
+    boost::atomic< size_t > n_reordered;
+};
+
+template< typename SYNC >
+inline TortureResult run_torture( const std::string& mode, MTCircularBuffer< TortureItem, SYNC >& buff, bool snapshots )
+{
+    const TortureResult res = TortureHarness< SYNC >( buff, 3, 2, 2, 20000, snapshots ).run();
+    std::cout << "Torture, " << mode << ": " << static_cast< size_t >( res.n_ops/res.seconds ) << " ops/s, "
+              << res.n_consumed << " consumed, " << res.n_overwritten << " overwritten" << std::endl;
+    return res;
+}
+
+inline void require_invariants( const TortureResult& res, size_t n_overwritten_stats )
+{
+    REQUIRE( res.n_torn == 0 );
+    REQUIRE( res.n_duplicated == 0 );
+    REQUIRE( res.n_reordered == 0 );
+    REQUIRE( res.n_left == 0 );
+    REQUIRE( res.n_consumed+res.n_overwritten == res.n_produced );
+    REQUIRE( res.n_overwritten == n_overwritten_stats );
+}
+
+SCENARIO("Concurrency torture", "[Torture]")
+{
+    GIVEN( "3 producers, 2 consumers and 2 readers writing, consuming, peeking and reading 60000 items" ) {
+
+        WHEN("The buffer uses the default sync")
+        {
+            MTCircularBuffer< TortureItem > buff( 16 );
+            const TortureResult res = run_torture( "default sync", buff, false );
+            THEN("No item is torn, duplicated, reordered or unaccounted for")
+            {
+                require_invariants( res, buff.stats().n_overwritten );
+            }
+        }
+        WHEN("The buffer prefetches, serves snapshots and has a registered consumer")
+        {
+            MTCircularBuffer< TortureItem > buff( 16 );
+            buff.set_prefetch( 2, sizeof(TortureItem) );
+            buff.enable_snapshots( 4 );
+            MTCircularBuffer< TortureItem >::ConsumerMetrics metrics;
+            buff.register_consumer( &metrics );
+            const TortureResult res = run_torture( "prefetch, snapshots, metrics", buff, true );
+            buff.register_consumer( 0 );
+            THEN("No item is torn, duplicated, reordered or unaccounted for")
+            {
+                require_invariants( res, buff.stats().n_overwritten );
+            }
+        }
+#if defined(MT_CIRCULAR_BUFFER_HAS_RT)
+        WHEN("The buffer uses priority-inheritance locks")
+        {
+            MTCircularBuffer< TortureItem, MTCircularBufferRTSync > buff( 16 );
+            const TortureResult res = run_torture( "RT sync", buff, false );
+            THEN("No item is torn, duplicated, reordered or unaccounted for")
+            {
+                require_invariants( res, buff.stats().n_overwritten );
+            }
+        }
+#endif
+    }
+}
+
+
+SCENARIO("Unix socket bridge", "[Socket]")
+{
+    typedef MTCircularBuffer< int > Buffer;
+
+    GIVEN( "A sender and a receiver connected by a Unix socket pair, and 100 items to send" ) {
+        int fds[2];
+        REQUIRE( socketpair( AF_UNIX, SOCK_STREAM, 0, fds )==0 );
+        Buffer source(128);
+        Buffer dest(128);
+        MTCircularBufferSocketSender< int > sender( source, fds[0], 16 );
+        MTCircularBufferSocketReceiver< int > receiver( dest, fds[1], 16 );
+        for( int i=0; i<100; ++i )
+        {
+            Buffer::BufferSlotWriteAccess wa;
+            source.write_next( wa );
+            *(wa.data) = i;
+            wa.tag = 1000+i;
+        }
+
+        WHEN("The items are sent and received")
+        {
+            while( sender.num_sent() < 100 )
+                REQUIRE( sender.send_available() > 0 );
+            while( receiver.num_received() < 100 )
+                REQUIRE( receiver.receive_available() > 0 );
+
+            THEN("They are written in order, with their tags, with one syscall per batch")
+            {
+                REQUIRE( sender.num_syscalls() == 7 );
+                REQUIRE( receiver.num_syscalls() == 7 );
+                REQUIRE( source.num_consumable_slots() == 0 );
+                for( int i=0; i<100; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    dest.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i );
+                    REQUIRE( ca.tag == static_cast< boost::uint32_t >( 1000+i ) );
+                }
+            }
+        }
+        WHEN("A frame arrives in two parts")
+        {
+            MTSocketFrameHeader header;
+            header.bytes = sizeof(int);
+            header.tag = 7;
+            const int item = 42;
+            REQUIRE( write( fds[0], &header, sizeof(header) ) == static_cast< ssize_t >( sizeof(header) ) );
+            REQUIRE( receiver.receive_available() == 0 );
+            REQUIRE( write( fds[0], &item, sizeof(item) ) == static_cast< ssize_t >( sizeof(item) ) );
+            REQUIRE( receiver.receive_available() == 1 );
+
+            THEN("The item is written once complete")
+            {
+                Buffer::BufferSlotConsumeAccess ca;
+                dest.consume_next_available( ca );
+                REQUIRE( *(ca.data) == 42 );
+                REQUIRE( ca.tag == 7 );
+            }
+        }
+        WHEN("A frame does not hold an item")
+        {
+            MTSocketFrameHeader header;
+            header.bytes = 3;
+            header.tag = 0;
+            char padding[4] = { 0, 0, 0, 0 };
+            REQUIRE( write( fds[0], &header, sizeof(header) ) == static_cast< ssize_t >( sizeof(header) ) );
+            REQUIRE( write( fds[0], padding, sizeof(padding) ) == static_cast< ssize_t >( sizeof(padding) ) );
+
+            THEN("The receiver reports a protocol error and closes, since the stream cannot be resynchronized")
+            {
+                REQUIRE( receiver.receive_available() == -1 );
+                REQUIRE( errno == EPROTO );
+                REQUIRE( receiver.closed() );
+                REQUIRE( receiver.receive_available() == -1 );
+                REQUIRE( receiver.num_syscalls() == 1 );
+            }
+        }
+        WHEN("A slot of the destination is held while frames arrive")
+        {
+            Buffer::BufferSlotReadAccess held;
+            REQUIRE( dest.try_read_slot( 1, held )==Buffer::ACQUIRE_OK );
+            REQUIRE( sender.send_available() == 16 );
+            REQUIRE( receiver.receive_available() == -1 );
+            REQUIRE( errno == ETIMEDOUT );
+            REQUIRE( receiver.num_received() == 1 );
+            held.release();
+
+            THEN("The remaining frames are written once, on the next calls")
+            {
+                REQUIRE( receiver.receive_available() == 15 );
+                REQUIRE( receiver.num_received() == 16 );
+                REQUIRE( dest.next_seq() == 16 );
+                for( int i=0; i<16; ++i )
+                {
+                    Buffer::BufferSlotConsumeAccess ca;
+                    dest.consume_next_available( ca );
+                    REQUIRE( *(ca.data) == i );
+                }
+            }
+        }
+        WHEN("The sender side is closed")
+        {
+            close( fds[0] );
+            fds[0] = -1;
+
+            THEN("The receiver reports the end of the stream")
+            {
+                REQUIRE( receiver.receive_available() == -1 );
+                REQUIRE( receiver.closed() );
+            }
+        }
+        if( fds[0]>=0 )
+            close( fds[0] );
+        close( fds[1] );
+    }
+}
+
+
+struct VariantPosition
+{
+    double x;
+    double y;
+};
+
+struct VariantEvent
+{
+    int code;
+};
+
+struct VariantText
+{
+    char text[32];
+};
+
+struct VariantCounted
+{
+    VariantCounted() : code(0) { n_constructed++; }
+    VariantCounted( const VariantCounted& o ) : code(o.code) { n_copied++; }
+    VariantCounted& operator=( const VariantCounted& o ) { code = o.code; n_copied++; return *this; }
+
+    int code;
+    static int n_constructed;
+    static int n_copied;
+};
+int VariantCounted::n_constructed = 0;
+int VariantCounted::n_copied = 0;
+
+typedef boost::variant< VariantPosition, VariantEvent, VariantText > VariantMessage;
+
+class VariantRecorder : public boost::static_visitor< int >
+{
+public:
+    VariantRecorder( std::string& _log ) : log(&_log) {}
+    int operator()( const VariantPosition& p ) const { *log += "P"; return static_cast< int >( p.x+p.y ); }
+    int operator()( const VariantEvent& e ) const { *log += "E"; return e.code; }
+    int operator()( const VariantText& t ) const { *log += "T"; return static_cast< int >( std::strlen( t.text ) ); }
+    int operator()( const VariantCounted& c ) const { *log += "C"; return c.code; }
+
+    std::string* log;
+};
+
+SCENARIO("Heterogeneous message slots", "[Variant]")
+{
+    typedef MTCircularBuffer< VariantMessage > Buffer;
+
+    GIVEN( "A buffer of 8 variant slots" ) {
+        Buffer buff(8);
+        std::string log;
+        log.reserve( 64 );
+
+        WHEN("Messages of different types are written and consumed through the same slots")
+        {
+            int sum = 0;
+            count_allocations = true;
+            num_allocations = 0;
+            for( int i=0; i<24; ++i )
+            {
+                {
+                    Buffer::BufferSlotWriteAccess wa;
+                    switch( i%3 )
+                    {
+                    case 0: { VariantPosition& p = write_next_as< VariantPosition >( buff, wa ); p.x = i; p.y = 1; break; }
+                    case 1: { write_next_as< VariantEvent >( buff, wa ).code = i; break; }
+                    default: { VariantText& t = write_next_as< VariantText >( buff, wa ); std::strcpy( t.text, "abc" ); break; }
+                    }
+                }
+                if( i%2==1 )
+                {
+                    sum += consume_next_visit( buff, VariantRecorder( log ) );
+                    sum += consume_next_visit( buff, VariantRecorder( log ) );
+                }
+            }
+            count_allocations = false;
+
+            THEN("They are dispatched in order, by type, without any allocation")
+            {
+                REQUIRE( num_allocations == 0 );
+                REQUIRE( log == "PETPETPETPETPETPETPETPET" );
+                REQUIRE( sum == (0+3+6+9+12+15+18+21)+8*1 + (1+4+7+10+13+16+19+22) + 8*3 );
+                REQUIRE( try_consume_next_visit( buff, VariantRecorder( log ) ) == Buffer::ACQUIRE_DATA_TIMEOUT );
+            }
+        }
+        WHEN("A slot is reused by another message type")
+        {
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                write_next_as< VariantEvent >( buff, wa ).code = 5;
+            }
+            {
+                Buffer::BufferSlotReadAccess ra;
+                buff.read_newest_available( ra );
+                REQUIRE( ra.data->which() == 1 );
+            }
+            for( int i=0; i<8; ++i )
+            {
+                Buffer::BufferSlotWriteAccess wa;
+                std::strcpy( write_next_as< VariantText >( buff, wa ).text, "x" );
+            }
+            THEN("The slot holds the new type")
+            {
+                REQUIRE( buff.stats().n_overwritten == 1 );
+                std::string types;
+                for( int i=0; i<8; ++i )
+                    consume_next_visit( buff, VariantRecorder( types ) );
+                REQUIRE( types == "TTTTTTTT" );
+            }
+        }
+    }
+#if defined(MT_CIRCULAR_BUFFER_HAS_STD_VARIANT)
+    GIVEN( "A buffer of 8 std::variant slots" ) {
+        typedef MTCircularBuffer< std::variant< VariantPosition, VariantCounted > > StdBuffer;
+        StdBuffer buff(8);
+        VariantCounted::n_constructed = 0;
+        VariantCounted::n_copied = 0;
+
+        WHEN("Messages of different types are written through the same slots")
+        {
+            for( int i=0; i<16; ++i )
+            {
+                StdBuffer::BufferSlotWriteAccess wa;
+                if( i%2==0 )
+                    write_next_as< VariantPosition >( buff, wa ).x = i;
+                else
+                    write_next_as< VariantCounted >( buff, wa ).code = i;
+            }
+
+            THEN("Messages are constructed in place, never copied")
+            {
+                REQUIRE( VariantCounted::n_constructed == 8 );
+                REQUIRE( VariantCounted::n_copied == 0 );
+
+                std::string log;
+                for( int i=0; i<8; ++i )
+                    consume_next_visit( buff, VariantRecorder( log ) );
+                REQUIRE( log == "PCPCPCPC" );
+                REQUIRE( try_consume_next_visit( buff, VariantRecorder( log ) ) == StdBuffer::ACQUIRE_DATA_TIMEOUT );
+            }
+        }
+    }
+#endif
+}
+
+
+class SimpleProducerThread
+{
+public:
+    SimpleProducerThread( MTCircularBuffer<int>& _buff ) : running(true), buff(_buff) { }
+    void operator()()
+    {
+
+        while( running )
+        {
+            {
+                MTCircularBuffer<int>::BufferSlotWriteAccess wa;
+                bool overwrite = false;
+                try{
+                    buff.write_next( wa, &overwrite );
+                } catch( MTCircularBuffer<int>::SlotAcqTimeout& ex )
+                {
+                    std::cout << "Write lock timeout" << std::endl;
+                }
+
+                if( overwrite )
+                    std::cout << "Overwrite occurred" << std::endl;
+                boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+            }
+        }
+    }
+    inline void kill()
+    {
+        running = false;
+    }
+
+    bool running;
+    MTCircularBuffer<int>& buff;
+};
+
+class SimpleConsumerThread
+{
+public:
+    SimpleConsumerThread( MTCircularBuffer<int>& _buff ) : running(true), buff(_buff) { }
+    void operator()()
+    {
+
+        while( running )
+        {
+            {
+                MTCircularBuffer<int>::BufferSlotConsumeAccess ca;
+                try
+                {
+                    buff.consume_next_available( ca );
+                } catch( MTCircularBuffer<int>::DataAvailableTimeout& ex )
+                {
+                    std::cout << "DataAvailableTimeout" << std::endl;
+                }
+
+                boost::this_thread::sleep(boost::posix_time::milliseconds(2000));
+            }
+        }
+    }
+    inline void kill()
+    {
+        running = false;
+    }
+
+    bool running;
+    MTCircularBuffer<int>& buff;
+};
+
+class SimpleReaderThread
+{
+public:
+    SimpleReaderThread( MTCircularBuffer<int>& _buff ) : running(true), buff(_buff) { }
+    void operator()()
+    {
+
+        while( running )
+        {
+            {
+                MTCircularBuffer<int>::BufferSlotReadAccess ra;
+                try
+                {
+                    buff.read_newest_available( ra );
+                } catch( ... )
+                {
+                }
+
+                boost::this_thread::sleep(boost::posix_time::milliseconds(600));
+            }
+        }
+    }
+    inline void kill()
+    {
+        running = false;
+    }
+
+    bool running;
+    MTCircularBuffer<int>& buff;
+};
+
+
+SCENARIO( "MultiThreaded single producer test", "[MT_Single_Producer]")
+{
+    GIVEN( "Buffer with 10 slots" ) {
+        std::cout << "MultiThreaded single producer test" << std::endl;
+        const int test_duration_sec=10;
+        MTCircularBuffer< int > buff(10);
+
+        SimpleProducerThread pr_thread( buff );
+        boost::thread pr_thread_t( boost::ref( pr_thread ) );
+
+        std::cout << std::endl;
+        for( int i=0; i<test_duration_sec*10; ++i )
+        {
+            std::cout << "\r\r" << buff.to_string() << "    ";
+            std::flush( std::cout );
+            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        }
+        std::cout << std::endl << "Killing producer thread..." << std::endl;
+        pr_thread.kill();
+        pr_thread_t.join();
+        std::cout << std::endl << "Test done." << std::endl;
+        REQUIRE(true);
+    }
+
+}
+
+SCENARIO( "MultiThreaded producer/consumer test", "[MT_Producer_consumer]")
+{
+    GIVEN( "Buffer with 10 slots" ) {
+        std::cout << "MultiThreaded producer/consumer test" << std::endl;
+
+        const int test_duration_sec=13;
+        MTCircularBuffer< int > buff(10);
+
+        SimpleProducerThread pr_thread( buff );
+        boost::thread pr_thread_t( boost::ref( pr_thread ) );
+        SimpleConsumerThread cn_thread( buff );
+        boost::thread cn_thread_t( boost::ref( cn_thread ) );
+
+        std::cout << std::endl;
+        for( int i=0; i<test_duration_sec*10; ++i )
+        {
+            std::cout << "\r\r" << buff.to_string() << "    ";
+            std::flush( std::cout );
+            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        }
+        std::cout << std::endl << "Killing producer thread..." << std::endl;
+        pr_thread.kill();
+        pr_thread_t.join();
+        std::cout << std::endl << "Killing consumer thread..." << std::endl;
+        cn_thread.kill();
+        cn_thread_t.join();
+        std::cout << std::endl << "Test done." << std::endl;
+        REQUIRE(true);
+    }
+}
+
+SCENARIO( "MultiThreaded producer/consumer/reader test", "[MT_Producer_consumer_reader]")
+{
+    GIVEN( "Buffer with 10 slots" ) {
+        std::cout << "MultiThreaded producer/consumer test" << std::endl;
+
+        const int test_duration_sec=15;
+        MTCircularBuffer< int > buff(10);
+
+        SimpleProducerThread pr_thread( buff );
+        boost::thread pr_thread_t( boost::ref( pr_thread ) );
+        SimpleConsumerThread cn_thread( buff );
+        boost::thread cn_thread_t( boost::ref( cn_thread ) );
+        SimpleReaderThread rd_thread( buff );
+        boost::thread rd_thread_t( boost::ref( rd_thread ) );
+
+        std::cout << std::endl;
+        for( int i=0; i<test_duration_sec*10; ++i )
+        {
+            std::cout << "\r\r" << buff.to_string() << "    ";
+            std::flush( std::cout );
+            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        }
+        std::cout << std::endl << "Killing reader thread..." << std::endl;
+        rd_thread.kill();
+        rd_thread_t.join();
+        std::cout << std::endl << "Killing producer thread..." << std::endl;
+        pr_thread.kill();
+        pr_thread_t.join();
+        std::cout << std::endl << "Killing consumer thread..." << std::endl;
+        cn_thread.kill();
+        cn_thread_t.join();
+        std::cout << std::endl << "Test done." << std::endl;
+        REQUIRE(true);
+    }
+
+}
+
+#if defined(MT_CIRCULAR_BUFFER_HAS_RT)
+
+typedef MTCircularBuffer< int, MTCircularBufferRTSync > RTBuffer;
+
+class RTConsumerThread
+{
+public:
+    RTConsumerThread( RTBuffer& _buff ) : running(true), consumed(0), buff(_buff) { }
+    void operator()()
+    {
+        while( running )
+        {
+            RTBuffer::BufferSlotConsumeAccess ca;
+            if( buff.try_consume_next_available( ca )==RTBuffer::ACQUIRE_OK )
+                ++consumed;
+        }
+    }
+    inline void kill()
+    {
+        running = false;
+    }
+
+    volatile bool running;
+    size_t consumed;
+    RTBuffer& buff;
+};
+
+SCENARIO( "Real-time write path", "[RT]")
+{
+    GIVEN( "A priority-inheritance buffer with 16 slots and a running consumer" ) {
+        RTBuffer buff(16);
+        RTConsumerThread cn_thread( buff );
+        boost::thread cn_thread_t( boost::ref( cn_thread ) );
+
+        // Try to run the producer as SCHED_FIFO (it silently stays SCHED_OTHER without privileges)
+        sched_param sp;
+        int old_policy;
+        sched_param old_sp;
+        pthread_getschedparam( pthread_self(), &old_policy, &old_sp );
+        sp.sched_priority = sched_get_priority_min( SCHED_FIFO );
+        pthread_setschedparam( pthread_self(), SCHED_FIFO, &sp );
+
+        WHEN("The producer writes 20000 items")
+        {
+            const int n_items = 20000;
+            boost::posix_time::time_duration worst_latency;
+            int failures = 0;
+
+            count_allocations = true;
+            num_allocations = 0;
+            for( int i=0; i<n_items; ++i )
+            {
+                const boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+                {
+                    RTBuffer::BufferSlotWriteAccess wa;
+                    if( buff.try_write_next( wa )==RTBuffer::ACQUIRE_OK )
+                        *(wa.data) = i;
+                    else
+                        ++failures;
+                }
+                const boost::posix_time::time_duration dt = boost::posix_time::microsec_clock::universal_time()-t0;
+                if( dt > worst_latency )
+                    worst_latency = dt;
+            }
+            count_allocations = false;
+
+            cn_thread.kill();
+            cn_thread_t.join();
+            pthread_setschedparam( pthread_self(), old_policy, &old_sp );
+
+            std::cout << "RT write path worst-case latency: " << worst_latency.total_microseconds() << " us" << std::endl;
+
+            THEN("No allocation occurred and the write latency is bounded")
+            {
+                REQUIRE( num_allocations == 0 );
+                REQUIRE( failures == 0 );
+                REQUIRE( worst_latency.total_milliseconds() < 20 );
+            }
+        }
+    }
+}
+
+#endif
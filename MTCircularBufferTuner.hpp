@@ -0,0 +1,207 @@
+/**
+  *  MTCircularBufferTuner recommends (and optionally applies) the capacity of a MTCircularBuffer
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  The tuner looks at the buffer statistics (see MTCircularBuffer::stats) over fixed time windows.
+  *  It keeps peaks of its own (see MTCircularBuffer::watch_peaks), so the peaks reported by stats()
+  *  are left untouched. At the end of each window it computes the capacity that would have held the
+  *  observed burst: the peak occupancy and the peak consumer lag, plus the overwritten items if the
+  *  buffer overflowed, times a headroom factor and clamped to [min_size,max_size]. The buffer grows as
+  *  soon as a window needs more slots. It shrinks only after shrink_windows consecutive windows that
+  *  needed less than half of the slots, or right away if it is larger than max_size.
+  *
+  *  The recommendation is published with MTCircularBuffer::set_recommended_size, and applied through
+  *  MTCircularBuffer::try_resize when apply is true. The tuner has no thread of its own: update()
+  *  must be called periodically, from a thread that is not holding a write access on the buffer.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    MTCircularBufferTuner< Sample > tuner( buff, 64, 65536, boost::posix_time::seconds(1), true );
+  *    ...
+  *    tuner.update();      // e.g. from a housekeeping loop
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_BUFFER_TUNER_HPP)
+#define MT_CIRCULAR_BUFFER_TUNER_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include "MTCircularBuffer.hpp"
+
+
+template < typename T, typename SYNC = MTCircularBufferDefaultSync >
+class MTCircularBufferTuner : private boost::noncopyable
+{
+public:
+
+    typedef MTCircularBuffer< T, SYNC > Buffer;
+
+    /**
+     * @brief Decision describes the outcome of the last completed window
+     */
+    struct Decision
+    {
+        size_t peak_occupancy;          // observed in the window
+        boost::uint64_t peak_lag;       // observed in the window
+        boost::uint64_t n_overwritten;  // in the window
+        size_t recommended_size;
+        bool applied;                   // true if the buffer was resized to recommended_size
+    };
+
+    /**
+     * @brief MTCircularBufferTuner constructs a tuner for buff
+     * @param _min_size Smallest recommended capacity
+     * @param _max_size Largest recommended capacity
+     * @param _window Length of the observation windows
+     * @param _apply If true, recommendations are applied with MTCircularBuffer::try_resize
+     * @param _headroom Factor applied to the observed need
+     * @param _shrink_windows Number of consecutive windows needing less than half the slots before shrinking
+     */
+    MTCircularBufferTuner( Buffer& _buff, size_t _min_size, size_t _max_size, const boost::posix_time::time_duration& _window,
+                           bool _apply, double _headroom = 1.5, size_t _shrink_windows = 4 ) :
+        buff( _buff ),
+        min_size( _min_size>0 ? _min_size : 1 ),
+        max_size( _max_size>_min_size ? _max_size : _min_size ),
+        window( _window ),
+        apply( _apply ),
+        headroom( _headroom>1.0 ? _headroom : 1.0 ),
+        shrink_windows( _shrink_windows ),
+        n_small_windows( 0 ),
+        n_windows( 0 )
+    {
+        buff.watch_peaks( peaks );
+        const typename Buffer::Stats st = buff.stats();
+        last_overwritten = st.n_overwritten;
+        window_start = boost::get_system_time();
+        last.peak_occupancy = 0;
+        last.peak_lag = 0;
+        last.n_overwritten = 0;
+        last.recommended_size = buff.size();
+        last.applied = false;
+    }
+
+    inline ~MTCircularBufferTuner()
+    {
+        buff.unwatch_peaks( peaks );
+    }
+
+    /**
+     * @brief update Closes the current window if it has elapsed, computes the recommendation and
+     *        applies it if enabled
+     * @return true if a window was completed (see last_decision)
+     */
+    inline bool update()
+    {
+        const boost::system_time now = boost::get_system_time();
+        if( now-window_start < window )
+            return false;
+        window_start = now;
+
+        typename Buffer::Stats st = buff.stats();
+        st.peak_occupancy = peaks.peak_occupancy.exchange( st.occupancy );
+        st.peak_lag = peaks.peak_lag.exchange( 0 );
+        evaluate( st );
+        return true;
+    }
+
+    /**
+     * @brief evaluate Computes the recommendation for a window with statistics st (st.n_overwritten
+     *        is cumulative, as returned by MTCircularBuffer::stats, and the peaks are the window ones).
+     *        Called by update()
+     */
+    inline void evaluate( const typename Buffer::Stats& st )
+    {
+        ++n_windows;
+        last.peak_occupancy = st.peak_occupancy;
+        last.peak_lag = st.peak_lag;
+        last.n_overwritten = st.n_overwritten-last_overwritten;
+        last_overwritten = st.n_overwritten;
+
+        boost::uint64_t need = st.peak_occupancy > st.peak_lag ? st.peak_occupancy : st.peak_lag;
+        if( last.n_overwritten > 0 && need < st.size+last.n_overwritten )
+            need = st.size+last.n_overwritten;
+        boost::uint64_t target = static_cast< boost::uint64_t >( need*headroom + 0.5 );
+        if( target < min_size )
+            target = min_size;
+        if( target > max_size )
+            target = max_size;
+
+        size_t recommended = st.size;
+        if( target > st.size )
+        {
+            recommended = static_cast< size_t >( target );
+            n_small_windows = 0;
+        }
+        else if( 2*target <= st.size )
+        {
+            if( ++n_small_windows >= shrink_windows )
+            {
+                recommended = static_cast< size_t >( target );
+                n_small_windows = 0;
+            }
+        }
+        else
+        {
+            n_small_windows = 0;
+        }
+        // The buffer may have been sized outside [min_size,max_size] by its owner
+        if( recommended > max_size )
+            recommended = max_size;
+        if( recommended < min_size )
+            recommended = min_size;
+
+        last.recommended_size = recommended;
+        last.applied = false;
+        buff.set_recommended_size( recommended );
+        if( apply && recommended != st.size )
+            last.applied = buff.try_resize( recommended )==Buffer::ACQUIRE_OK;
+    }
+
+    inline const Decision& last_decision() const { return last; }
+    inline size_t num_windows() const { return n_windows; }
+
+private:
+    Buffer& buff;
+    size_t min_size;
+    size_t max_size;
+    boost::posix_time::time_duration window;
+    bool apply;
+    double headroom;
+    size_t shrink_windows;
+    size_t n_small_windows;
+    size_t n_windows;
+    boost::uint64_t last_overwritten;
+    boost::system_time window_start;
+    typename Buffer::PeakWindow peaks;
+    Decision last;
+};
+
+
+#endif
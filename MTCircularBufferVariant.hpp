@@ -0,0 +1,165 @@
+/**
+  *  MTCircularBufferVariant carries several message types through one MTCircularBuffer, without heap allocations
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  A MTCircularBuffer< boost::variant< A, B, C > > (or std::variant, with C++17) stores in each slot a
+  *  type index and an inline storage large enough for the largest message type, so messages of
+  *  different types keep a single order without allocating one object per message (as a buffer of
+  *  shared pointers would).
+  *
+  *  write_next_as< M >() gains write access to the next slot and makes it hold a value-initialized M.
+  *  With std::variant the M is constructed in place, in the slot storage (see std::variant::emplace).
+  *  boost::variant has no emplace, so M() is assigned to the slot: messages should then be nothrow
+  *  copy constructible (plain structs), otherwise boost::variant may allocate a temporary backup
+  *  when the type held by a slot changes.
+  *
+  *  consume_next_visit() consumes the next slot and dispatches its message to a static visitor (see
+  *  boost::static_visitor), that has an operator() for each message type.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    typedef boost::variant< Position, Event > Message;
+  *    MTCircularBuffer< Message > buff( 1024 );
+  *    {
+  *        MTCircularBuffer< Message >::BufferSlotWriteAccess wa;
+  *        Position& p = write_next_as< Position >( buff, wa );
+  *        p.x = 1; p.y = 2;
+  *    }
+  *    struct Dispatcher : public boost::static_visitor<>
+  *    {
+  *        void operator()( const Position& p ) const { ... }
+  *        void operator()( const Event& e ) const { ... }
+  *    };
+  *    consume_next_visit( buff, Dispatcher() );
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_BUFFER_VARIANT_HPP)
+#define MT_CIRCULAR_BUFFER_VARIANT_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include "MTCircularBuffer.hpp"
+#include <boost/variant.hpp>
+
+#if __cplusplus >= 201703L
+    #include <variant>
+    #define MT_CIRCULAR_BUFFER_HAS_STD_VARIANT 1
+#endif
+
+
+/**
+ * @brief write_next_as gains write access to the next slot (see MTCircularBuffer::write_next) and
+ *        makes it hold a value-initialized M, by assigning M() to the slot (boost::variant has no
+ *        emplace). If the slot held another message type, that message is destroyed and the
+ *        temporary is copied in the same storage.
+ * @param wa A BufferSlotWriteAccess that will represent slot ownership
+ * @return the message to fill before wa is released
+ */
+template< typename M, typename VARIANT, typename SYNC >
+inline M& write_next_as( MTCircularBuffer< VARIANT, SYNC >& buff, typename MTCircularBuffer< VARIANT, SYNC >::BufferSlotWriteAccess& wa,
+                         bool* overwrite_occurred=0 )
+{
+    buff.write_next( wa, overwrite_occurred );
+    *(wa.data) = M();
+    return boost::get< M >( *(wa.data) );
+}
+
+/**
+ * @brief consume_next_visit consumes the least recently produced slot (see
+ *        MTCircularBuffer::consume_next_available) and applies visitor to its message, while the
+ *        slot is still owned
+ * @return the result of the visitor
+ */
+template< typename VARIANT, typename SYNC, typename VISITOR >
+inline typename VISITOR::result_type consume_next_visit( MTCircularBuffer< VARIANT, SYNC >& buff, const VISITOR& visitor )
+{
+    typename MTCircularBuffer< VARIANT, SYNC >::BufferSlotConsumeAccess ca;
+    buff.consume_next_available( ca );
+    return boost::apply_visitor( visitor, *(ca.data) );
+}
+
+/**
+ * @brief try_consume_next_visit same as consume_next_visit, but returns the failure reason instead
+ *        of throwing. The result of the visitor is discarded
+ */
+template< typename VARIANT, typename SYNC, typename VISITOR >
+inline typename MTCircularBuffer< VARIANT, SYNC >::AcquireResult try_consume_next_visit( MTCircularBuffer< VARIANT, SYNC >& buff, const VISITOR& visitor )
+{
+    typename MTCircularBuffer< VARIANT, SYNC >::BufferSlotConsumeAccess ca;
+    const typename MTCircularBuffer< VARIANT, SYNC >::AcquireResult res = buff.try_consume_next_available( ca );
+    if( res==MTCircularBuffer< VARIANT, SYNC >::ACQUIRE_OK )
+        boost::apply_visitor( visitor, *(ca.data) );
+    return res;
+}
+
+
+#if defined(MT_CIRCULAR_BUFFER_HAS_STD_VARIANT)
+
+/**
+ * @brief write_next_as same as above for std::variant slots: if the slot held another message type,
+ *        that message is destroyed and M is constructed in place, in the same storage
+ */
+template< typename M, typename SYNC, typename... TYPES >
+inline M& write_next_as( MTCircularBuffer< std::variant< TYPES... >, SYNC >& buff, typename MTCircularBuffer< std::variant< TYPES... >, SYNC >::BufferSlotWriteAccess& wa,
+                         bool* overwrite_occurred=0 )
+{
+    buff.write_next( wa, overwrite_occurred );
+    return wa.data->template emplace< M >();
+}
+
+/**
+ * @brief consume_next_visit same as above for std::variant slots (see std::visit)
+ */
+template< typename SYNC, typename VISITOR, typename... TYPES >
+inline typename VISITOR::result_type consume_next_visit( MTCircularBuffer< std::variant< TYPES... >, SYNC >& buff, const VISITOR& visitor )
+{
+    typename MTCircularBuffer< std::variant< TYPES... >, SYNC >::BufferSlotConsumeAccess ca;
+    buff.consume_next_available( ca );
+    return std::visit( visitor, *(ca.data) );
+}
+
+/**
+ * @brief try_consume_next_visit same as above for std::variant slots (see std::visit)
+ */
+template< typename SYNC, typename VISITOR, typename... TYPES >
+inline typename MTCircularBuffer< std::variant< TYPES... >, SYNC >::AcquireResult try_consume_next_visit( MTCircularBuffer< std::variant< TYPES... >, SYNC >& buff, const VISITOR& visitor )
+{
+    typedef MTCircularBuffer< std::variant< TYPES... >, SYNC > Buffer;
+    typename Buffer::BufferSlotConsumeAccess ca;
+    const typename Buffer::AcquireResult res = buff.try_consume_next_available( ca );
+    if( res==Buffer::ACQUIRE_OK )
+        std::visit( visitor, *(ca.data) );
+    return res;
+}
+
+#endif
+
+
+#endif
@@ -0,0 +1,424 @@
+/**
+  *  MTCircularBufferWorkload drives a MTCircularBuffer with a configurable traffic shape
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  A workload starts producer, consumer and reader threads on a buffer for a given duration. Producers
+  *  write bursts of items at a given rate (or as fast as possible), consumers and readers hold each
+  *  access for a given time, and every thread can be pinned to a CPU. Items are MTWorkloadItem< BYTES >:
+  *  each one carries its publication time, so that consumers can measure the latency.
+  *
+  *  The buffer is created by the caller, so any configuration (size, sync policy, prefetch, snapshots...)
+  *  can be driven. At the end, run() returns a MTWorkloadReport with throughput, lost and overwritten
+  *  items and latency percentiles.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    MTCircularBuffer< MTWorkloadItem< 256 > > buff( 1024 );
+  *    MTWorkloadConfig cfg;
+  *    cfg.n_producers = 2;
+  *    cfg.rate = 50000;          // items per second, per producer
+  *    cfg.burst_size = 64;
+  *    cfg.duration = boost::posix_time::seconds(10);
+  *    MTWorkloadReport report = MTCircularBufferWorkload< 256 >( buff, cfg ).run();
+  *    std::cout << report.to_string() << std::endl;
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_BUFFER_WORKLOAD_HPP)
+#define MT_CIRCULAR_BUFFER_WORKLOAD_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include "MTCircularBuffer.hpp"
+#include <boost/cstdint.hpp>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+    #include <sched.h>
+#endif
+
+
+/**
+ * @brief MTWorkloadItem is the item written by the workload producers
+ */
+template< size_t BYTES >
+struct MTWorkloadItem
+{
+    boost::int64_t published_us;    // publication time, relative to the workload start
+    boost::uint64_t seq;            // per-producer sequence number
+    char payload[ BYTES ];
+};
+
+/**
+ * @brief MTWorkloadConfig describes the traffic shape of a workload
+ */
+struct MTWorkloadConfig
+{
+    MTWorkloadConfig() : n_producers(1), n_consumers(1), n_readers(0), rate(0), burst_size(1), payload_bytes(0),
+        consumer_hold(0,0,0), reader_hold(0,0,0), duration(0,0,1) {}
+
+    size_t n_producers;
+    size_t n_consumers;
+    size_t n_readers;       // threads reading the newest item (see MTCircularBuffer::read_newest_available)
+    double rate;            // items per second written by each producer (0: as fast as possible)
+    size_t burst_size;      // items written back to back; bursts are spaced so that the rate is kept
+    size_t payload_bytes;   // payload bytes written and read for each item (at most the item payload)
+    boost::posix_time::time_duration consumer_hold;     // time a consume access is held
+    boost::posix_time::time_duration reader_hold;       // time a read access is held
+    boost::posix_time::time_duration duration;
+    std::vector< int > cpus;    // threads are pinned round-robin to these CPUs (Linux only, empty: no pinning)
+};
+
+/**
+ * @brief MTLatencyHistogram counts latencies in microseconds with a relative error below 1/32
+ *        (exact below 64 us). Storage is allocated once, at construction.
+ */
+class MTLatencyHistogram
+{
+public:
+    enum { SUB_BUCKETS = 32, N_BUCKETS = 64+SUB_BUCKETS*58 };
+
+    MTLatencyHistogram() : counts( N_BUCKETS, 0 ), n(0), max_us(0) {}
+
+    inline void record( boost::uint64_t us )
+    {
+        counts[ bucket_of( us ) ]++;
+        ++n;
+        if( us > max_us )
+            max_us = us;
+    }
+
+    inline void merge( const MTLatencyHistogram& other )
+    {
+        for( size_t b=0; b<N_BUCKETS; ++b )
+            counts[b] += other.counts[b];
+        n += other.n;
+        if( other.max_us > max_us )
+            max_us = other.max_us;
+    }
+
+    /**
+     * @return the latency below which a fraction p of the samples fall (upper bound of its bucket)
+     */
+    inline boost::uint64_t percentile( double p ) const
+    {
+        if( n==0 )
+            return 0;
+        boost::uint64_t rank = static_cast< boost::uint64_t >( p*n + 0.5 );
+        if( rank==0 )
+            rank = 1;
+        boost::uint64_t seen = 0;
+        for( size_t b=0; b<N_BUCKETS; ++b )
+        {
+            seen += counts[b];
+            if( seen >= rank )
+            {
+                const boost::uint64_t bound = upper_bound_of( b );
+                return bound < max_us ? bound : max_us;
+            }
+        }
+        return max_us;
+    }
+
+    inline boost::uint64_t count() const { return n; }
+    inline boost::uint64_t max() const { return max_us; }
+
+private:
+    static inline size_t bucket_of( boost::uint64_t us )
+    {
+        if( us < 64 )
+            return static_cast< size_t >( us );
+        size_t e = 6;
+        while( e < 63 && ( us >> (e+1) )!=0 )
+            ++e;
+        const size_t b = 64 + (e-6)*SUB_BUCKETS + static_cast< size_t >( ( us >> (e-5) ) & (SUB_BUCKETS-1) );
+        return b < N_BUCKETS ? b : N_BUCKETS-1;
+    }
+
+    static inline boost::uint64_t upper_bound_of( size_t b )
+    {
+        if( b < 64 )
+            return b;
+        const size_t e = 6 + (b-64)/SUB_BUCKETS;
+        const boost::uint64_t sub = (b-64)%SUB_BUCKETS;
+        return ( ( static_cast< boost::uint64_t >(SUB_BUCKETS)+sub+1 ) << (e-5) ) - 1;
+    }
+
+    std::vector< boost::uint64_t > counts;
+    boost::uint64_t n;
+    boost::uint64_t max_us;
+};
+
+/**
+ * @brief MTWorkloadReport is the outcome of a workload run
+ */
+struct MTWorkloadReport
+{
+    double seconds;
+    boost::uint64_t n_produced;
+    boost::uint64_t n_consumed;
+    boost::uint64_t n_read;
+    boost::uint64_t n_overwritten;      // items overwritten before being consumed
+    boost::uint64_t n_lost;             // items produced and never consumed (overwritten or left in the buffer)
+    boost::uint64_t n_write_timeouts;
+    double throughput;                  // consumed items per second
+    boost::uint64_t latency_us_p50;     // time between publication and consumption
+    boost::uint64_t latency_us_p90;
+    boost::uint64_t latency_us_p99;
+    boost::uint64_t latency_us_p999;
+    boost::uint64_t latency_us_max;
+
+    inline std::string to_string() const
+    {
+        std::stringstream ss;
+        ss << "produced " << n_produced << ", consumed " << n_consumed << " (" << static_cast< boost::uint64_t >( throughput ) << " items/s)"
+           << ", read " << n_read << ", lost " << n_lost << ", overwritten " << n_overwritten << ", write timeouts " << n_write_timeouts
+           << ", latency us p50 " << latency_us_p50 << " p90 " << latency_us_p90 << " p99 " << latency_us_p99
+           << " p99.9 " << latency_us_p999 << " max " << latency_us_max;
+        return ss.str();
+    }
+};
+
+
+template< size_t BYTES, typename SYNC = MTCircularBufferDefaultSync >
+class MTCircularBufferWorkload : private boost::noncopyable
+{
+public:
+
+    typedef MTWorkloadItem< BYTES > Item;
+    typedef MTCircularBuffer< Item, SYNC > Buffer;
+
+    MTCircularBufferWorkload( Buffer& _buff, const MTWorkloadConfig& _cfg ) : buff( _buff ), cfg( _cfg ), stop( false ), n_running_producers( 0 ), payload_checksum( 0 )
+    {
+        if( cfg.payload_bytes > BYTES )
+            cfg.payload_bytes = BYTES;
+        if( cfg.burst_size==0 )
+            cfg.burst_size = 1;
+    }
+
+    /**
+     * @brief run starts the threads, waits for the configured duration, stops them and reports.
+     *        Items left in the buffer by a previous run are counted as produced and lost.
+     */
+    inline MTWorkloadReport run()
+    {
+        stop = false;
+        producers.assign( cfg.n_producers, ThreadCounters() );
+        consumers.assign( cfg.n_consumers, ThreadCounters() );
+        readers.assign( cfg.n_readers, ThreadCounters() );
+        const boost::uint64_t overwritten_before = buff.stats().n_overwritten;
+        start = boost::get_system_time();
+
+        size_t n_threads = 0;
+        boost::thread_group threads;
+        n_running_producers = cfg.n_producers;
+        for( size_t i=0; i<cfg.n_producers; ++i )
+            threads.create_thread( Runner( *this, &MTCircularBufferWorkload::produce, producers[i], n_threads++ ) );
+        for( size_t i=0; i<cfg.n_consumers; ++i )
+            threads.create_thread( Runner( *this, &MTCircularBufferWorkload::consume, consumers[i], n_threads++ ) );
+        for( size_t i=0; i<cfg.n_readers; ++i )
+            threads.create_thread( Runner( *this, &MTCircularBufferWorkload::read, readers[i], n_threads++ ) );
+
+        boost::this_thread::sleep( start+cfg.duration );
+        stop = true;
+        threads.join_all();
+        const boost::posix_time::time_duration elapsed = boost::get_system_time()-start;
+
+        MTWorkloadReport report;
+        MTLatencyHistogram latency;
+        report.seconds = elapsed.total_microseconds()*1E-6;
+        report.n_produced = report.n_consumed = report.n_read = report.n_write_timeouts = 0;
+        for( size_t i=0; i<producers.size(); ++i )
+        {
+            report.n_produced += producers[i].n_items;
+            report.n_write_timeouts += producers[i].n_timeouts;
+        }
+        for( size_t i=0; i<consumers.size(); ++i )
+        {
+            report.n_consumed += consumers[i].n_items;
+            latency.merge( consumers[i].latency );
+        }
+        for( size_t i=0; i<readers.size(); ++i )
+            report.n_read += readers[i].n_items;
+        payload_checksum = 0;
+        for( size_t i=0; i<consumers.size(); ++i )
+            payload_checksum += consumers[i].checksum;
+        for( size_t i=0; i<readers.size(); ++i )
+            payload_checksum += readers[i].checksum;
+        report.n_overwritten = buff.stats().n_overwritten-overwritten_before;
+        report.n_lost = report.n_produced > report.n_consumed ? report.n_produced-report.n_consumed : 0;
+        report.throughput = report.seconds > 0 ? report.n_consumed/report.seconds : 0;
+        report.latency_us_p50 = latency.percentile( 0.5 );
+        report.latency_us_p90 = latency.percentile( 0.9 );
+        report.latency_us_p99 = latency.percentile( 0.99 );
+        report.latency_us_p999 = latency.percentile( 0.999 );
+        report.latency_us_max = latency.max();
+        return report;
+    }
+
+private:
+
+    struct ThreadCounters
+    {
+        ThreadCounters() : n_items(0), n_timeouts(0), checksum(0) {}
+        boost::uint64_t n_items;
+        boost::uint64_t n_timeouts;
+        size_t checksum;                // of the payload bytes read, combined after the threads are joined
+        MTLatencyHistogram latency;
+    };
+
+    typedef void ( MTCircularBufferWorkload::*Body )( ThreadCounters& );
+
+    struct Runner
+    {
+        Runner( MTCircularBufferWorkload& _w, Body _body, ThreadCounters& _counters, size_t _thread ) : w(&_w), body(_body), counters(&_counters), thread(_thread) {}
+        void operator()()
+        {
+            w->pin( thread );
+            (w->*body)( *counters );
+        }
+        MTCircularBufferWorkload* w;
+        Body body;
+        ThreadCounters* counters;
+        size_t thread;
+    };
+
+    inline boost::int64_t now_us() const
+    {
+        return ( boost::get_system_time()-start ).total_microseconds();
+    }
+
+    inline void pin( size_t thread )
+    {
+#if defined(__linux__)
+        if( cfg.cpus.empty() )
+            return;
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cfg.cpus[ thread%cfg.cpus.size() ], &set );
+        pthread_setaffinity_np( pthread_self(), sizeof(set), &set );
+#else
+        (void)thread;
+#endif
+    }
+
+    inline void produce( ThreadCounters& counters )
+    {
+        const boost::int64_t burst_period_us = cfg.rate > 0 ? static_cast< boost::int64_t >( cfg.burst_size*1E6/cfg.rate ) : 0;
+        boost::int64_t next_burst_us = 0;
+        while( !stop )
+        {
+            for( size_t i=0; i<cfg.burst_size && !stop; ++i )
+            {
+                typename Buffer::BufferSlotWriteAccess wa;
+                if( buff.try_write_next( wa )!=Buffer::ACQUIRE_OK )
+                {
+                    counters.n_timeouts++;
+                    continue;
+                }
+                std::memset( wa.data->payload, static_cast< int >( counters.n_items ), cfg.payload_bytes );
+                wa.data->seq = counters.n_items++;
+                wa.data->published_us = now_us();
+            }
+            if( burst_period_us > 0 )
+            {
+                // Absolute schedule, so that a late burst does not shift the following ones
+                next_burst_us += burst_period_us;
+                const boost::int64_t wait_us = next_burst_us-now_us();
+                if( wait_us > 0 )
+                    boost::this_thread::sleep( boost::posix_time::microseconds( wait_us ) );
+            }
+        }
+
+        // The last producer wakes up the consumers waiting for data, with items that are not counted
+        if( --n_running_producers==0 )
+        {
+            for( size_t i=0; i<cfg.n_consumers; ++i )
+            {
+                typename Buffer::BufferSlotWriteAccess wa;
+                if( buff.try_write_next( wa )==Buffer::ACQUIRE_OK )
+                    wa.data->published_us = -1;
+            }
+        }
+    }
+
+    inline void consume( ThreadCounters& counters )
+    {
+        size_t checksum = 0;
+        while( !stop || n_running_producers>0 )
+        {
+            typename Buffer::BufferSlotConsumeAccess ca;
+            if( buff.try_consume_next_available( ca )!=Buffer::ACQUIRE_OK )
+                continue;
+            if( ca.data->published_us < 0 )
+                continue;
+            const boost::int64_t latency = now_us()-ca.data->published_us;
+            counters.latency.record( latency > 0 ? static_cast< boost::uint64_t >( latency ) : 0 );
+            counters.n_items++;
+            for( size_t k=0; k<cfg.payload_bytes; k+=MT_CIRCULAR_BUFFER_CACHE_LINE )
+                checksum += ca.data->payload[k];
+            if( cfg.consumer_hold.total_microseconds() > 0 )
+                boost::this_thread::sleep( cfg.consumer_hold );
+        }
+        counters.checksum = checksum;
+    }
+
+    inline void read( ThreadCounters& counters )
+    {
+        size_t checksum = 0;
+        while( !stop )
+        {
+            typename Buffer::BufferSlotReadAccess ra;
+            if( buff.try_read_newest_available( ra )!=Buffer::ACQUIRE_OK )
+                continue;
+            counters.n_items++;
+            for( size_t k=0; k<cfg.payload_bytes; k+=MT_CIRCULAR_BUFFER_CACHE_LINE )
+                checksum += ra.data->payload[k];
+            if( cfg.reader_hold.total_microseconds() > 0 )
+                boost::this_thread::sleep( cfg.reader_hold );
+        }
+        counters.checksum = checksum;
+    }
+
+    Buffer& buff;
+    MTWorkloadConfig cfg;
+    boost::system_time start;
+    boost::atomic< bool > stop;
+    boost::atomic< size_t > n_running_producers;
+    std::vector< ThreadCounters > producers;
+    std::vector< ThreadCounters > consumers;
+    std::vector< ThreadCounters > readers;
+    size_t payload_checksum;        // keeps the payload reads from being optimized away
+};
+
+
+#endif
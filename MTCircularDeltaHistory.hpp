@@ -0,0 +1,415 @@
+/**
+  *  MTCircularDeltaHistory is a compact history ring for slowly varying numeric records
+  * ---------------------------------------------------------------------------------------------------
+  *
+  *  Each record is made of FIELDS values of an arithmetic type T. Records are stored in a byte ring
+  *  as differences against their predecessor:
+  *
+  *  - integer fields are stored as zig-zag encoded varint deltas
+  *  - floating point fields are XORed with the previous value (as in Gorilla) and only the
+  *    significant bytes of the result are stored, after a one byte header
+  *
+  *  The ring is split into fixed-size blocks. The first record of each block is stored verbatim,
+  *  so that blocks can be decoded independently and the oldest block can be dropped when the ring
+  *  is full. Records are decoded on read.
+  *
+  *  Like MTCircularBuffer, MTCircularDeltaHistory supports a single producer and multiple readers.
+  *
+  *  Basic Usage:
+  *
+  *   ```
+  *    MTCircularDeltaHistory< double, 3 > history( 64*1024*1024 ); // 64 MB of compressed records
+  *
+  *    double rec[3] = { x, y, z };
+  *    history.push( rec );
+  *
+  *    double out[3];
+  *    if( history.read( seq, out ) == MTCircularDeltaHistory< double, 3 >::READ_OK )
+  *        ...
+  *   ```
+  *
+  * The MIT License (MIT)
+  * Copyright (c) 2015 Filippo Bergamasco
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in
+  * all copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  * THE SOFTWARE.
+  *
+  */
+
+#if !defined(MT_CIRCULAR_DELTA_HISTORY_HPP)
+#define MT_CIRCULAR_DELTA_HISTORY_HPP
+
+#if defined(_MSC_VER) && _MSC_VER >= 1200
+    #pragma once
+#endif
+
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/type_traits/conditional.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+#include <boost/type_traits/is_arithmetic.hpp>
+#include <boost/type_traits/is_floating_point.hpp>
+#include <boost/type_traits/is_signed.hpp>
+#include <cstring>
+#include <vector>
+
+
+template < typename T, size_t FIELDS = 1 >
+class MTCircularDeltaHistory : private boost::noncopyable
+{
+    BOOST_STATIC_ASSERT( boost::is_arithmetic<T>::value );
+    BOOST_STATIC_ASSERT( sizeof(T) <= 8 );
+    BOOST_STATIC_ASSERT( FIELDS > 0 );
+
+public:
+
+    typedef boost::uint64_t seq_type;
+
+    /**
+     * @brief ReadResult is returned by the read methods
+     */
+    enum ReadResult
+    {
+        READ_OK = 0,
+        READ_TOO_OLD,   // the requested record has been dropped to make room for newer ones
+        READ_NOT_YET    // the requested record has not been pushed yet
+    };
+
+    static const size_t RECORD_BYTES = FIELDS*sizeof(T);
+
+    /**
+     * @brief MTCircularDeltaHistory constructs a new history ring
+     * @param capacity_bytes Size of the byte ring (rounded down to a multiple of block_bytes, at least 2 blocks)
+     * @param block_bytes Size of each independently decodable block. Reading a record decodes, on
+     *        average, half a block
+     */
+    inline explicit MTCircularDeltaHistory( size_t capacity_bytes, size_t block_bytes = 4096 ) :
+        block_size( block_bytes > 4*RECORD_BYTES ? block_bytes : 4*RECORD_BYTES ),
+        blocks( capacity_bytes/block_size > 2 ? capacity_bytes/block_size : 2 ),
+        bytes( blocks.size()*block_size ),
+        oldest_block(0), n_live_blocks(0), w_seq(0)
+    {
+        std::memset( last, 0, sizeof(last) );
+    }
+
+    /**
+     * @brief push Appends a record, dropping the oldest block if the ring is full
+     * @param record Pointer to FIELDS values
+     * @return sequence number of the record
+     */
+    inline seq_type push( const T* record )
+    {
+        unsigned char encoded[ FIELDS*(sizeof(T)+2) ];
+        size_t n_encoded = 0;
+        for( size_t f=0; f<FIELDS; ++f )
+            n_encoded += encode( last[f], record[f], encoded+n_encoded, boost::is_floating_point<T>() );
+
+        boost::unique_lock< boost::shared_mutex > lock( mtx );
+
+        Block* blk = n_live_blocks>0 ? &blocks[ newest_block() ] : 0;
+        if( blk==0 || blk->used+n_encoded > block_size )
+        {
+            blk = &open_block();
+            std::memcpy( block_data(*blk), record, RECORD_BYTES );  // key frame
+            blk->used = RECORD_BYTES;
+        }
+        else
+        {
+            std::memcpy( block_data(*blk)+blk->used, encoded, n_encoded );
+            blk->used += n_encoded;
+        }
+        blk->count++;
+
+        std::memcpy( last, record, RECORD_BYTES );
+        return w_seq++;
+    }
+
+    /**
+     * @brief push Appends a single-field record
+     */
+    inline seq_type push( const T& value )
+    {
+        BOOST_STATIC_ASSERT( FIELDS==1 );
+        return push( &value );
+    }
+
+    /**
+     * @brief read Decodes the record with a given sequence number
+     * @param seq Sequence number returned by push
+     * @param record Pointer to FIELDS values, filled with the record
+     */
+    inline ReadResult read( seq_type seq, T* record ) const
+    {
+        size_t n_read;
+        const ReadResult res = read_range( seq, 1, record, &n_read );
+        return res;
+    }
+
+    /**
+     * @brief read_range Decodes up to count consecutive records, starting from the record first
+     * @param records Pointer to count*FIELDS values
+     * @param n_read If not null, is set to the number of decoded records
+     * @return READ_OK if at least one record was decoded
+     */
+    inline ReadResult read_range( seq_type first, size_t count, T* records, size_t* n_read=0 ) const
+    {
+        if( n_read )
+            *n_read = 0;
+
+        boost::shared_lock< boost::shared_mutex > lock( mtx );
+        if( first >= w_seq )
+            return READ_NOT_YET;
+        if( n_live_blocks==0 || first < blocks[oldest_block].first_seq )
+            return READ_TOO_OLD;
+
+        // Binary search for the block containing first (blocks are sorted by sequence number)
+        size_t lo = 0, hi = n_live_blocks-1;
+        while( lo < hi )
+        {
+            const size_t mid = (lo+hi+1)/2;
+            if( blocks[ live_block(mid) ].first_seq <= first )
+                lo = mid;
+            else
+                hi = mid-1;
+        }
+
+        size_t done = 0;
+        for( size_t b=lo; b<n_live_blocks && done<count; ++b )
+        {
+            const Block& blk = blocks[ live_block(b) ];
+            const seq_type skip = first+done > blk.first_seq ? first+done-blk.first_seq : 0;
+            done += decode_block( blk, static_cast<size_t>(skip), count-done, records+done*FIELDS );
+        }
+
+        if( n_read )
+            *n_read = done;
+        return READ_OK;
+    }
+
+    /**
+     * @return the sequence number that will be given to the next record
+     */
+    inline seq_type next_seq() const
+    {
+        boost::shared_lock< boost::shared_mutex > lock( mtx );
+        return w_seq;
+    }
+
+    /**
+     * @return the sequence number of the oldest stored record
+     */
+    inline seq_type oldest_seq() const
+    {
+        boost::shared_lock< boost::shared_mutex > lock( mtx );
+        return n_live_blocks>0 ? blocks[oldest_block].first_seq : w_seq;
+    }
+
+    /**
+     * @return number of stored records
+     */
+    inline seq_type size() const
+    {
+        boost::shared_lock< boost::shared_mutex > lock( mtx );
+        return n_live_blocks>0 ? w_seq-blocks[oldest_block].first_seq : 0;
+    }
+
+    /**
+     * @return number of bytes of the ring (the memory used by the records)
+     */
+    inline size_t capacity_bytes() const { return bytes.size(); }
+
+    /**
+     * @return average number of bytes used by each stored record
+     */
+    inline double bytes_per_record() const
+    {
+        boost::shared_lock< boost::shared_mutex > lock( mtx );
+        size_t used = 0;
+        seq_type count = 0;
+        for( size_t b=0; b<n_live_blocks; ++b )
+        {
+            used += blocks[ live_block(b) ].used;
+            count += blocks[ live_block(b) ].count;
+        }
+        return count>0 ? double(used)/double(count) : 0.0;
+    }
+
+private:
+
+    struct Block
+    {
+        Block() : first_seq(0), count(0), used(0) {}
+        seq_type first_seq;
+        size_t count;
+        size_t used;
+    };
+
+    typedef typename boost::conditional< sizeof(T)<=4, boost::uint32_t, boost::uint64_t >::type bits_type;
+
+    inline size_t live_block( size_t i ) const { return (oldest_block+i)%blocks.size(); }
+    inline size_t newest_block() const { return live_block( n_live_blocks-1 ); }
+    inline unsigned char* block_data( const Block& blk ) { return &bytes[ (&blk-&blocks[0])*block_size ]; }
+    inline const unsigned char* block_data( const Block& blk ) const { return &bytes[ (&blk-&blocks[0])*block_size ]; }
+
+    inline Block& open_block()
+    {
+        if( n_live_blocks==blocks.size() )
+        {
+            oldest_block = (oldest_block+1)%blocks.size();
+            n_live_blocks--;
+        }
+        n_live_blocks++;
+        Block& blk = blocks[ newest_block() ];
+        blk.first_seq = w_seq;
+        blk.count = 0;
+        blk.used = 0;
+        return blk;
+    }
+
+    /**
+     * @brief decode_block Decodes count records of a block, after skipping the first skip records
+     * @return number of decoded records
+     */
+    inline size_t decode_block( const Block& blk, size_t skip, size_t count, T* out ) const
+    {
+        const unsigned char* p = block_data( blk );
+        T curr[ FIELDS ];
+        std::memcpy( curr, p, RECORD_BYTES );
+        p += RECORD_BYTES;
+
+        size_t done = 0;
+        for( size_t r=0; r<blk.count && done<count; ++r )
+        {
+            if( r>0 )
+            {
+                for( size_t f=0; f<FIELDS; ++f )
+                    p = decode( curr[f], p, boost::is_floating_point<T>() );
+            }
+            if( r>=skip )
+            {
+                std::memcpy( out+done*FIELDS, curr, RECORD_BYTES );
+                ++done;
+            }
+        }
+        return done;
+    }
+
+    // Integer fields: zig-zag varint of the delta
+
+    static inline boost::uint64_t to_u64( T v ) { return static_cast<boost::uint64_t>( static_cast<typename boost::conditional< boost::is_signed<T>::value, boost::int64_t, boost::uint64_t >::type>( v ) ); }
+
+    static inline size_t encode( const T& prev, const T& curr, unsigned char* out, boost::false_type )
+    {
+        const boost::int64_t delta = static_cast<boost::int64_t>( to_u64(curr)-to_u64(prev) );
+        boost::uint64_t zz = ( static_cast<boost::uint64_t>(delta) << 1 ) ^ static_cast<boost::uint64_t>( delta >> 63 );
+        size_t n = 0;
+        while( zz >= 0x80 )
+        {
+            out[n++] = static_cast<unsigned char>( zz | 0x80 );
+            zz >>= 7;
+        }
+        out[n++] = static_cast<unsigned char>( zz );
+        return n;
+    }
+
+    static inline const unsigned char* decode( T& value, const unsigned char* in, boost::false_type )
+    {
+        boost::uint64_t zz = 0;
+        unsigned shift = 0;
+        while( *in & 0x80 )
+        {
+            zz |= static_cast<boost::uint64_t>( *in++ & 0x7F ) << shift;
+            shift += 7;
+        }
+        zz |= static_cast<boost::uint64_t>( *in++ ) << shift;
+        const boost::uint64_t delta = (zz >> 1) ^ (~(zz & 1)+1);
+        value = static_cast<T>( to_u64(value)+delta );
+        return in;
+    }
+
+    // Floating point fields: XOR with the previous value, significant bytes only.
+    // Header byte: (trailing zero bytes << 4) | significant bytes, 0 if the value did not change
+
+    static inline size_t encode( const T& prev, const T& curr, unsigned char* out, boost::true_type )
+    {
+        bits_type a, b;
+        std::memcpy( &a, &prev, sizeof(T) );
+        std::memcpy( &b, &curr, sizeof(T) );
+        bits_type x = a^b;
+        if( x==0 )
+        {
+            out[0] = 0;
+            return 1;
+        }
+
+        unsigned trailing = 0;
+        while( (x & 0xFF)==0 )
+        {
+            x >>= 8;
+            ++trailing;
+        }
+        unsigned significant = 0;
+        while( x != 0 )
+        {
+            out[1+significant++] = static_cast<unsigned char>( x & 0xFF );
+            x >>= 8;
+        }
+        out[0] = static_cast<unsigned char>( (trailing<<4) | significant );
+        return 1+significant;
+    }
+
+    static inline const unsigned char* decode( T& value, const unsigned char* in, boost::true_type )
+    {
+        const unsigned header = *in++;
+        if( header==0 )
+            return in;
+
+        const unsigned trailing = header >> 4;
+        const unsigned significant = header & 0x0F;
+        bits_type x = 0;
+        for( unsigned i=0; i<significant; ++i )
+            x |= static_cast<bits_type>( in[i] ) << (8*i);
+        x <<= 8*trailing;
+
+        bits_type bits;
+        std::memcpy( &bits, &value, sizeof(T) );
+        bits ^= x;
+        std::memcpy( &value, &bits, sizeof(T) );
+        return in+significant;
+    }
+
+    const size_t block_size;
+    std::vector< Block > blocks;
+    std::vector< unsigned char > bytes;
+    size_t oldest_block;
+    size_t n_live_blocks;
+    seq_type w_seq;
+    T last[ FIELDS ];
+
+    mutable boost::shared_mutex mtx;
+};
+
+template < typename T, size_t FIELDS >
+const size_t MTCircularDeltaHistory< T, FIELDS >::RECORD_BYTES;
+
+
+#endif